@@ -0,0 +1,18 @@
+; Tight `while` loops: count the steps of the collatz sequence of every
+; number up to a limit, like the `collatz` example in examples/loops.lisp.
+; An operation is one number.
+(define bench-ops 10000)
+
+(defun collatz-steps (n) (do
+    (define steps 0)
+    (while (!= n 1)
+        (if (% n 2)
+            (define n (+ (* 3 n) 1))
+            (define n (/ n 2)))
+        (define steps (+ steps 1)))
+    steps))
+
+(define total 0)
+(for n (range 1 (+ bench-ops 1))
+    (define total (+ total (collatz-steps n))))
+(print total)
@@ -0,0 +1,52 @@
+; A library of small helpers, for the startup benchmark to include
+
+(defun inc (n) (+ n 1))
+(defun dec (n) (- n 1))
+(defun not (x) (if x 0 1))
+(defun neg (n) (- 0 n))
+(defun abs (n) (if (< n 0) (neg n) n))
+(defun square (n) (* n n))
+(defun cube (n) (* n n n))
+(defun is-pos (n) (> n 0))
+(defun is-neg (n) (< n 0))
+(defun is-zero (n) (= n 0))
+(defun is-odd (n) (% n 2))
+(defun is-even (n) (not (is-odd n)))
+(defun min2 (a b) (if (< a b) a b))
+(defun max2 (a b) (if (> a b) a b))
+(defun clamp (n low high) (min2 (max2 n low) high))
+(defun sign (n) (if (> n 0) 1 (if (< n 0) -1 0)))
+(defun const (n) (lambda (_) n))
+(defun compose (f g) (lambda (x) (f (g x))))
+(defun twice (f) (compose f f))
+(defun flip (f) (lambda (a b) (f b a)))
+
+(defun sum-of (l) (reduce + 0 l))
+(defun product-of (l) (reduce * 1 l))
+(defun count-if (f l) (len (filter f l)))
+(defun any (f l) (> (count-if f l) 0))
+(defun all (f l) (= (count-if f l) (len l)))
+(defun last (l) (index l (dec (len l))))
+(defun take (l n) (if (<= n 0) '() (if (= (len l) 0) '() (push (take (tail l) (dec n)) (first l)))))
+(defun drop (l n) (if (<= n 0) l (if (= (len l) 0) '() (drop (tail l) (dec n)))))
+(defun reverse-of (l) (reduce (lambda (acc x) (insert acc 0 x)) '() l))
+(defun range-to (n) (range 0 n))
+(defun squares-to (n) (map square (range-to n)))
+(defun evens-to (n) (filter is-even (range-to n)))
+(defun odds-to (n) (filter is-odd (range-to n)))
+
+(defun fact (n) (if (<= n 1) 1 (* n (fact (dec n)))))
+(defun fib (n) (if (<= n 1) n (+ (fib (- n 1)) (fib (- n 2)))))
+(defun gcd (a b) (if (= b 0) a (gcd b (% a b))))
+(defun lcm (a b) (/ (* a b) (gcd a b)))
+(defun pow (n exp) (if (= exp 0) 1 (* n (pow n (dec exp)))))
+(defun is-prime (n)
+    (if (< n 2)
+        0
+        (not (any (lambda (d) (= (% n d) 0)) (range 2 n)))))
+
+(defun repeat (s n) (if (<= n 0) "" (+ s (repeat s (dec n)))))
+(defun words-of (s) (split s " "))
+(defun unwords (l) (join l " "))
+(defun lines-of (s) (split s endl))
+(defun unlines (l) (join l endl))
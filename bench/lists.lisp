@@ -0,0 +1,12 @@
+; `map`, `filter`, and `reduce` over big ranges.
+; An operation is one item of a range.
+(define size 100000)
+(define runs 5)
+(define bench-ops (* size runs))
+
+(define total 0)
+(for i (range 0 runs) (do
+    (define squares (map (lambda (x) (* x x)) (range 0 size)))
+    (define evens (filter (lambda (x) (= (% x 2) 0)) squares))
+    (define total (+ total (reduce (lambda (acc x) (+ acc (% x 7))) 0 evens)))))
+(print total)
@@ -0,0 +1,16 @@
+; Parsing a large source. The source is a thousand function definitions,
+; which are parsed ten times. An operation is one definition parsed.
+(define definitions 1000)
+(define runs 10)
+(define bench-ops (* definitions runs))
+
+(define source (builder))
+(for i (range 0 definitions)
+    (append source
+        "(defun f" i " (x y) (if (< x " i ") (+ x (* y 2) \"a string\") '(" i " 2.5 x y)))" endl))
+(define source (display source))
+
+(define count 0)
+(for i (range 0 runs)
+    (define count (+ count (len (parse source)))))
+(print count)
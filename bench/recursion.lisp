@@ -0,0 +1,19 @@
+; Deep recursion: calls that aren't tail calls, so every one of them
+; stays on the stack until the innermost returns, and tree recursion.
+; An operation is one call.
+(defun depth (n)
+    (if (= n 0)
+        0
+        (+ 1 (depth (- n 1)))))
+
+(defun fib (n)
+    (if (<= n 1)
+        n
+        (+ (fib (- n 1)) (fib (- n 2)))))
+
+(for i (range 0 50)
+    (depth 2000))
+(print (fib 22))
+
+; 50 runs of 2001 calls, and the 57313 calls of (fib 22)
+(define bench-ops (+ (* 50 2001) 57313))
@@ -0,0 +1,78 @@
+#!/bin/sh
+# Runs the benchmarks in this directory, and compares them with a baseline.
+#
+#   bench/run.sh           run the benchmarks, and compare them with bench/baseline.txt
+#   bench/run.sh --save    run the benchmarks, and save them as the new baseline
+#
+# The interpreter is built from wisp.cpp with $CXX, or $WISP can name one
+# that's already built. Each benchmark is run $RUNS times, and its fastest
+# run is kept. A benchmark has regressed if its time or its peak memory is
+# more than $THRESHOLD percent over the baseline, or if it allocates more
+# objects per operation. The script exits with 1 if any benchmark regressed.
+#
+# The baseline is only meaningful on the machine it was saved on, so save
+# one before making a change, and compare with it after.
+
+cd "$(dirname "$0")" || exit 1
+RUNS=${RUNS:-3}
+THRESHOLD=${THRESHOLD:-15}
+
+if [ -z "$WISP" ]; then
+    WISP=$(mktemp -d)/wisp
+    ${CXX:-c++} -O2 -pthread ../wisp.cpp -o "$WISP" || exit 1
+fi
+
+results=$(mktemp)
+failed=0
+for bench in *.lisp; do
+    best=""
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        # The report is the last line of the errors, and the program's own output is dropped
+        line=$("$WISP" --bench "$bench" 2>&1 >/dev/null | tail -n 1)
+        case "$line" in
+        *ns/op*) ;;
+        *)
+            echo "$bench failed: $line"
+            failed=1
+            break
+            ;;
+        esac
+        if [ -z "$best" ] || [ "$(echo "$line $best" | awk '{ print ($2 < $10) }')" = 1 ]; then
+            best=$line
+        fi
+        i=$((i + 1))
+    done
+    [ -n "$best" ] && echo "$best" | tee -a "$results"
+done
+
+if [ "$1" = "--save" ]; then
+    mv "$results" baseline.txt
+    echo "saved the baseline to bench/baseline.txt"
+    exit $failed
+fi
+
+if [ ! -f baseline.txt ]; then
+    echo "there's no baseline to compare with, run bench/run.sh --save to make one"
+    exit $failed
+fi
+
+echo
+awk -v threshold="$THRESHOLD" '
+    NR == FNR { ns[$1] = $2; allocs[$1] = $4; rss[$1] = $6; next }
+    !($1 in ns) { printf "%-24s new\n", $1; next }
+    {
+        time = ($2 - ns[$1]) * 100 / ns[$1]
+        memory = ($6 - rss[$1]) * 100 / rss[$1]
+        status = ""
+        if (time > threshold) status = status " slower"
+        if ($4 > allocs[$1]) status = status " more-allocs"
+        if (memory > threshold) status = status " more-memory"
+        if (status != "") regressed = 1
+        printf "%-24s %+7.1f%% time  %+7.1f%% memory  %s -> %s allocs/op %s\n",
+            $1, time, memory, allocs[$1], $4, status == ""? " ok" : status
+    }
+    END { exit regressed }
+' baseline.txt "$results" || failed=1
+rm -f "$results"
+exit $failed
@@ -0,0 +1,10 @@
+; Startup of a program that includes a library many times over, like scripts
+; that each include the libraries they use. Included files are only parsed the
+; first time, so this mostly measures defining what they define.
+; The library is found from the bench directory, which bench/run.sh runs in.
+; An operation is one include.
+(define bench-ops 1000)
+
+(for i (range 0 bench-ops)
+    (include "lib/prelude.lisp"))
+(print (sum-of (range 0 10)))
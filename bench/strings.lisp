@@ -0,0 +1,15 @@
+; Building strings out of many pieces: by adding strings together,
+; which copies the string so far every time, and with a builder.
+; An operation is one piece.
+(define pieces 5000)
+(define bench-ops (* pieces 2))
+
+(define text "")
+(for i (range 0 pieces)
+    (define text (+ text (display i) " ")))
+
+(define b (builder))
+(for i (range 0 pieces)
+    (append b i " "))
+
+(print (= text (display b)))
@@ -21,6 +21,10 @@
 #include <iostream>
 #include <fstream>
 #include <ctime>
+#include <unistd.h>
+#include <signal.h>
+#include <iomanip>
+#include <sys/time.h>
 
 std::string read_file_contents(std::string filename) {
     std::ifstream f;
@@ -39,11 +43,56 @@ std::string read_file_contents(std::string filename) {
     return contents;
 }
 
+// The wall clock time, in seconds
+double wall_time() {
+    timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec * 1e-6;
+}
+
 #else
 #define NO_STD "no standard library support"
 #endif
 
 
+// Comment this define out to run programs exactly as they're written,
+// without folding constant expressions or hoisting loop invariants.
+#define OPTIMIZE
+
+
+// Comment this define out to drop support for threads.
+// The parallel builtins then run on a single thread.
+#define HAS_THREADS
+#ifdef HAS_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+
+// Comment this define out to drop support for the profiler.
+// It uses POSIX timers and signals, and the standard library to report.
+#define HAS_PROFILER
+#if defined(HAS_PROFILER) && defined(USE_STD)
+#include <sys/resource.h>
+#include <signal.h>
+#else
+#undef HAS_PROFILER
+#endif
+
+
+// Comment this define out to read images and included files with the
+// standard library, instead of mapping them into memory with POSIX mmap.
+#define HAS_MMAP
+#if defined(HAS_MMAP) && defined(USE_STD)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#undef HAS_MMAP
+#endif
+
+
 ////////////////////////////////////////////////////////////////////////////////
 /// REQUIRED INCLUDES //////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -53,6 +102,13 @@ std::string read_file_contents(std::string filename) {
 #include <vector>
 #include <sstream>
 #include <exception>
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+#include <new>
+#include <climits>
+#include <cstring>
+#include <cstdio>
 
 ////////////////////////////////////////////////////////////////////////////////
 /// ERROR MESSAGES /////////////////////////////////////////////////////////////
@@ -72,7 +128,15 @@ std::string read_file_contents(std::string filename) {
 #define EVAL_EMPTY_LIST "evaluated empty list"
 #define INTERNAL_ERROR "interal virtual machine error"
 #define INDEX_OUT_OF_RANGE "index out of range"
+#define KEY_NOT_FOUND "key not found"
 #define MALFORMED_PROGRAM "malformed program"
+#define DIVIDE_BY_ZERO "division by zero"
+#define BAD_IMAGE "invalid image"
+#define CANNOT_SAVE "cannot save value in an image"
+#define COULD_NOT_OPEN "could not open file"
+#define FILE_CLOSED "file is closed"
+#define CHANNEL_CLOSED "channel is closed"
+#define BLOCKED_FOREVER "would block forever"
 
 ////////////////////////////////////////////////////////////////////////////////
 /// TYPE NAMES /////////////////////////////////////////////////////////////////
@@ -86,6 +150,15 @@ std::string read_file_contents(std::string filename) {
 #define ATOM_TYPE "atom"
 #define QUOTE_TYPE "quote"
 #define LIST_TYPE "list"
+#define F64VEC_TYPE "f64vec"
+#define I32VEC_TYPE "i32vec"
+#define FILE_TYPE "file"
+#define VIEW_TYPE "view"
+#define BUILDER_TYPE "builder"
+#define DICT_TYPE "dict"
+#define SET_TYPE "set"
+#define TASK_TYPE "task"
+#define CHANNEL_TYPE "channel"
 
 ////////////////////////////////////////////////////////////////////////////////
 /// HELPER FUNCTIONS ///////////////////////////////////////////////////////////
@@ -102,13 +175,83 @@ std::string to_string(T t) {
     return ss.str();
 }
 
-// Replace a substring with a replacement string in a source string
-void replace_substring(std::string &src, std::string substr, std::string replacement) {
-    size_t i=0;
-    for (i=src.find(substr, i); i!=std::string::npos; i=src.find(substr, i)) {
-        src.replace(i, substr.size(), replacement);
-        i += replacement.size();
+// Add an int to the end of a string, without a stream
+void append_int(std::string &out, int n) {
+    char digits[12];
+    int i = sizeof(digits);
+    // Negative numbers are built from negative digits, so INT_MIN doesn't overflow
+    int rest = n;
+    do {
+        int digit = rest % 10;
+        digits[--i] = char('0' + (digit < 0? -digit : digit));
+        rest /= 10;
+    } while (rest != 0);
+    if (n < 0) digits[--i] = '-';
+    out.append(digits + i, sizeof(digits) - i);
+}
+
+// Add a float to the end of a string, without a stream.
+// This formats it the same way a stream does by default.
+void append_float(std::string &out, double f) {
+    char text[32];
+    sprintf(text, "%g", f);
+    out += text;
+}
+
+// Replace every occurrence of a substring in some text, in one pass
+// over the text. An empty substring is never replaced.
+std::string replace_substring(const char *src, size_t length, std::string const &substr, std::string const &replacement) {
+    if (substr.empty()) return std::string(src, length);
+    std::string result;
+    result.reserve(length);
+    const char *end = src + length;
+    for (const char *i=src; i<end;) {
+        const char *found = std::search(i, end, substr.begin(), substr.end());
+        result.append(i, found);
+        if (found == end) break;
+        result += replacement;
+        i = found + substr.size();
     }
+    return result;
+}
+
+// Get a hash of some bytes with FNV-1a
+unsigned hash_bytes(const char *bytes, size_t length) {
+    unsigned hash = 2166136261u;
+    for (size_t i=0; i<length; i++)
+        hash = (hash ^ (unsigned char)bytes[i]) * 16777619u;
+    return hash;
+}
+
+// Mix a hash into another, for hashing a sequence of values
+unsigned combine_hashes(unsigned hash, unsigned item) {
+    return (hash ^ item) * 16777619u + 0x9e3779b9u;
+}
+
+// Add two ints, and get whether the sum fits in an int
+bool add_ints(int a, int b, int &result) {
+    if ((b > 0 && a > INT_MAX - b) || (b < 0 && a < INT_MIN - b))
+        return false;
+    result = a + b;
+    return true;
+}
+
+// Subtract two ints, and get whether the difference fits in an int
+bool subtract_ints(int a, int b, int &result) {
+    if ((b < 0 && a > INT_MAX + b) || (b > 0 && a < INT_MIN + b))
+        return false;
+    result = a - b;
+    return true;
+}
+
+// Multiply two ints, and get whether the product fits in an int.
+// A product that fits in an int is exact as a double.
+bool multiply_ints(int a, int b, int &result) {
+    double product = double(a) * b;
+    if (product > INT_MAX || product < INT_MIN)
+        return false;
+    result = int(product);
+    return true;
 }
 
 // Is this character a valid lisp symbol character
@@ -117,1684 +260,7896 @@ bool is_symbol(char ch) {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-/// LISP CONSTRUCTS ////////////////////////////////////////////////////////////
+/// THREAD SAFETY //////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-// Forward declaration for Environment class definition
-class Value;
-
+// Whether the thread pool is running a parallel builtin, or interpreters were
+// enabled to run on several threads. Reference counts and the shared tables
+// are only synchronized while it is, so programs that don't use threads
+// don't pay for synchronization. This is only changed while no workers are running.
+bool workers_running = false;
 
-// An instance of a function's scope.
-class Environment {
+// A mutual exclusion lock. Without thread support, locking does nothing.
+class Mutex {
 public:
-    // Default constructor
-    Environment() : parent_scope(NULL) {}
-
-    // Does this environment, or its parent environment,
-    // have this atom in scope?
-    // This is only used to determine which atoms to capture when
-    // creating a lambda function.
-    bool has(std::string name) const;
-    // Get the value associated with this name in this scope
-    Value get(std::string name) const;
-    // Set the value associated with this name in this scope
-    void set(std::string name, Value value);
+#ifdef HAS_THREADS
+    Mutex() { pthread_mutex_init(&mutex, NULL); }
+    ~Mutex() { pthread_mutex_destroy(&mutex); }
+    void lock() { pthread_mutex_lock(&mutex); }
+    void unlock() { pthread_mutex_unlock(&mutex); }
 
-    void combine(Environment const &other);
+    pthread_mutex_t mutex;
+#else
+    Mutex() {}
+    void lock() {}
+    void unlock() {}
+#endif
+private:
+    // Mutexes can't be copied
+    Mutex(Mutex const &);
+    Mutex &operator=(Mutex const &);
+};
 
-    void set_parent_scope(Environment *parent) {
-        parent_scope = parent;
+// Holds a lock on a mutex until the end of the scope,
+// but only if the thread pool is running.
+class SharedLock {
+public:
+    SharedLock(Mutex &m) : mutex(workers_running? &m : NULL) {
+        if (mutex != NULL) mutex->lock();
+    }
+    ~SharedLock() {
+        if (mutex != NULL) mutex->unlock();
     }
-    
-    // Output this scope in readable form to a stream.
-    friend std::ostream &operator<<(std::ostream &os, Environment const &v);
 private:
-
-    // The definitions in the scope.
-    std::map<std::string, Value> defs;
-    Environment *parent_scope;
+    Mutex *mutex;
 };
 
+// Add one to a reference count
+inline void increment_refs(int &refs) {
+#ifdef HAS_THREADS
+    if (workers_running) {
+        __sync_add_and_fetch(&refs, 1);
+        return;
+    }
+#endif
+    refs++;
+}
 
-// An exception thrown by the lisp
-class Error {
-public:
-    // Create an error with the value that caused the error,
-    // the scope where the error was found, and the message.
-    Error(Value v, Environment const &env, const char *msg);
-    // Copy constructor is needed to prevent double frees
-    Error(Error const &other);
-    ~Error();
+// Take one from a reference count, and get whether it reached zero
+inline bool decrement_refs(int &refs) {
+#ifdef HAS_THREADS
+    if (workers_running)
+        return __sync_sub_and_fetch(&refs, 1) == 0;
+#endif
+    return --refs == 0;
+}
 
-    // Get the printable error description.
-    std::string description();
-private:
-    Value *cause;
-    Environment env;
-    const char *msg;
-};
+// Read a reference count that other threads might be changing
+inline int load_refs(int &refs) {
+#ifdef HAS_THREADS
+    if (workers_running)
+        return __sync_fetch_and_add(&refs, 0);
+#endif
+    return refs;
+}
 
-// The type for a builtin function, which takes a list of values,
-// and the environment to run the function in.
-typedef Value (*Builtin)(std::vector<Value>, Environment &);
+////////////////////////////////////////////////////////////////////////////////
+/// OUTPUT /////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-class Value {
+#ifdef USE_STD
+// The default number of bytes of output to buffer before writing them
+#define OUTPUT_BUFFER_SIZE 65536
+
+// The standard output of programs. What they print is collected in a buffer,
+// and written when the buffer fills up, so printing many lines doesn't make a
+// system call for each line. The buffer is also flushed by `flush`, before
+// reading input, and when the program exits. When the output is a terminal,
+// every print is flushed right away, so it can be seen as it's printed.
+class Output {
 public:
-    ////////////////////////////////////////////////////////////////////////////////
-    /// CONSTRUCTORS ///////////////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////
+    Output() : capacity(OUTPUT_BUFFER_SIZE), terminal(isatty(fileno(stdout)) != 0) {}
+    ~Output() { flush(); }
 
-    // Constructs a unit value
-    Value() : type(UNIT) {}
+    // Write everything in the buffer
+    void flush() {
+        SharedLock lock(mutex);
+        write_buffer();
+    }
 
-    // Constructs an integer
-    Value(int i) : type(INT) { stack_data.i = i; }
-    // Constructs a floating point value
-    Value(double f) : type(FLOAT) { stack_data.f = f; }
-    // Constructs a list
-    Value(std::vector<Value> list) : type(LIST), list(list) {}
+    // Flush the buffer after a print, if it's full or the output is a terminal.
+    // The caller must hold the lock while it adds to the buffer.
+    void end_print() {
+        if (terminal || buffer.size() >= capacity) write_buffer();
+    }
 
-    // Construct a quoted value
-    static Value quote(Value quoted) {
-        Value result;
-        result.type = QUOTE;
+    // Set how many bytes are buffered before they're written. With no buffer,
+    // every print is written right away.
+    void set_capacity(size_t n) {
+        SharedLock lock(mutex);
+        capacity = n;
+        if (buffer.size() >= capacity) write_buffer();
+    }
 
-        // The first position in the list is
-        // used to store the quoted expression.
-        result.list.push_back(quoted);
-        return result;
+    size_t get_capacity() const { return capacity; }
+
+    // The text printed since the last flush
+    std::string buffer;
+    // Held while adding to the buffer, if the thread pool is running
+    Mutex mutex;
+private:
+    void write_buffer() {
+        if (!buffer.empty()) fwrite(buffer.data(), 1, buffer.size(), stdout);
+        fflush(stdout);
+        buffer.clear();
     }
 
-    // Construct an atom
-    static Value atom(std::string s) {
-        Value result;
-        result.type = ATOM;
+    size_t capacity;
+    bool terminal;
+};
 
-        // We use the `str` member to store the atom.
-        result.str = s;
-        return result;
+// The standard output shared by the whole interpreter
+Output &output() {
+    static Output out;
+    return out;
+}
+
+// Write all of the buffered output
+void flush_output() {
+    output().flush();
+}
+
+// The size of the stack that crashes are handled on
+#define CRASH_STACK_SIZE 65536
+
+// A crash, like from recursion too deep for the stack, writes what's left
+// in the buffer before the program dies, so what it printed isn't lost.
+// The buffer isn't locked, since the thread that crashed may hold the lock.
+extern "C" void flush_on_crash(int sig) {
+    std::string const &buffer = output().buffer;
+    if (!buffer.empty() && write(STDOUT_FILENO, buffer.data(), buffer.size()) < 0) {}
+    // The handler was reset, so this dies the way the crash would have
+    raise(sig);
+}
+
+// Handle crashes on a stack of their own, since a stack
+// that overflowed has no room left to run the handler on
+void catch_crashes() {
+    static char crash_stack[CRASH_STACK_SIZE];
+    stack_t stack;
+    stack.ss_sp = crash_stack;
+    stack.ss_size = sizeof(crash_stack);
+    stack.ss_flags = 0;
+    sigaltstack(&stack, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = flush_on_crash;
+    action.sa_flags = SA_ONSTACK | SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+/// ARENA //////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// The size of the blocks an arena carves its allocations out of
+#define ARENA_BLOCK_SIZE 65536
+
+// A region allocator for memory that's only needed while a call runs,
+// like the frames of lambda calls. Calls nest, so their memory is freed
+// in the opposite order it was allocated in: allocating bumps a pointer,
+// and freeing moves it back to where it was before.
+// Freed blocks are kept around to be used again by the next calls.
+class Arena {
+public:
+    // A position in the arena to free back to
+    struct Mark {
+        size_t block;
+        size_t used;
+    };
+
+    Arena() : current(0), used(0) {}
+    ~Arena() {
+        for (size_t i=0; i<blocks.size(); i++)
+            delete[] blocks[i].memory;
     }
 
-    // Construct a string
-    static Value string(std::string s) {
-        Value result;
-        result.type = STRING;
+    // Get the position of the next allocation
+    Mark mark() const {
+        Mark m;
+        m.block = current;
+        m.used = used;
+        return m;
+    }
 
-        // We use the `str` member to store the string.
-        result.str = s;
+    // Allocate memory that's freed by releasing a mark taken before this
+    void *allocate(size_t bytes) {
+        // Keep every allocation aligned for any type
+        bytes = (bytes + 15) & ~size_t(15);
+        if (current >= blocks.size() || used + bytes > blocks[current].size)
+            next_block(bytes);
+        void *result = blocks[current].memory + used;
+        used += bytes;
         return result;
     }
 
-    // Construct a lambda function
-    Value(std::vector<Value> params, Value ret, Environment const &env) : type(LAMBDA) {
-        // We store the params and the result in the list member
-        // instead of having dedicated members. This is to save memory.
-        list.push_back(Value(params));
-        list.push_back(ret);
+    // Free everything allocated since the mark was taken
+    void release(Mark const &m) {
+        current = m.block;
+        used = m.used;
+    }
 
-        // Lambdas capture only variables that they know they will use.
-        std::vector<std::string> used_atoms = ret.get_used_atoms();
-        for (size_t i=0; i<used_atoms.size(); i++) {
-            // If the environment has a symbol that this lambda uses, capture it.
-            if (env.has(used_atoms[i]))
-                lambda_scope.set(used_atoms[i], env.get(used_atoms[i]));
+private:
+    struct Block {
+        char *memory;
+        size_t size;
+    };
+
+    // Move on to a block with room for an allocation
+    void next_block(size_t bytes) {
+        if (current < blocks.size()) current++;
+        // An existing block that's too small for this allocation is replaced
+        if (current < blocks.size() && blocks[current].size < bytes) {
+            delete[] blocks[current].memory;
+            blocks.erase(blocks.begin() + current);
+        }
+        if (current == blocks.size() || blocks[current].size < bytes) {
+            Block block;
+            block.size = std::max(size_t(ARENA_BLOCK_SIZE), bytes);
+            block.memory = new char[block.size];
+            blocks.insert(blocks.begin() + current, block);
         }
+        used = 0;
     }
 
-    // Construct a builtin function
-    Value(std::string name, Builtin b) : type(BUILTIN) {
-        // Store the name of the builtin function in the str member
-        // to save memory, and use the builtin function slot in the union
-        // to store the function pointer.
-        str = name;
-        stack_data.b = b;
-    }
+    std::vector<Block> blocks;
+    // The block being allocated from, and how much of it is used
+    size_t current, used;
 
-    ////////////////////////////////////////////////////////////////////////////////
-    /// C++ INTEROP METHODS ////////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////
+    Arena(Arena const &);
+    Arena &operator=(Arena const &);
+};
 
-    // Get all of the atoms used in a given Value
-    std::vector<std::string> get_used_atoms() {
-        std::vector<std::string> result, tmp;
-        switch (type) {
-        case QUOTE:
-            // The data for a quote is stored in the
-            // first slot of the list member.
-            return list[0].get_used_atoms();
-        case ATOM:
-            // If this is an atom, add it to the list
-            // of used atoms in this expression.
-            result.push_back(as_atom());
-            return result;
-        case LAMBDA:
-            // If this is a lambda, get the list of used atoms in the body
-            // of the expression.
-            return list[1].get_used_atoms();
-        case LIST:
-            // If this is a list, add each of the atoms used in all
-            // of the elements in the list.
-            for (size_t i=0; i<list.size(); i++) {
-                // Get the atoms used in the element
-                tmp = list[i].get_used_atoms();
-                // Add the used atoms to the current list of used atoms
-                result.insert(result.end(), tmp.begin(), tmp.end());
-            }
-            return result;
-        default:
-            return result;
-        }
-    }
+// Get the arena of the calling thread
+#ifdef HAS_THREADS
+void delete_arena(void *arena) {
+    delete (Arena *)arena;
+}
 
-    // Is this a builtin function?
-    bool is_builtin() {
-        return type == BUILTIN;
+Arena &arena() {
+    static pthread_key_t key;
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    struct Key { static void create() { pthread_key_create(&key, delete_arena); } };
+    pthread_once(&once, Key::create);
+
+    Arena *result = (Arena *)pthread_getspecific(key);
+    if (result == NULL) {
+        result = new Arena;
+        pthread_setspecific(key, result);
     }
+    return *result;
+}
+#else
+Arena &arena() {
+    static Arena result;
+    return result;
+}
+#endif
 
-    // Apply this as a function to a list of arguments in a given environment.
-    Value apply(std::vector<Value> args, Environment &env);
-    // Evaluate this value as lisp code.
-    Value eval(Environment &env);
+////////////////////////////////////////////////////////////////////////////////
+/// RANDOM NUMBERS /////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-    bool is_number() const {
-        return type == INT || type == FLOAT;
-    }
+// A xorshift random number generator. Each thread has its own,
+// so threads drawing random numbers don't share any state.
+class Random {
+public:
+    Random(unsigned seed) { reseed(seed); }
 
-    // Get the "truthy" boolean value of this value.
-    bool as_bool() const {
-        return *this != Value(0);
+    void reseed(unsigned seed) {
+        // Xorshift never leaves a state of zero
+        state = seed != 0? seed : 2463534242u;
     }
 
-    // Get this item's integer value
-    int as_int() const {
-        return cast_to_int().stack_data.i;
+    // Get a random number between 0 and 2^32 - 1
+    unsigned next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
     }
 
-    // Get this item's floating point value
-    double as_float() const {
-        return cast_to_int().stack_data.f;
+private:
+    unsigned state;
+};
+
+// Get the random number generator of the calling thread.
+// Each one is seeded with the time and the address it's made at.
+#ifdef HAS_THREADS
+void delete_random(void *random) {
+    delete (Random *)random;
+}
+
+Random &random_numbers() {
+    static pthread_key_t key;
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    struct Key { static void create() { pthread_key_create(&key, delete_random); } };
+    pthread_once(&once, Key::create);
+
+    Random *result = (Random *)pthread_getspecific(key);
+    if (result == NULL) {
+        result = new Random(0);
+        result->reseed(unsigned(time(NULL)) ^ unsigned(long(result)));
+        pthread_setspecific(key, result);
     }
+    return *result;
+}
+#else
+Random &random_numbers() {
+    static Random result(unsigned(time(NULL)));
+    return result;
+}
+#endif
 
-    // Get this item's string value
-    std::string as_string() const {
-        // If this item is not a string, throw a cast error.
-        if (type != STRING)
-            throw Error(*this, Environment(), BAD_CAST);
-        return str;
+////////////////////////////////////////////////////////////////////////////////
+/// SYMBOL TABLE ///////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Every atom is interned into this table when it is parsed, so the
+// interpreter can compare and look up atoms by integer id instead of by name.
+class SymbolTable {
+public:
+    // Get the id of a name, adding it to the table if it is new
+    int intern(std::string const &name) {
+        SharedLock lock(mutex);
+        std::map<std::string, int>::const_iterator itr = ids.find(name);
+        if (itr != ids.end()) return itr->second;
+
+        int id = int(names.size());
+        ids[name] = id;
+        names.push_back(name);
+        return id;
     }
 
-    // Get this item's atom value
-    std::string as_atom() const {
-        // If this item is not an atom, throw a cast error.
-        if (type != ATOM)
-            throw Error(*this, Environment(), BAD_CAST);
-        return str;
+    // Get the name of an interned symbol
+    std::string const &name(int id) const {
+        SharedLock lock(mutex);
+        return names[id];
     }
 
-    // Get this item's list value
-    std::vector<Value> as_list() const {
-        // If this item is not a list, throw a cast error.
-        if (type != LIST)
-            throw Error(*this, Environment(), BAD_CAST);
-        return list;
+    // The number of symbols interned so far
+    int size() const {
+        SharedLock lock(mutex);
+        return int(names.size());
     }
 
-    // Push an item to the end of this list
-    void push(Value val) {
-        // If this item is not a list, you cannot push to it.
-        // Throw an error.
-        if (type != LIST)
-            throw Error(*this, Environment(), MISMATCHED_TYPES);
-        
-        list.push_back(val);
+private:
+    std::map<std::string, int> ids;
+    // Names are kept in a deque so that references to them
+    // stay valid while other threads intern new names.
+    std::deque<std::string> names;
+    mutable Mutex mutex;
+};
+
+// The symbol table shared by the whole interpreter.
+// This is a function-local static so it's ready before any other global needs it.
+SymbolTable &symbols() {
+    static SymbolTable table;
+    return table;
+}
+
+// Intern a name in the interpreter's symbol table
+int intern(std::string const &name) {
+    return symbols().intern(name);
+}
+
+// Get the name of an interned symbol
+std::string const &symbol_name(int id) {
+    return symbols().name(id);
+}
+
+// Call sites cache the function their head atom resolved to. A cache is
+// only valid while the atom's binding version is the same, and the version
+// changes whenever the atom is redefined in the global scope. An atom that's
+// bound anywhere else, or that a lambda captured before it was redefined,
+// can resolve to something different depending on where it's looked up,
+// so its version becomes UNCACHED for good.
+class BindingVersions {
+public:
+    enum { UNCACHED = 0 };
+
+    // The version of an atom's binding.
+    // This isn't synchronized, so it's only read while no workers are running.
+    unsigned version(int symbol) const {
+        return symbol < int(bindings.size())? bindings[symbol].version : 1;
     }
 
-    // Push an item from the end of this list
-    Value pop() {
-        // If this item is not a list, you cannot pop from it.
-        // Throw an error.
-        if (type != LIST)
-            throw Error(*this, Environment(), MISMATCHED_TYPES);
-        
-        // Remember the last item in the list
-        Value result = list[list.size()-1];
-        // Remove it from this instance
-        list.pop_back();
-        // Return the remembered value
-        return result;
+    // An atom was defined in the global scope
+    void redefine(int symbol) {
+        SharedLock lock(mutex);
+        Binding &binding = get(symbol);
+        if (binding.captured) binding.version = UNCACHED;
+        else if (binding.version != UNCACHED && ++binding.version == UNCACHED)
+            binding.version++;
     }
 
-    ////////////////////////////////////////////////////////////////////////////////
-    /// TYPECASTING METHODS ////////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////
+    // An atom was bound in a lambda frame, or in some other local scope
+    void shadow(int symbol) {
+        SharedLock lock(mutex);
+        get(symbol).version = UNCACHED;
+    }
 
-    // Cast this to an integer value
-    Value cast_to_int() const {
-        switch (type) {
-        case INT: return *this;
-        case FLOAT: return Value(int(stack_data.f));
-        // Only ints and floats can be cast to an int
-        default:
-            throw Error(*this, Environment(), BAD_CAST);
-        }
+    // A lambda captured the value of an atom
+    void capture(int symbol) {
+        SharedLock lock(mutex);
+        get(symbol).captured = true;
     }
 
-    // Cast this to a floating point value
-    Value cast_to_float() const {
-        switch (type) {
-        case FLOAT: return *this;
-        case INT: return Value(float(stack_data.i));
-        // Only ints and floats can be cast to a float
-        default:
-            throw Error(*this, Environment(), BAD_CAST);
-        }
+private:
+    struct Binding {
+        Binding() : version(1), captured(false) {}
+        unsigned version;
+        bool captured;
+    };
+
+    Binding &get(int symbol) {
+        if (symbol >= int(bindings.size()))
+            bindings.resize(symbol + 1);
+        return bindings[symbol];
     }
 
-    ////////////////////////////////////////////////////////////////////////////////
-    /// COMPARISON OPERATIONS //////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////
+    std::vector<Binding> bindings;
+    Mutex mutex;
+};
 
-    bool operator==(Value other) const {
-        // If either of these values are floats, promote the
-        // other to a float, and then compare for equality.
-        if (type == FLOAT && other.type == INT) return *this == other.cast_to_float();
-        else if (type == INT && other.type == FLOAT) return this->cast_to_float() == other;
-        // If the values types aren't equal, then they cannot be equal.
-        else if (type != other.type) return false;
+BindingVersions &binding_versions() {
+    static BindingVersions versions;
+    return versions;
+}
 
-        switch (type) {
-        case FLOAT:
-            return stack_data.f == other.stack_data.f;
-        case INT:
-            return stack_data.i == other.stack_data.i;
-        case BUILTIN:
-            return stack_data.b == other.stack_data.b;
-        case STRING:
-        case ATOM:
-            // Both atoms and strings store their
-            // data in the str member.
-            return str == other.str;
-        case LAMBDA:
-        case LIST:
-            // Both lambdas and lists store their
-            // data in the list member.
-            return list == other.list;
-        case QUOTE:
-            // The values for quotes are stored in the
-            // first slot of the list member.
-            return list[0] == other.list[0];
-        default:
-            return true;
-        }
-    }
-    
-    bool operator!=(Value other) const {
-        return !(*this == other);
-    }
+////////////////////////////////////////////////////////////////////////////////
+/// PROFILER ///////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-    // bool operator<(Value other) const {
-    //     if (other.type != FLOAT && other.type != INT)
-    //         throw Error(*this, Environment(), INVALID_BIN_OP);
+#ifdef HAS_PROFILER
+// How often the sampling profiler takes a sample, in microseconds of CPU time
+#define PROFILE_SAMPLE_INTERVAL 1000
+
+// `--profile` counts every call and times it, and `--profile-samples`
+// only keeps track of the stack of calls, which it samples on a timer.
+enum ProfileMode { PROFILE_OFF, PROFILE_CALLS, PROFILE_SAMPLES };
+ProfileMode profile_mode = PROFILE_OFF;
+
+// The number of heap objects allocated while calls are being profiled
+size_t profiled_allocations = 0;
+// The number of heap objects allocated so far, while no workers were running
+size_t allocated_objects = 0;
+
+// The totals of the calls to a function
+struct ProfileEntry {
+    ProfileEntry() : calls(0), active(0), inclusive(0), exclusive(0), allocations(0) {}
+
+    size_t calls;
+    // The number of calls to the function that haven't returned yet.
+    // Only the outermost recursive call adds to the inclusive time.
+    int active;
+    // The time spent in calls to the function, with and without the calls it made
+    double inclusive, exclusive;
+    // The number of objects the function allocated itself
+    size_t allocations;
+};
 
-    //     switch (type) {
-    //     case FLOAT:
-    //         return stack_data.f < other.cast_to_float().stack_data.f;
-    //     case INT:
-    //         if (other.type == FLOAT)
-    //             return cast_to_float().stack_data.f < other.stack_data.f;
-    //         else return stack_data.i < other.stack_data.i;
-    //     default:
-    //         throw Error(*this, Environment(), INVALID_ORDER);
-    //     }
-    // }
-    
-    ////////////////////////////////////////////////////////////////////////////////
-    /// ORDERING OPERATIONS ////////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////
+// A call to a function that hasn't returned yet
+struct ProfileFrame {
+    int name;
+    double start, children;
+    size_t allocations, child_allocations;
+};
 
-    bool operator>=(Value other) const {
-        return !(*this < other);
-    }
-    
-    bool operator<=(Value other) const {
-        return (*this == other) || (*this < other);
-    }
-    
-    bool operator>(Value other) const {
-        return !(*this <= other);
-    }
+// The totals of every function, indexed by the symbol of its name
+std::vector<ProfileEntry> profile_entries;
+// The calls that haven't returned yet, innermost last
+std::vector<ProfileFrame> profile_stack;
+// The number of samples taken of each stack of calls
+std::map<std::vector<int>, size_t> profile_samples;
+// Where the samples are written when the program exits
+std::string profile_samples_file;
 
-    bool operator<(Value other) const {
-        // Other type must be a float or an int
-        if (other.type != FLOAT && other.type != INT)
-            throw Error(*this, Environment(), INVALID_BIN_OP);
+// Set by the timer when a sample is due, and taken at the next call or return
+volatile sig_atomic_t sample_pending = 0;
 
-        switch (type) {
-        case FLOAT:
-            // If this is a float, promote the other value to a float and compare.
-            return stack_data.f < other.cast_to_float().stack_data.f;
-        case INT:
-            // If the other value is a float, promote this value to a float and compare.
-            if (other.type == FLOAT)
-                return cast_to_float().stack_data.f < other.stack_data.f;
-            // Otherwise compare the integer values
-            else return stack_data.i < other.stack_data.i;
-        default:
-            // Only allow comparisons between integers and floats
-            throw Error(*this, Environment(), INVALID_ORDER);
-        }
-    }
-    
-    ////////////////////////////////////////////////////////////////////////////////
-    /// ARITHMETIC OPERATIONS //////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////
+void request_sample(int) {
+    sample_pending = 1;
+}
 
-    // This function adds two lisp values, and returns the lisp value result.
-    Value operator+(Value other) const {
-        // If the other value's type is the unit type,
-        // don't even bother continuing.
-        // Unit types consume all arithmetic operations.
-        if (other.type == UNIT) return other;
+// Record the stack of calls running right now
+void take_sample() {
+    sample_pending = 0;
+    std::vector<int> stack(profile_stack.size());
+    for (size_t i=0; i<profile_stack.size(); i++)
+        stack[i] = profile_stack[i].name;
+    profile_samples[stack]++;
+}
 
-        // Other type must be a float or an int
-        if ((is_number() || other.is_number()) &&
-            !(is_number() && other.is_number()))
-            throw Error(*this, Environment(), INVALID_BIN_OP);
+// Records a call to a function for the profiler, until it's destroyed.
+// Calls made by worker threads aren't profiled, and count toward the
+// parallel builtin that made them.
+class ProfileScope {
+public:
+    ProfileScope() : entered(false) {}
+    ~ProfileScope() {
+        if (entered) leave();
+    }
 
-        switch (type) {
-        case FLOAT:
-            // If one is a float, promote the other by default and do
-            // float addition.
-            return Value(stack_data.f + other.cast_to_float().stack_data.f);
-        case INT:
-            // If the other type is a float, go ahead and promote this expression
-            // before continuing with the addition.
-            if (other.type == FLOAT)
-                return Value(cast_to_float() + other.stack_data.f);
-            // Otherwise, do integer addition.
-            else return Value(stack_data.i + other.stack_data.i);
-        case STRING:
-            // If the other value is also a string, do the concat
-            if (other.type == STRING)
-                return Value::string(str + other.str);
-            // We throw an error if we try to concat anything of non-string type
-            else throw Error(*this, Environment(), INVALID_BIN_OP);
-        case LIST:
-            // If the other value is also a list, do the concat
-            if (other.type == LIST) {
-                // Maintain the value that will be returned
-                Value result = *this;
-                // Add each item in the other list to the end of this list
-                for (size_t i=0; i<other.list.size(); i++)
-                    result.push(other.list[i]);
-                return result;
-            
-            } else throw Error(*this, Environment(), INVALID_BIN_OP);
-        case UNIT:
-            return *this;
-        default:
-            throw Error(*this, Environment(), INVALID_BIN_OP);
+    // Profile a call to the function with this name, or to an anonymous
+    // lambda if the name is negative. A scope that's already profiling
+    // a call finishes it first, so a tail call replaces the current one.
+    void enter(int name) {
+        if (profile_mode != PROFILE_OFF && !workers_running) {
+            if (entered) leave();
+            begin(name);
         }
     }
 
-    // This function subtracts two lisp values, and returns the lisp value result.
-    Value operator-(Value other) const {
-        // If the other value's type is the unit type,
-        // don't even bother continuing.
-        // Unit types consume all arithmetic operations.
-        if (other.type == UNIT) return other;
-
-        // Other type must be a float or an int
-        if (other.type != FLOAT && other.type != INT)
-            throw Error(*this, Environment(), INVALID_BIN_OP);
-
-        switch (type) {
-        case FLOAT:
-            // If one is a float, promote the other by default and do
-            // float subtraction.
-            return Value(stack_data.f - other.cast_to_float().stack_data.f);
-        case INT:
-            // If the other type is a float, go ahead and promote this expression
-            // before continuing with the subtraction
-            if (other.type == FLOAT)
-                return Value(cast_to_float().stack_data.f - other.stack_data.f);
-            // Otherwise, do integer subtraction.
-            else return Value(stack_data.i - other.stack_data.i);
-        case UNIT:
-            // Unit types consume all arithmetic operations.
-            return *this;
-        default:
-            // This operation was done on an unsupported type
-            throw Error(*this, Environment(), INVALID_BIN_OP);
+private:
+    // A sample that is due when a call starts or returns is taken with
+    // the call still on the stack, so calls that make no calls are counted.
+    void begin(int name) {
+        static const int lambda_symbol = intern("lambda");
+
+        ProfileFrame frame;
+        frame.name = name < 0? lambda_symbol : name;
+        if (profile_mode == PROFILE_CALLS) {
+            frame.start = wall_time();
+            frame.allocations = profiled_allocations;
         }
+        frame.children = 0;
+        frame.child_allocations = 0;
+        profile_stack.push_back(frame);
+
+        if (size_t(frame.name) >= profile_entries.size())
+            profile_entries.resize(frame.name + 1);
+        profile_entries[frame.name].active++;
+        entered = true;
+        if (sample_pending) take_sample();
     }
 
-    // This function multiplies two lisp values, and returns the lisp value result.
-    Value operator*(Value other) const {
-        // If the other value's type is the unit type,
-        // don't even bother continuing.
-        // Unit types consume all arithmetic operations.
-        if (other.type == UNIT) return other;
-
-        // Other type must be a float or an int
-        if (other.type != FLOAT && other.type != INT)
-            throw Error(*this, Environment(), INVALID_BIN_OP);
-        
-        switch (type) {
-        case FLOAT:
-            return Value(stack_data.f * other.cast_to_float().stack_data.f);
-        case INT:
-            // If the other type is a float, go ahead and promote this expression
-            // before continuing with the product
-            if (other.type == FLOAT)
-                return Value(cast_to_float().stack_data.f * other.stack_data.f);
-            // Otherwise, do integer multiplication.
-            else return Value(stack_data.i * other.stack_data.i);
-        case UNIT:
-            // Unit types consume all arithmetic operations.
-            return *this;
-        default:
-            // This operation was done on an unsupported type
-            throw Error(*this, Environment(), INVALID_BIN_OP);
+    void leave() {
+        if (sample_pending) take_sample();
+
+        ProfileFrame frame = profile_stack.back();
+        profile_stack.pop_back();
+        ProfileEntry &entry = profile_entries[frame.name];
+        entry.calls++;
+        entry.active--;
+        entered = false;
+        if (profile_mode != PROFILE_CALLS) return;
+
+        double elapsed = wall_time() - frame.start;
+        size_t allocations = profiled_allocations - frame.allocations;
+        entry.exclusive += elapsed - frame.children;
+        entry.allocations += allocations - frame.child_allocations;
+        if (entry.active == 0) entry.inclusive += elapsed;
+        if (!profile_stack.empty()) {
+            profile_stack.back().children += elapsed;
+            profile_stack.back().child_allocations += allocations;
         }
     }
 
-    // This function divides two lisp values, and returns the lisp value result.
-    Value operator/(Value other) const {
-        // If the other value's type is the unit type,
-        // don't even bother continuing.
-        // Unit types consume all arithmetic operations.
-        if (other.type == UNIT) return other;
+    bool entered;
+};
 
-        // Other type must be a float or an int
-        if (other.type != FLOAT && other.type != INT)
-            throw Error(*this, Environment(), INVALID_BIN_OP);
+// Orders functions by the time they spent themselves, longest first
+bool slower(std::pair<int, ProfileEntry> const &a, std::pair<int, ProfileEntry> const &b) {
+    return a.second.exclusive > b.second.exclusive;
+}
 
-        switch (type) {
-        case FLOAT:
-            return Value(stack_data.f / other.cast_to_float().stack_data.f);
-        case INT:
-            // If the other type is a float, go ahead and promote this expression
-            // before continuing with the product
-            if (other.type == FLOAT)
-                return Value(cast_to_float().stack_data.f / other.stack_data.f);
-            // Otherwise, do integer multiplication.
-            else return Value(stack_data.i / other.stack_data.i);
-        case UNIT:
-            // Unit types consume all arithmetic operations.
-            return *this;
-        default:
-            // This operation was done on an unsupported type
-            throw Error(*this, Environment(), INVALID_BIN_OP);
+// Write the profile out when the program exits
+void report_profile() {
+    if (profile_mode == PROFILE_CALLS) {
+        std::vector<std::pair<int, ProfileEntry> > functions;
+        for (size_t i=0; i<profile_entries.size(); i++)
+            if (profile_entries[i].calls > 0)
+                functions.push_back(std::make_pair(int(i), profile_entries[i]));
+        std::sort(functions.begin(), functions.end(), slower);
+
+        std::cerr << std::setw(12) << "calls" << std::setw(13) << "total ms"
+            << std::setw(13) << "self ms" << std::setw(13) << "allocs" << "  function" << std::endl;
+        std::cerr << std::fixed << std::setprecision(3);
+        for (size_t i=0; i<functions.size(); i++) {
+            ProfileEntry const &entry = functions[i].second;
+            std::cerr << std::setw(12) << entry.calls
+                << std::setw(13) << entry.inclusive * 1000
+                << std::setw(13) << entry.exclusive * 1000
+                << std::setw(13) << entry.allocations
+                << "  " << symbol_name(functions[i].first) << std::endl;
+        }
+    } else if (profile_mode == PROFILE_SAMPLES) {
+        // Stacks are written in the collapsed format flamegraph tools read:
+        // the names of the calls from outermost to innermost, and a count.
+        std::ofstream out(profile_samples_file.c_str());
+        std::map<std::vector<int>, size_t>::const_iterator i;
+        for (i=profile_samples.begin(); i!=profile_samples.end(); i++) {
+            if (i->first.empty()) out << "(top level)";
+            for (size_t j=0; j<i->first.size(); j++)
+                out << (j > 0? ";" : "") << symbol_name(i->first[j]);
+            out << " " << i->second << std::endl;
         }
     }
+}
 
-    // This function finds the remainder of two lisp values, and returns the lisp value result.
-    Value operator%(Value other) const {
-        // If the other value's type is the unit type,
-        // don't even bother continuing.
-        // Unit types consume all arithmetic operations.
-        if (other.type == UNIT) return other;
+// Write out how long a benchmark took and how many objects it allocated for each
+// of its operations, and the most memory the process has used, in kilobytes
+void report_benchmark(std::string const &name, double seconds, size_t allocations, int ops) {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cerr << std::left << std::setw(24) << name << std::right << std::fixed
+        << std::setw(14) << std::setprecision(1) << seconds * 1e9 / ops << " ns/op"
+        << std::setw(12) << std::setprecision(2) << double(allocations) / ops << " allocs/op"
+        << std::setw(10) << usage.ru_maxrss << " KB peak" << std::endl;
+}
 
-        // Other type must be a float or an int
-        if (other.type != FLOAT && other.type != INT)
-            throw Error(*this, Environment(), INVALID_BIN_OP);
-        
-        switch (type) {
-        // If we support libm, we can find the remainder of floating point values.
-        #ifdef HAS_LIBM
-        case FLOAT:
-            return Value(fmod(stack_data.f, other.cast_to_float().stack_data.f));
-        case INT:
-            if (other.type == FLOAT)
-                return Value(fmod(cast_to_float().stack_data.f, other.stack_data.f));
-            else return Value(stack_data.i % other.stack_data.i);
+// Start profiling the program in one of the profiler's modes
+void start_profile(ProfileMode mode) {
+    profile_mode = mode;
+    atexit(report_profile);
+    if (mode != PROFILE_SAMPLES) return;
+
+    struct sigaction action;
+    action.sa_handler = request_sample;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, NULL);
+
+    itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROFILE_SAMPLE_INTERVAL;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+#else
+// Without the profiler, calls aren't recorded
+class ProfileScope {
+public:
+    void enter(int) {}
+};
+#endif
 
-        #else
-        case INT:
-            // If we do not support libm, we have to throw errors for floating point values.
-            if (other.type != INT)
-                throw Error(other, Environment(), NO_LIBM_SUPPORT);
-            return Value(stack_data.i % other.stack_data.i);
-        #endif
+////////////////////////////////////////////////////////////////////////////////
+/// LISP CONSTRUCTS ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-        case UNIT:
-            // Unit types consume all arithmetic operations.
-            return *this;
-        default:
-            // This operation was done on an unsupported type
-            throw Error(*this, Environment(), INVALID_BIN_OP);
-        }
+// Forward declaration for Environment class definition
+class Value;
+class Object;
+struct TailCall;
+
+// A read-only view of the arguments passed to a function, or of the items of a list.
+// Arguments are passed in place, without copying them into a new list.
+class Args {
+public:
+    Args() : items(NULL), count(0) {}
+    Args(Value const *items, size_t count) : items(items), count(count) {}
+    Args(std::vector<Value> const &list) : items(list.empty()? NULL : &list[0]), count(list.size()) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    Value const &operator[](size_t i) const;
+
+    Value const *begin() const { return items; }
+    Value const *end() const;
+
+    // Copy the arguments into a list
+    std::vector<Value> to_vector() const;
+private:
+    Value const *items;
+    size_t count;
+};
+
+// The local variables of a single lambda call.
+// The resolver addresses these slots with (depth, slot) pairs,
+// so references to locals are indexed loads instead of name lookups.
+// The frame of a running call is carved out of its thread's arena, and freed
+// when the call returns. Copies of a frame, like the ones closures capture,
+// outlive the call, so they're kept on the heap instead.
+class Frame {
+public:
+    Frame() : symbols(NULL), slots(NULL), count(0), capacity(0), heap(false), arena(NULL) {}
+    Frame(Frame const &other);
+    Frame &operator=(Frame const &other);
+    ~Frame() { clear(); }
+
+    // The number of slots in the frame
+    size_t size() const { return count; }
+    // Fill the frame with a call's arguments bound to its parameters.
+    // The frame is put in the arena, with room for `reserved` slots.
+    void assign(Args params, Args args, size_t reserved, Arena &arena);
+    // Add unbound slots to the frame until it has `n` of them
+    void resize(size_t n);
+    // Empty the frame and free its memory
+    void clear();
+
+    // The symbol bound in each slot, or -1 if the slot isn't bound yet
+    int *symbols;
+    // The value bound in each slot
+    Value *slots;
+private:
+    // Move the slots to memory with room for `n` slots, on the heap
+    // if there's no arena. Only `count` slots are ever constructed.
+    void reserve(size_t n, Arena *in);
+
+    size_t count, capacity;
+    // Whether the slots are on the heap
+    bool heap;
+    // The arena the frame was first put in, and the mark to free it back to
+    Arena *arena;
+    Arena::Mark mark;
+};
+
+// The layout of a lambda's frame, built by the resolver before the program runs.
+struct FrameLayout {
+    FrameLayout() : size(0) {}
+
+    // Get the slot a symbol is bound to in this frame, or -1 if it isn't bound
+    int find(int symbol) const {
+        std::map<int, int>::const_iterator itr = slots.find(symbol);
+        return itr != slots.end()? itr->second : -1;
     }
 
-    // Get the name of the type of this value
-    std::string get_type_name() {
-        switch (type) {
-        case QUOTE: return QUOTE_TYPE;
-        case ATOM: return ATOM_TYPE;
-        case INT: return INT_TYPE;
-        case FLOAT: return FLOAT_TYPE;
-        case LIST: return LIST_TYPE;
-        case STRING: return STRING_TYPE;
-        case BUILTIN:
-        case LAMBDA:
-            // Instead of differentiating between
-            // lambda and builtin types, we group them together.
-            // This is because they are both callable.
-            return FUNCTION_TYPE;
-        case UNIT:
-            return UNIT_TYPE;
-        default:
-            // We don't know the name of this type.
-            // This isn't the users fault, this is just unhandled.
-            // This should never be reached.
-            throw Error(*this, Environment(), INTERNAL_ERROR);
-        }
+    // Give a local variable a slot in this frame, if it doesn't already have one
+    void declare(int symbol) {
+        if (slots.find(symbol) == slots.end())
+            slots[symbol] = size++;
     }
 
-    std::string display() const {
-        std::string result;
-        switch (type) {
-        case QUOTE:
-            return "'" + list[0].debug();
-        case ATOM:
-            return str;
-        case INT:
-            return to_string(stack_data.i);
-        case FLOAT:
-            return to_string(stack_data.f);
-        case STRING:
-            return str;
-        case LAMBDA:
-            for (size_t i=0; i<list.size(); i++) {
-                result += list[i].debug();
-                if (i < list.size()-1) result += " ";
-            }
-            return "(lambda " + result + ")";
-        case LIST:
-            for (size_t i=0; i<list.size(); i++) {
-                result += list[i].debug();
-                if (i < list.size()-1) result += " ";
-            }
-            return "(" + result + ")";
-        case BUILTIN:
-            return "<" + str + " at " + to_string(long(stack_data.b)) + ">";
-        case UNIT:
-            return "@";
+    // Map each symbol to its slot
+    std::map<int, int> slots;
+    // The number of slots in the frame
+    int size;
+};
+
+// The variables defined in a scope, in a hash table keyed by symbol id with
+// open addressing. The symbols are probed in an array of their own, so a lookup
+// only touches the value it finds. A table doesn't allocate anything until a
+// variable is defined in it, since the scopes of most lambda calls keep all
+// of their variables in frames.
+class Bindings {
+public:
+    Bindings() : symbols(NULL), values(NULL), count(0), capacity(0) {}
+    Bindings(Bindings const &other);
+    Bindings &operator=(Bindings const &other);
+    ~Bindings();
+
+    // The number of variables bound in the table
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    // Get the value bound to a symbol, or NULL if it isn't bound
+    Value const *find(int symbol) const;
+    // Bind a symbol to a value, replacing the value it was bound to
+    void set(int symbol, Value const &value);
+    // Make room for `n` variables, so binding them doesn't grow the table again
+    void reserve(size_t n);
+    // Unbind every variable, keeping the table's memory
+    void clear();
+
+    // The entries are iterated over by slot. Empty slots hold the symbol EMPTY.
+    size_t slots() const { return capacity; }
+    int symbol_at(size_t slot) const { return symbols[slot]; }
+    Value const &value_at(size_t slot) const;
+
+    enum { EMPTY = -1, MIN_CAPACITY = 8 };
+private:
+    // Get the slot a symbol is bound in, or the empty slot it would be bound in
+    size_t probe(int symbol) const;
+    // Move the entries to a table with `n` slots
+    void rehash(size_t n);
+
+    int *symbols;
+    Value *values;
+    size_t count, capacity;
+};
+
+class ErrorInfo;
+class LambdaObject;
+struct CallCache;
+class MemoTable;
+class TaskObject;
+class ChannelObject;
+
+// An instance of a function's scope.
+class Environment {
+public:
+    // Default constructor
+    Environment() : parent_scope(NULL), outermost(NULL), lambda(NULL), error(NULL) {}
+    // Copies of a scope don't inherit the errors thrown in the original
+    Environment(Environment const &other);
+    Environment &operator=(Environment const &other);
+    ~Environment();
+
+    // Does this environment, or its parent environment,
+    // have this atom in scope?
+    // This is only used to determine which atoms to capture when
+    // creating a lambda function.
+    bool has(int symbol) const;
+    // Does this environment itself, not counting its parents, bind this atom?
+    bool binds(int symbol) const;
+    // Get the value associated with this symbol in this scope
+    Value get(int symbol) const;
+    // Set the value associated with this symbol in this scope
+    void set(int symbol, Value value);
+    // Bind a variable a lambda captured into the lambda's scope
+    void capture(int symbol, Value const &value);
+
+    // Get and set values by name instead of by symbol id
+    Value get(std::string const &name) const;
+    void set(std::string const &name, Value value);
+
+    // Get the value in a slot of the frame `depth` lambdas out from the
+    // current one. If the slot doesn't hold `symbol`, this returns NULL,
+    // and the caller must fall back to looking the symbol up by name.
+    Value const *get_local(int depth, int slot, int symbol) const;
+    // Bind a name to a value. Resolved atoms are bound directly into
+    // their slot in the current frame, everything else goes through `set`.
+    void bind(Value const &name, Value value);
+    // Start a new frame for a lambda call with its parameters bound
+    void push_frame(Args params, Args args);
+    // Capture the frames of an enclosing scope, for a lambda's closure
+    void capture_frames(Environment const &other);
+    // Clear this scope for a call to a lambda. The variables the lambda
+    // captured are shared by all of its calls, and are looked up in place.
+    void enter_lambda(LambdaObject *called);
+
+    void combine(Environment const &other);
+
+    void set_parent_scope(Environment *parent) {
+        parent_scope = parent;
+        outermost = parent == NULL? NULL : &parent->global_scope();
+    }
+
+    // Get the outermost scope this scope is inside of
+    Environment const &global_scope() const {
+        return outermost == NULL? *this : *outermost;
+    }
+
+    // Get the variables that can be seen from this scope, by name
+    std::map<std::string, Value const *> variables() const;
+
+    // Add the objects this scope refers to to a list, once for each reference
+    void trace(std::vector<Object *> &objects) const;
+    // Drop everything bound in this scope
+    void clear();
+    
+    // Output this scope in readable form to a stream.
+    friend std::ostream &operator<<(std::ostream &os, Environment const &v);
+    friend class Error;
+    friend class ImageWriter;
+    friend class ImageReader;
+private:
+    // Print this scope into the last error thrown in it,
+    // before the scope is destroyed or overwritten.
+    void detach_error() const;
+    // Update the binding version of a symbol that was defined in this scope
+    void rebind(int symbol) const;
+    // Find the variable a symbol is bound to in this scope or its parents, or NULL
+    Value const *lookup(int symbol) const;
+
+    // The definitions in the scope, keyed by symbol id.
+    Bindings defs;
+    // The frames of the lambda calls lexically enclosing this scope.
+    // The current call's frame is at the back.
+    std::vector<Frame> frames;
+    Environment *parent_scope;
+    // The outermost scope this is inside of, or NULL if this is it.
+    // It's kept so it can be found without walking through every caller.
+    Environment const *outermost;
+    // The lambda this is a call to, whose captured scope sits
+    // below this one. Lambdas' own scopes never have one.
+    LambdaObject *lambda;
+    // The frame of the call, if this is the scope of a lambda call
+    Frame frame;
+    // The last error thrown in this scope that may still be printed
+    mutable ErrorInfo *error;
+};
+
+
+// An exception thrown by the lisp
+class Error {
+public:
+    // Create an error with the value that caused the error,
+    // the scope where the error was found, and the message.
+    // The scope isn't copied: it's only printed when the description
+    // is asked for, or when the scope goes away before then.
+    Error(Value const &v, Environment const &env, const char *msg);
+    // Create an error that wasn't found in any particular scope
+    Error(Value const &v, const char *msg);
+    // Copies of an error share its cause and scope
+    Error(Error const &other);
+    Error &operator=(Error const &other);
+    ~Error();
+
+    // Get the printable error description.
+    std::string description();
+private:
+    ErrorInfo *info;
+    const char *msg;
+};
+
+// The type for a builtin function, which takes a list of arguments,
+// and the environment to run the function in.
+// Regular builtins are passed their evaluated arguments, and special
+// forms are passed the unevaluated expressions of their arguments.
+typedef Value (*Builtin)(Args args, Environment &);
+
+// Remember an object whose reference count dropped without reaching zero,
+// because it may be part of a cycle of references that's now garbage.
+void possible_root(Object *object);
+// Forget an object that was remembered as a possible root of a cycle
+void forget_root(Object *object);
+// Free the cycles of garbage among the possible roots, and get the number of objects freed
+size_t collect_cycles();
+// Whether enough possible roots are remembered that cycles should be collected
+bool gc_pending = false;
+// The number of heap objects that are alive
+int live_objects = 0;
+
+// The data of a value that doesn't fit in a machine word lives in a heap
+// object: the text of strings, the items of lists and quotes, and lambdas.
+// Copies of a value share its object, which is reference counted,
+// and freed when the last value referring to it is destroyed.
+// Objects that refer to other objects can form cycles, which reference
+// counting never frees, so those are traced by the cycle collector.
+class Object {
+public:
+    enum { NOT_ROOT = -1, UNTRACED = -2 };
+
+    Object(bool traced=false) : refs(1), root(traced? NOT_ROOT : UNTRACED) {
+        increment_refs(live_objects);
+        #ifdef HAS_PROFILER
+        if (!workers_running) {
+            allocated_objects++;
+            if (profile_mode == PROFILE_CALLS) profiled_allocations++;
+        }
+        #endif
+    }
+    virtual ~Object() {
+        if (root >= 0) forget_root(this);
+        decrement_refs(live_objects);
+    }
+
+    // Take a reference to this object
+    void retain() { increment_refs(refs); }
+    // Give up a reference to this object, and get whether it was the last one
+    bool release() {
+        if (decrement_refs(refs)) return true;
+        // Another thread may free the object as soon as the count is taken from,
+        // so it's only looked at again when no other threads are running
+        if (!workers_running && root == NOT_ROOT) possible_root(this);
+        return false;
+    }
+    // Is more than one value referring to this object?
+    bool is_shared() { return load_refs(refs) > 1; }
+
+    // Add the objects this object refers to to a list, once for each reference
+    virtual void trace(std::vector<Object *> &) const {}
+    // Drop every reference this object has, to break up a cycle of garbage
+    virtual void clear() {}
+
+    // The number of values referring to this object
+    int refs;
+    // The position of this object in the list of possible roots of cycles,
+    // NOT_ROOT if it isn't in the list, or UNTRACED if it can't be in a cycle
+    int root;
+};
+
+// The text of a string
+class StringObject : public Object {
+public:
+    StringObject(std::string const &str) : str(str) {}
+
+    std::string str;
+};
+
+// The items of a numeric vector, stored unboxed in a contiguous array.
+// A vector holds either floats or ints: the other array is left empty.
+class VectorObject : public Object {
+public:
+    VectorObject(bool floats) : floats(floats) {}
+
+    size_t size() const { return floats? f.size() : i.size(); }
+
+    bool floats;
+    std::vector<double> f;
+    std::vector<int> i;
+};
+
+// An open file, read and written through the buffers of the C library
+class FileObject : public Object {
+public:
+    FileObject(FILE *file, std::string const &path) : file(file), path(path) {}
+    ~FileObject() { close(); }
+
+    void close() {
+        if (file != NULL) fclose(file);
+        file = NULL;
+    }
+
+    // The file, or NULL once it's closed
+    FILE *file;
+    std::string path;
+};
+
+// A read-only view of bytes owned by another object, like a mapped file.
+// Slices of a view share its bytes instead of copying them.
+class ViewObject : public Object {
+public:
+    ViewObject(Object *owner, const char *data, size_t length) : owner(owner), data(data), length(length) {
+        owner->retain();
+    }
+    ~ViewObject() {
+        if (owner->release()) delete owner;
+    }
+
+    Object *owner;
+    const char *data;
+    size_t length;
+};
+
+// A string that is built up in place. Appending to a builder is amortized
+// constant time, where adding strings together copies both of them.
+class BuilderObject : public Object {
+public:
+    BuilderObject() {}
+
+    std::string text;
+};
+
+#ifdef USE_STD
+// The contents of a file, mapped into memory if mmap is supported
+class MappedFile {
+public:
+    MappedFile(std::string const &filename);
+    ~MappedFile();
+
+    const char *data() const { return bytes; }
+    size_t size() const { return length; }
+private:
+    const char *bytes;
+    size_t length;
+    #ifdef HAS_MMAP
+    void *mapping;
+    #else
+    std::string contents;
+    #endif
+
+    // Mapped files can't be copied
+    MappedFile(MappedFile const &);
+    MappedFile &operator=(MappedFile const &);
+};
+
+#ifdef HAS_MMAP
+MappedFile::MappedFile(std::string const &filename) : bytes(""), length(0), mapping(NULL) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("could not open file");
+    }
+
+    // Empty files can't be mapped, but there's nothing to map anyways
+    if (info.st_size > 0) {
+        mapping = mmap(NULL, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("could not open file");
+        }
+        bytes = (const char *)mapping;
+        length = size_t(info.st_size);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (mapping != NULL) munmap(mapping, length);
+}
+#else
+MappedFile::MappedFile(std::string const &filename) : contents(read_file_contents(filename)) {
+    bytes = contents.data();
+    length = contents.size();
+}
+
+MappedFile::~MappedFile() {}
+#endif
+
+// A file mapped into memory, which all the views of its contents share
+class MappingObject : public Object {
+public:
+    MappingObject(std::string const &filename) : file(filename) {}
+
+    MappedFile file;
+};
+#endif
+
+// The storage for the items of one or more lists.
+// Lists built from one another share the same buffer: each list is a run
+// of items in the buffer, so taking the tail of a list, or pushing to the
+// end of the longest list in the buffer, doesn't copy any items.
+// A buffer never reallocates, so views of its items stay valid while it lives.
+class ListBuffer : public Object {
+public:
+    ListBuffer();
+    ~ListBuffer();
+
+    void trace(std::vector<Object *> &objects) const;
+    void clear();
+
+    std::vector<Value> items;
+};
+
+// The items of a list, or the quoted expression of a quote
+class ListObject : public Object {
+public:
+    ListObject(std::vector<Value> const &items);
+    // Share `count` items of a buffer, starting at `start`
+    ListObject(ListBuffer *buffer, size_t start, size_t count);
+    // A lazy range of `count` integers starting at `first`
+    ListObject(int first, size_t count);
+    ~ListObject();
+
+    // The buffer of this list. The items of a lazy range are built the first time this is called.
+    ListBuffer *get_buffer();
+
+    void trace(std::vector<Object *> &objects) const;
+    void clear();
+
+    // The buffer is NULL for a lazy range whose items haven't been built.
+    // Lazy ranges can be iterated over, indexed, and sliced without building them.
+    ListBuffer *buffer;
+    size_t start, count;
+    // The first integer of a lazy range
+    int first;
+    // If this list is a call that's been evaluated, the function its head resolved to
+    CallCache *cache;
+};
+
+// A lambda stores its parameter list and its body in the items
+class LambdaObject : public ListObject {
+public:
+    LambdaObject(std::vector<Value> const &items);
+    ~LambdaObject();
+
+    void trace(std::vector<Object *> &objects) const;
+    void clear();
+
+    // The variables the lambda captured when it was created
+    Environment scope;
+    // The number of slots a call's frame needs for its parameters and locals
+    size_t frame_size;
+    // The atoms the lambda uses but couldn't capture,
+    // which it looks up in the scope it's called from
+    std::vector<int> dynamic;
+    // The bytecode chunk the body was compiled to, or -1 if it wasn't compiled
+    int chunk;
+    // The atom the lambda was first defined as, or -1 if it's anonymous
+    int name;
+    // The results of earlier calls, if the lambda is memoized
+    MemoTable *memo;
+};
+
+// The entries of dicts and sets in the order they were added, with a hash
+// table of their keys. Like list buffers, map buffers are shared by maps,
+// and only appended to: each map sees the entries up to its own count.
+// Setting a key that's already in the buffer adds a new entry for it,
+// which the table then points to instead.
+class MapBuffer : public Object {
+public:
+    // Make a buffer with room for `limit` entries
+    MapBuffer(size_t limit);
+    ~MapBuffer();
+
+    void trace(std::vector<Object *> &objects) const;
+    void clear();
+
+    // Get the latest entry for a key among the first `count` entries, or NONE
+    int find(Value const &key, unsigned hash, size_t count) const;
+    // Add an entry for a key. There must be room for it.
+    void add(Value const &key, unsigned hash, Value const &value);
+    bool full() const { return keys.size() == limit; }
+
+    enum { NONE = -1, MIN_SLOTS = 8 };
+    std::vector<Value> keys, values;
+    std::vector<unsigned> hashes;
+    // For each entry, the earlier entry for the same key, or NONE if it's
+    // the first. And the later entry for the same key, or NONE if it's the last.
+    std::vector<int> previous, next;
+private:
+    // Get the slot of the table a key's latest entry is in, or the empty slot it would be in
+    size_t probe(Value const &key, unsigned hash) const;
+
+    size_t limit;
+    // The latest entry for each key, at the slot its hash probes to. Empty slots are NONE.
+    int *table;
+    size_t slots;
+};
+
+// A dict of keys to values, or a set of keys: the first `count` entries of a buffer
+class MapObject : public Object {
+public:
+    MapObject(bool is_set);
+    // Share the entries of another map
+    MapObject(MapObject const &other);
+    ~MapObject();
+
+    void trace(std::vector<Object *> &objects) const;
+    void clear();
+
+    // Get the value of a key, or NULL if the key isn't in the map
+    Value const *find(Value const &key) const;
+    // Set a key to a value. If this map's entries are the last ones in its buffer,
+    // the entry is added in place. Otherwise, the entries are copied to a new buffer.
+    void set(Value const &key, Value const &value);
+    // Is an entry the one this map uses for its key?
+    bool is_latest(size_t entry) const;
+    // Get the value of the key added at an entry
+    Value const &latest_value(size_t entry) const;
+
+    bool is_set;
+    // The buffer is NULL if nothing was ever added
+    MapBuffer *buffer;
+    // The number of entries this map sees, and the number of keys in them
+    size_t count, size;
+};
+
+class Value {
+public:
+    ////////////////////////////////////////////////////////////////////////////////
+    /// CONSTRUCTORS ///////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Constructs a unit value
+    Value() : type(UNIT), special_form(false), builtin_name(0) { stack_data.object = NULL; }
+
+    // Constructs an integer
+    Value(int i) : type(INT), special_form(false), builtin_name(0) { stack_data.i = i; }
+    // Constructs a floating point value
+    Value(double f) : type(FLOAT), special_form(false), builtin_name(0) { stack_data.f = f; }
+    // Constructs a list
+    Value(std::vector<Value> const &list) : type(LIST), special_form(false), builtin_name(0) {
+        stack_data.object = new ListObject(list);
+    }
+
+    // Copies share the heap object of the original
+    Value(Value const &other) : type(other.type), special_form(other.special_form),
+        builtin_name(other.builtin_name), stack_data(other.stack_data) {
+        retain();
+    }
+
+    Value &operator=(Value const &other) {
+        // Take a reference to the other object before releasing ours,
+        // in case the other value lives inside of our object.
+        other.retain();
+        unsigned char other_type = other.type;
+        bool other_special_form = other.special_form;
+        int other_builtin_name = other.builtin_name;
+        Data other_data = other.stack_data;
+
+        release();
+        type = other_type;
+        special_form = other_special_form;
+        builtin_name = other_builtin_name;
+        stack_data = other_data;
+        return *this;
+    }
+
+    ~Value() {
+        release();
+    }
+
+    // Construct a quoted value
+    static Value quote(Value quoted) {
+        Value result;
+        result.type = QUOTE;
+
+        // The first position in the list is
+        // used to store the quoted expression.
+        result.stack_data.object = new ListObject(std::vector<Value>(1, quoted));
+        return result;
+    }
+
+    // Construct an atom
+    static Value atom(std::string const &s) {
+        return atom(intern(s));
+    }
+
+    // Construct an atom from an interned symbol id
+    static Value atom(int symbol) {
+        Value result;
+        result.type = ATOM;
+
+        // We use the atom slot in the union to store the symbol id.
+        // The atom isn't resolved to a local variable until `resolve` runs.
+        result.stack_data.atom.symbol = symbol;
+        result.stack_data.atom.depth = 0;
+        result.stack_data.atom.slot = -1;
+        return result;
+    }
+
+    // Construct a numeric vector from its heap object
+    static Value vector(VectorObject *object) {
+        Value result;
+        result.type = VECTOR;
+        result.stack_data.object = object;
+        return result;
+    }
+
+    // Construct a file handle from its heap object
+    static Value file(FileObject *object) {
+        Value result;
+        result.type = HANDLE;
+        result.stack_data.object = object;
+        return result;
+    }
+
+    // Construct a view of some bytes from its heap object
+    static Value view(ViewObject *object) {
+        Value result;
+        result.type = VIEW;
+        result.stack_data.object = object;
+        return result;
+    }
+
+    // Construct a dict or a set from its heap object
+    static Value map(MapObject *object) {
+        Value result;
+        result.type = MAP;
+        result.stack_data.object = object;
+        return result;
+    }
+
+    // Construct a string builder from its heap object
+    static Value builder(BuilderObject *object) {
+        Value result;
+        result.type = BUILDER;
+        result.stack_data.object = object;
+        return result;
+    }
+
+    // Construct a task or a channel from its heap object
+    static Value task(TaskObject *object);
+    static Value channel(ChannelObject *object);
+
+    // Construct a string
+    static Value string(std::string const &s) {
+        Value result;
+        result.type = STRING;
+
+        // The text is stored in a string object.
+        result.stack_data.object = new StringObject(s);
+        return result;
+    }
+
+    // Construct a lambda function
+    Value(std::vector<Value> const &params, Value const &ret, Environment const &env)
+        : type(LAMBDA), special_form(false), builtin_name(0) {
+        // We store the params and the result in the list of the object
+        // instead of having dedicated members. This is to save memory.
+        std::vector<Value> items;
+        items.push_back(Value(params));
+        items.push_back(ret);
+        LambdaObject *lambda = new LambdaObject(items);
+        stack_data.object = lambda;
+
+        // Lambdas capture only variables that they know they will use.
+        std::vector<int> used_atoms;
+        ret.get_used_atoms(used_atoms);
+        for (size_t i=0; i<used_atoms.size(); i++) {
+            // If the environment has a symbol that this lambda uses, capture it.
+            if (env.has(used_atoms[i]))
+                lambda->scope.capture(used_atoms[i], env.get(used_atoms[i]));
+        }
+
+        // Resolved references to the locals of enclosing lambdas
+        // are read straight out of their frames, so capture those too.
+        lambda->scope.capture_frames(env);
+
+        // Calls get a frame with room for the parameters and every local the
+        // body defines, so it doesn't have to grow. This may overestimate.
+        FrameLayout layout;
+        layout.size = params.size();
+        ret.declare_locals(layout);
+        lambda->frame_size = layout.size;
+
+        // Atoms bound in the frame resolve differently in each call, so call sites can't cache them
+        for (size_t i=0; i<params.size(); i++)
+            if (params[i].is_atom()) binding_versions().shadow(params[i].as_symbol());
+        for (std::map<int, int>::const_iterator i=layout.slots.begin(); i!=layout.slots.end(); i++)
+            binding_versions().shadow(i->first);
+
+        // Any other atom besides the parameters and the locals the body defines
+        // might be looked up in the scope the lambda is called from. The locals
+        // are left out, so a tail call from a body that defines them still
+        // replaces the current call, and the callee's `define` binds its own copy.
+        used_atoms.clear();
+        ret.get_used_atoms(used_atoms, true);
+        for (size_t i=0; i<used_atoms.size(); i++) {
+            bool is_param = false;
+            for (size_t j=0; j<params.size(); j++)
+                if (params[j].is_atom() && params[j].as_symbol() == used_atoms[i])
+                    is_param = true;
+
+            if (!is_param && layout.find(used_atoms[i]) < 0 && !env.has(used_atoms[i]))
+                lambda->dynamic.push_back(used_atoms[i]);
+        }
+    }
+
+    // Construct a builtin function. Special forms are passed
+    // their arguments without evaluating them first.
+    Value(std::string name, Builtin b, bool special_form=false)
+        : type(BUILTIN), special_form(special_form), builtin_name(intern(name)) {
+        // The name of the builtin is stored as a symbol next to the
+        // type tag, and the function pointer is stored in the union.
+        stack_data.fn = b;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    /// C++ INTEROP METHODS ////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Add the atoms used in a given Value to `atoms`, without repeating any.
+    // Resolved locals are left out unless `locals` is set.
+    void get_used_atoms(std::vector<int> &atoms, bool locals=false) const {
+        switch (type) {
+        case QUOTE:
+            // The data for a quote is stored in the
+            // first slot of the list member.
+            list()[0].get_used_atoms(atoms, locals);
+            return;
+        case ATOM:
+            // If this is an atom, add it to the list
+            // of used atoms in this expression.
+            // Resolved locals are found in the lambda frames instead.
+            if ((locals || !is_local()) && std::find(atoms.begin(), atoms.end(), as_symbol()) == atoms.end())
+                atoms.push_back(as_symbol());
+            return;
+        case LAMBDA:
+            // If this is a lambda, get the list of used atoms in the body
+            // of the expression.
+            list()[1].get_used_atoms(atoms, locals);
+            return;
+        case LIST:
+            // If this is a list, add each of the atoms used in all
+            // of the elements in the list.
+            for (size_t i=0; i<list().size(); i++)
+                list()[i].get_used_atoms(atoms, locals);
+            return;
         default:
-            // We don't know how to display whatever type this is.
-            // This isn't the users fault, this is just unhandled.
-            // This should never be reached.
-            throw Error(*this, Environment(), INTERNAL_ERROR);
+            return;
         }
     }
 
-    std::string debug() const {
-        std::string result;
-        switch (type) {
-        case QUOTE:
-            return "'" + list[0].debug();
-        case ATOM:
-            return str;
-        case INT:
-            return to_string(stack_data.i);
-        case FLOAT:
-            return to_string(stack_data.f);
-        case STRING:
-            for (size_t i=0; i<str.length(); i++) {
-                if (str[i] == '"') result += "\\\"";
-                else result.push_back(str[i]);
-            }
-            return "\"" + result + "\"";
-        case LAMBDA:
-            for (size_t i=0; i<list.size(); i++) {
-                result += list[i].debug();
-                if (i < list.size()-1) result += " ";
-            }
-            return "(lambda " + result + ")";
-        case LIST:
-            for (size_t i=0; i<list.size(); i++) {
-                result += list[i].debug();
-                if (i < list.size()-1) result += " ";
-            }
-            return "(" + result + ")";
-        case BUILTIN:
-            return "<" + str + " at " + to_string(long(stack_data.b)) + ">";
-        case UNIT:
-            return "@";
-        default:
-            // We don't know how to debug whatever type this is.
-            // This isn't the users fault, this is just unhandled.
-            // This should never be reached.
-            throw Error(*this, Environment(), INTERNAL_ERROR);
-        }
-    }
+    // The heap object this value refers to, or NULL if it doesn't have one
+    Object *heap_object() const {
+        return is_heap()? stack_data.object : NULL;
+    }
+
+    // Is this a builtin function?
+    bool is_builtin() const {
+        return type == BUILTIN;
+    }
+
+    // Is this a lambda?
+    bool is_lambda() const {
+        return type == LAMBDA;
+    }
+
+    // Does this value have the same type as another? Unlike for `==`, ints and floats don't.
+    bool is_same_type(Value const &other) const {
+        return type == other.type;
+    }
+
+    // Get a copy of this lambda that remembers the results of its last `limit` calls
+    Value memoized(size_t limit) const;
+    // Get the results a memoized lambda remembers, or NULL if this isn't one
+    MemoTable *memo_table() const {
+        return type == LAMBDA? lambda()->memo : NULL;
+    }
+
+    // Is this a builtin that takes its arguments unevaluated?
+    bool is_special_form() const {
+        return type == BUILTIN && special_form;
+    }
+
+    // Get the function of a builtin, or NULL if this isn't a builtin
+    Builtin builtin_function() const {
+        return type == BUILTIN? stack_data.fn : NULL;
+    }
+
+    // Run this lambda's body as the given bytecode chunk when it's called
+    void set_compiled_body(int chunk) {
+        if (type != LAMBDA)
+            throw Error(*this, INTERNAL_ERROR);
+        lambda()->chunk = chunk;
+    }
+
+    // Name this lambda after an atom it's defined as, if it doesn't have a name yet.
+    // The profiler reports calls to the lambda under this name.
+    void set_lambda_name(Value const &name) const {
+        if (type == LAMBDA && name.is_atom() && lambda()->name < 0 && !workers_running)
+            lambda()->name = name.as_symbol();
+    }
+
+    // Apply this as a function to a list of arguments in a given environment.
+    Value apply(Args args, Environment &env) const;
+    // Apply this as a function without looking for the result of an earlier call,
+    // even if this is a memoized lambda.
+    Value apply_function(Args args, Environment &env) const;
+    // Evaluate this value as lisp code.
+    Value eval(Environment &env) const;
+    // Evaluate this value as the body of a lambda. If it ends in a call
+    // to a lambda, the call is stored in `call` for `apply` to make,
+    // instead of being made on top of the current call.
+    Value eval_tail(Environment &env, TailCall &call) const;
+    // Evaluate the head of this call, or get the function it
+    // resolved to the last time, if the atom wasn't redefined since.
+    Value eval_head(Environment &env) const;
+    // Evaluate this loop invariant call, or get the value
+    // it had the last time in this run of its loop.
+    Value eval_invariant(Environment &env) const;
+
+    bool is_number() const {
+        return type == INT || type == FLOAT;
+    }
+
+    // Get the "truthy" boolean value of this value.
+    bool as_bool() const {
+        return *this != Value(0);
+    }
+
+    // Get this item's integer value
+    int as_int() const {
+        return cast_to_int().stack_data.i;
+    }
+
+    // Get this item's floating point value
+    double as_float() const {
+        return cast_to_float().stack_data.f;
+    }
+
+    // Get this item's string value
+    std::string as_string() const {
+        // Views are copied out into strings
+        if (type == VIEW)
+            return std::string(as_view()->data, as_view()->length);
+        // If this item is not a string, throw a cast error.
+        if (type != STRING)
+            throw Error(*this, BAD_CAST);
+        return str();
+    }
+
+    // Is this a string, or a view of some bytes?
+    bool is_text() const {
+        return type == STRING || type == VIEW;
+    }
+
+    // Get the bytes of a string or a view, without copying them
+    const char *text_data(size_t &length) const {
+        if (type == VIEW) {
+            length = as_view()->length;
+            return as_view()->data;
+        }
+        if (type != STRING)
+            throw Error(*this, BAD_CAST);
+        length = str().size();
+        return str().data();
+    }
+
+    // Get the heap object of a dict or a set
+    MapObject *as_map() const {
+        if (type != MAP)
+            throw Error(*this, BAD_CAST);
+        return static_cast<MapObject *>(stack_data.object);
+    }
+
+    // Set a key of a dict to a value, or add a key to a set.
+    // Other values sharing the map don't see the change.
+    void set_key(Value const &key, Value const &value) {
+        MapObject *object = as_map();
+        if (object->is_shared()) {
+            // The copy shares the entries, and adds to them in place if it can
+            MapObject *copy = new MapObject(*object);
+            release();
+            stack_data.object = copy;
+            object = copy;
+        }
+        object->set(key, value);
+    }
+
+    // Get the heap object of a string builder
+    BuilderObject *as_builder() const {
+        if (type != BUILDER)
+            throw Error(*this, BAD_CAST);
+        return static_cast<BuilderObject *>(stack_data.object);
+    }
+
+    // Get the heap object of a task or a channel
+    TaskObject *as_task() const;
+    ChannelObject *as_channel() const;
+
+    // Get the heap object of a file handle
+    FileObject *as_file() const {
+        if (type != HANDLE)
+            throw Error(*this, BAD_CAST);
+        return static_cast<FileObject *>(stack_data.object);
+    }
+
+    // Get the heap object of a view
+    ViewObject *as_view() const {
+        if (type != VIEW)
+            throw Error(*this, BAD_CAST);
+        return static_cast<ViewObject *>(stack_data.object);
+    }
+
+    // Get this item's atom value
+    std::string as_atom() const {
+        return symbol_name(as_symbol());
+    }
+
+    // Get the interned symbol id of this atom
+    int as_symbol() const {
+        // If this item is not an atom, throw a cast error.
+        if (type != ATOM)
+            throw Error(*this, BAD_CAST);
+        return stack_data.atom.symbol;
+    }
+
+    // Is this an atom?
+    bool is_atom() const {
+        return type == ATOM;
+    }
+
+    // Has the resolver bound this atom to a slot in a lambda frame?
+    bool is_local() const {
+        return type == ATOM && stack_data.atom.slot >= 0;
+    }
+
+    // The number of lambdas out from the current one this local belongs to
+    int local_depth() const {
+        return stack_data.atom.depth;
+    }
+
+    // The slot of this local in its lambda's frame
+    int local_slot() const {
+        return stack_data.atom.slot;
+    }
+
+    // Resolve the atoms in this expression that refer to lambda parameters
+    // and locals to (depth, slot) pairs in the enclosing lambda frames.
+    void resolve(std::vector<FrameLayout> &scopes);
+
+    // Replace the calls to pure builtins with constant arguments in this
+    // expression by their results, and mark the calls in the bodies of
+    // its loops that are invariant in the loop.
+    void optimize();
+
+    // Get this item's list value
+    std::vector<Value> as_list() const {
+        // If this item is not a list, throw a cast error.
+        if (type != LIST)
+            throw Error(*this, BAD_CAST);
+        return list().to_vector();
+    }
+
+    // Get a view of this list's items, without copying them
+    Args as_items() const {
+        // If this item is not a list, throw a cast error.
+        if (type != LIST)
+            throw Error(*this, BAD_CAST);
+        return list();
+    }
+
+    // Get the heap object of a numeric vector
+    VectorObject *as_vector() const {
+        if (type != VECTOR)
+            throw Error(*this, BAD_CAST);
+        return static_cast<VectorObject *>(stack_data.object);
+    }
+
+    // Get the `count` items of this list starting at `start`.
+    // The result shares this list's items instead of copying them.
+    Value slice(size_t start, size_t count) const {
+        if (type != LIST)
+            throw Error(*this, MISMATCHED_TYPES);
+
+        ListObject *object = list_object();
+        Value result;
+        result.type = LIST;
+        // Slices of lazy ranges are lazy too
+        if (object->buffer == NULL)
+            result.stack_data.object = new ListObject(object->first + int(start), count);
+        else result.stack_data.object = new ListObject(object->buffer, object->start + start, count);
+        return result;
+    }
+
+    // Construct a lazy range of `count` integers starting at `first`
+    static Value lazy_range(int first, size_t count) {
+        Value result;
+        result.type = LIST;
+        result.stack_data.object = new ListObject(first, count);
+        return result;
+    }
+
+    // Get the number of items in this list, without building a lazy range
+    size_t list_length() const {
+        if (type == VECTOR)
+            return as_vector()->size();
+        if (type == VIEW)
+            return as_view()->length;
+        if (type != LIST)
+            throw Error(*this, BAD_CAST);
+        return list_object()->count;
+    }
+
+    // Get an item of this list, without building a lazy range
+    Value list_item(size_t i) const {
+        if (type == VECTOR) {
+            VectorObject *vector = as_vector();
+            return vector->floats? Value(vector->f[i]) : Value(vector->i[i]);
+        }
+        // The items of a view are its bytes
+        if (type == VIEW)
+            return Value(int((unsigned char)as_view()->data[i]));
+        if (type != LIST)
+            throw Error(*this, BAD_CAST);
+        ListObject *object = list_object();
+        if (object->buffer == NULL)
+            return Value(object->first + int(i));
+        return object->buffer->items[object->start + i];
+    }
+
+    // Push an item to the end of this list
+    void push(Value const &val) {
+        // If this item is not a list, you cannot push to it.
+        // Throw an error.
+        if (type != LIST)
+            throw Error(*this, MISMATCHED_TYPES);
+        
+        ListObject *object = list_object();
+        ListBuffer *buffer = object->get_buffer();
+        std::vector<Value> &items = buffer->items;
+        // If this list ends at the end of its buffer, and the buffer has room,
+        // the item can be appended in place. Other lists sharing the buffer
+        // are shorter than the buffer, so they don't see the new item.
+        // Other threads might be appending to the same buffer, so
+        // this isn't done while the thread pool is running.
+        if (!workers_running && object->start + object->count == items.size()
+                && items.size() < items.capacity()) {
+            items.push_back(val);
+            set_list_object(buffer, object->start, object->count + 1);
+            return;
+        }
+
+        // Otherwise, copy this list's items into a new buffer with room to grow.
+        // Buffers are never grown in place, so older lists' views stay valid.
+        ListBuffer *grown = new ListBuffer;
+        grown->items.reserve(object->count * 2 + 4);
+        grown->items.insert(grown->items.end(), items.begin() + object->start,
+            items.begin() + object->start + object->count);
+        grown->items.push_back(val);
+        set_list_object(grown, 0, grown->items.size());
+        // The new list object took its own reference to the buffer
+        grown->release();
+    }
+
+    // Push an item from the end of this list
+    Value pop() {
+        // If this item is not a list, you cannot pop from it.
+        // Throw an error.
+        if (type != LIST)
+            throw Error(*this, MISMATCHED_TYPES);
+        
+        // Remember the last item in the list
+        Value result = list()[list().size()-1];
+        // Remove it from this instance, leaving the buffer to the other lists sharing it
+        ListObject *object = list_object();
+        set_list_object(object->get_buffer(), object->start, object->count - 1);
+        // Return the remembered value
+        return result;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    /// TYPECASTING METHODS ////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Cast this to an integer value
+    Value cast_to_int() const {
+        switch (type) {
+        case INT: return *this;
+        case FLOAT: return Value(int(stack_data.f));
+        // Only ints and floats can be cast to an int
+        default:
+            throw Error(*this, BAD_CAST);
+        }
+    }
+
+    // Cast this to a floating point value
+    Value cast_to_float() const {
+        switch (type) {
+        case FLOAT: return *this;
+        case INT: return Value(double(stack_data.i));
+        // Only ints and floats can be cast to a float
+        default:
+            throw Error(*this, BAD_CAST);
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    /// COMPARISON OPERATIONS //////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Get a hash of this value. Values that are equal have the same hash,
+    // so ints hash the same as the floats they're equal to, and views the same
+    // as strings. Maps' hashes don't depend on the order of their keys.
+    unsigned hash() const {
+        switch (type) {
+        case INT:
+            return unsigned(stack_data.i) * 2654435761u;
+        case FLOAT:
+            if (stack_data.f >= INT_MIN && stack_data.f <= INT_MAX && stack_data.f == double(int(stack_data.f)))
+                return unsigned(int(stack_data.f)) * 2654435761u;
+            return hash_bytes((const char *)&stack_data.f, sizeof(double));
+        case STRING:
+        case VIEW: {
+            size_t length;
+            const char *data = text_data(length);
+            return hash_bytes(data, length);
+        }
+        case ATOM:
+            return unsigned(stack_data.atom.symbol) * 2246822519u + 1;
+        case QUOTE:
+            return combine_hashes(3, list()[0].hash());
+        case LAMBDA: {
+            unsigned result = 5;
+            for (size_t i=0; i<list().size(); i++)
+                result = combine_hashes(result, list()[i].hash());
+            return result;
+        }
+        case LIST: {
+            unsigned result = 7;
+            for (size_t i=0; i<list_length(); i++)
+                result = combine_hashes(result, list_item(i).hash());
+            return result;
+        }
+        case VECTOR: {
+            VectorObject *vector = as_vector();
+            unsigned result = vector->floats? 11 : 13;
+            for (size_t i=0; i<vector->size(); i++)
+                result = combine_hashes(result, list_item(i).hash());
+            return result;
+        }
+        case MAP: {
+            MapObject *map = as_map();
+            unsigned result = map->is_set? 17 : 19;
+            for (size_t i=0; i<map->count; i++)
+                if (map->is_latest(i))
+                    result += combine_hashes(map->buffer->hashes[i], map->buffer->values[i].hash());
+            return result;
+        }
+        case BUILTIN:
+            return unsigned(long(stack_data.fn));
+        case UNIT:
+            return 0;
+        default:
+            // Files, builders, tasks, and channels are only equal to themselves
+            return unsigned(long(stack_data.object)) * 2654435761u;
+        }
+    }
+
+    bool operator==(Value const &other) const {
+        // Numbers of the same type are compared directly
+        if (type == INT && other.type == INT) return stack_data.i == other.stack_data.i;
+        if (type == FLOAT && other.type == FLOAT) return stack_data.f == other.stack_data.f;
+
+        // If either of these values are floats, promote the
+        // other to a float, and then compare for equality.
+        if (type == FLOAT && other.type == INT) return *this == other.cast_to_float();
+        else if (type == INT && other.type == FLOAT) return this->cast_to_float() == other;
+        // Views are equal to strings and views with the same text
+        else if ((type == VIEW && other.is_text()) || (other.type == VIEW && is_text()))
+            return as_string() == other.as_string();
+        // If the values types aren't equal, then they cannot be equal.
+        else if (type != other.type) return false;
+
+        switch (type) {
+        case FLOAT:
+            return stack_data.f == other.stack_data.f;
+        case INT:
+            return stack_data.i == other.stack_data.i;
+        case BUILTIN:
+            return stack_data.fn == other.stack_data.fn;
+        case STRING:
+            return str() == other.str();
+        case ATOM:
+            // Atoms are interned, so we only compare their ids.
+            return stack_data.atom.symbol == other.stack_data.atom.symbol;
+        case LAMBDA:
+            // Lambdas store their parameters and body in the list member
+            if (list().size() != other.list().size()) return false;
+            for (size_t i=0; i<list().size(); i++)
+                if (list()[i] != other.list()[i]) return false;
+            return true;
+        case LIST:
+            // Lists are compared item by item, without building lazy ranges
+            if (list_length() != other.list_length()) return false;
+            for (size_t i=0; i<list_length(); i++)
+                if (list_item(i) != other.list_item(i)) return false;
+            return true;
+        case QUOTE:
+            // The values for quotes are stored in the
+            // first slot of the list member.
+            return list()[0] == other.list()[0];
+        case VECTOR:
+            // Vectors of floats are never equal to vectors of ints
+            return as_vector()->floats == other.as_vector()->floats
+                && as_vector()->f == other.as_vector()->f
+                && as_vector()->i == other.as_vector()->i;
+        case MAP: {
+            // Maps are equal if they have the same keys, set to the same values
+            MapObject *map = as_map(), *other_map = other.as_map();
+            if (map->is_set != other_map->is_set || map->size != other_map->size) return false;
+            for (size_t i=0; i<map->count; i++) {
+                if (!map->is_latest(i)) continue;
+                Value const *value = other_map->find(map->buffer->keys[i]);
+                if (value == NULL || *value != map->buffer->values[i]) return false;
+            }
+            return true;
+        }
+        case HANDLE:
+        case BUILDER:
+        case TASK:
+        case CHANNEL:
+            // Files, builders, tasks, and channels are only equal to themselves
+            return stack_data.object == other.stack_data.object;
+        default:
+            return true;
+        }
+    }
+    
+    bool operator!=(Value const &other) const {
+        return !(*this == other);
+    }
+
+    // bool operator<(Value const &other) const {
+    //     if (other.type != FLOAT && other.type != INT)
+    //         throw Error(*this, INVALID_BIN_OP);
+
+    //     switch (type) {
+    //     case FLOAT:
+    //         return stack_data.f < other.cast_to_float().stack_data.f;
+    //     case INT:
+    //         if (other.type == FLOAT)
+    //             return cast_to_float().stack_data.f < other.stack_data.f;
+    //         else return stack_data.i < other.stack_data.i;
+    //     default:
+    //         throw Error(*this, INVALID_ORDER);
+    //     }
+    // }
+    
+    ////////////////////////////////////////////////////////////////////////////////
+    /// ORDERING OPERATIONS ////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////
+
+    bool operator>=(Value const &other) const {
+        if (type == INT && other.type == INT) return stack_data.i >= other.stack_data.i;
+        if (type == FLOAT && other.type == FLOAT) return !(stack_data.f < other.stack_data.f);
+        return !(*this < other);
+    }
+    
+    bool operator<=(Value const &other) const {
+        if (type == INT && other.type == INT) return stack_data.i <= other.stack_data.i;
+        if (type == FLOAT && other.type == FLOAT)
+            return stack_data.f == other.stack_data.f || stack_data.f < other.stack_data.f;
+        return (*this == other) || (*this < other);
+    }
+    
+    bool operator>(Value const &other) const {
+        if (type == INT && other.type == INT) return stack_data.i > other.stack_data.i;
+        return !(*this <= other);
+    }
+
+    bool operator<(Value const &other) const {
+        // Numbers of the same type are compared directly
+        if (type == INT && other.type == INT) return stack_data.i < other.stack_data.i;
+        if (type == FLOAT && other.type == FLOAT) return stack_data.f < other.stack_data.f;
+
+        // Other type must be a float or an int
+        if (other.type != FLOAT && other.type != INT)
+            throw Error(*this, INVALID_BIN_OP);
+
+        switch (type) {
+        case FLOAT:
+            // If this is a float, promote the other value to a float and compare.
+            return stack_data.f < other.cast_to_float().stack_data.f;
+        case INT:
+            // If the other value is a float, promote this value to a float and compare.
+            if (other.type == FLOAT)
+                return cast_to_float().stack_data.f < other.stack_data.f;
+            // Otherwise compare the integer values
+            else return stack_data.i < other.stack_data.i;
+        default:
+            // Only allow comparisons between integers and floats
+            throw Error(*this, INVALID_ORDER);
+        }
+    }
+    
+    ////////////////////////////////////////////////////////////////////////////////
+    /// ARITHMETIC OPERATIONS //////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // This function adds two lisp values, and returns the lisp value result.
+    Value operator+(Value const &other) const {
+        // Numbers of the same type skip the promotions and type checks.
+        // A sum of ints that doesn't fit in an int overflows into a float.
+        int result;
+        if (type == INT && other.type == INT) {
+            if (add_ints(stack_data.i, other.stack_data.i, result)) return Value(result);
+            return Value(double(stack_data.i) + other.stack_data.i);
+        }
+        if (type == FLOAT && other.type == FLOAT) return Value(stack_data.f + other.stack_data.f);
+
+        // If the other value's type is the unit type,
+        // don't even bother continuing.
+        // Unit types consume all arithmetic operations.
+        if (other.type == UNIT) return other;
+
+        // Other type must be a float or an int
+        if ((is_number() || other.is_number()) &&
+            !(is_number() && other.is_number()))
+            throw Error(*this, INVALID_BIN_OP);
+
+        switch (type) {
+        case FLOAT:
+            // If one is a float, promote the other by default and do
+            // float addition.
+            return Value(stack_data.f + other.cast_to_float().stack_data.f);
+        case INT:
+            // Two ints were added above, so the other type is a float.
+            // Go ahead and promote this expression before continuing with the addition.
+            return Value(double(stack_data.i) + other.stack_data.f);
+        case STRING:
+            // If the other value is also a string, do the concat
+            if (other.type == STRING)
+                return Value::string(str() + other.str());
+            // We throw an error if we try to concat anything of non-string type
+            else throw Error(*this, INVALID_BIN_OP);
+        case LIST:
+            // If the other value is also a list, do the concat
+            if (other.type == LIST) {
+                // Maintain the value that will be returned
+                Value result = *this;
+                // Add each item in the other list to the end of this list
+                for (size_t i=0; i<other.list().size(); i++)
+                    result.push(other.list()[i]);
+                return result;
+            
+            } else throw Error(*this, INVALID_BIN_OP);
+        case UNIT:
+            return *this;
+        default:
+            throw Error(*this, INVALID_BIN_OP);
+        }
+    }
+
+    // This function subtracts two lisp values, and returns the lisp value result.
+    Value operator-(Value const &other) const {
+        // Numbers of the same type skip the promotions and type checks
+        int result;
+        if (type == INT && other.type == INT) {
+            if (subtract_ints(stack_data.i, other.stack_data.i, result)) return Value(result);
+            return Value(double(stack_data.i) - other.stack_data.i);
+        }
+        if (type == FLOAT && other.type == FLOAT) return Value(stack_data.f - other.stack_data.f);
+
+        // If the other value's type is the unit type,
+        // don't even bother continuing.
+        // Unit types consume all arithmetic operations.
+        if (other.type == UNIT) return other;
+
+        // Other type must be a float or an int
+        if (other.type != FLOAT && other.type != INT)
+            throw Error(*this, INVALID_BIN_OP);
+
+        switch (type) {
+        case FLOAT:
+            // If one is a float, promote the other by default and do
+            // float subtraction.
+            return Value(stack_data.f - other.cast_to_float().stack_data.f);
+        case INT:
+            // Two ints were subtracted above, so the other type is a float.
+            // Go ahead and promote this expression before continuing with the subtraction
+            return Value(double(stack_data.i) - other.stack_data.f);
+        case UNIT:
+            // Unit types consume all arithmetic operations.
+            return *this;
+        default:
+            // This operation was done on an unsupported type
+            throw Error(*this, INVALID_BIN_OP);
+        }
+    }
+
+    // This function multiplies two lisp values, and returns the lisp value result.
+    Value operator*(Value const &other) const {
+        // Numbers of the same type skip the promotions and type checks
+        int result;
+        if (type == INT && other.type == INT) {
+            if (multiply_ints(stack_data.i, other.stack_data.i, result)) return Value(result);
+            return Value(double(stack_data.i) * other.stack_data.i);
+        }
+        if (type == FLOAT && other.type == FLOAT) return Value(stack_data.f * other.stack_data.f);
+
+        // If the other value's type is the unit type,
+        // don't even bother continuing.
+        // Unit types consume all arithmetic operations.
+        if (other.type == UNIT) return other;
+
+        // Other type must be a float or an int
+        if (other.type != FLOAT && other.type != INT)
+            throw Error(*this, INVALID_BIN_OP);
+        
+        switch (type) {
+        case FLOAT:
+            return Value(stack_data.f * other.cast_to_float().stack_data.f);
+        case INT:
+            // Two ints were multiplied above, so the other type is a float.
+            // Go ahead and promote this expression before continuing with the product
+            return Value(double(stack_data.i) * other.stack_data.f);
+        case UNIT:
+            // Unit types consume all arithmetic operations.
+            return *this;
+        default:
+            // This operation was done on an unsupported type
+            throw Error(*this, INVALID_BIN_OP);
+        }
+    }
+
+    // This function divides two lisp values, and returns the lisp value result.
+    Value operator/(Value const &other) const {
+        // Numbers of the same type skip the promotions and type checks
+        if (type == INT && other.type == INT) {
+            if (other.stack_data.i == 0)
+                throw Error(*this, DIVIDE_BY_ZERO);
+            // The only quotient of ints that doesn't fit in an int
+            if (other.stack_data.i == -1 && stack_data.i == INT_MIN)
+                return Value(-double(INT_MIN));
+            return Value(stack_data.i / other.stack_data.i);
+        }
+        if (type == FLOAT && other.type == FLOAT) return Value(stack_data.f / other.stack_data.f);
+
+        // If the other value's type is the unit type,
+        // don't even bother continuing.
+        // Unit types consume all arithmetic operations.
+        if (other.type == UNIT) return other;
+
+        // Other type must be a float or an int
+        if (other.type != FLOAT && other.type != INT)
+            throw Error(*this, INVALID_BIN_OP);
+
+        switch (type) {
+        case FLOAT:
+            return Value(stack_data.f / other.cast_to_float().stack_data.f);
+        case INT:
+            // Two ints were divided above, so the other type is a float.
+            // Go ahead and promote this expression before continuing with the quotient
+            return Value(double(stack_data.i) / other.stack_data.f);
+        case UNIT:
+            // Unit types consume all arithmetic operations.
+            return *this;
+        default:
+            // This operation was done on an unsupported type
+            throw Error(*this, INVALID_BIN_OP);
+        }
+    }
+
+    // This function finds the remainder of two lisp values, and returns the lisp value result.
+    Value operator%(Value const &other) const {
+        // Ints skip the promotions and type checks
+        if (type == INT && other.type == INT) {
+            if (other.stack_data.i == 0)
+                throw Error(*this, DIVIDE_BY_ZERO);
+            // The remainder is zero, but computing it overflows
+            if (other.stack_data.i == -1) return Value(0);
+            return Value(stack_data.i % other.stack_data.i);
+        }
+
+        // If the other value's type is the unit type,
+        // don't even bother continuing.
+        // Unit types consume all arithmetic operations.
+        if (other.type == UNIT) return other;
+
+        // Other type must be a float or an int
+        if (other.type != FLOAT && other.type != INT)
+            throw Error(*this, INVALID_BIN_OP);
+        
+        switch (type) {
+        // If we support libm, we can find the remainder of floating point values.
+        #ifdef HAS_LIBM
+        case FLOAT:
+            return Value(fmod(stack_data.f, other.cast_to_float().stack_data.f));
+        case INT:
+            // The remainder of two ints was found above, so the other type is a float
+            return Value(fmod(double(stack_data.i), other.stack_data.f));
+
+        #else
+        case INT:
+            // If we do not support libm, we have to throw errors for floating point values.
+            // The remainder of two ints was found above, so the other type is a float
+            throw Error(other, NO_LIBM_SUPPORT);
+        #endif
+
+        case UNIT:
+            // Unit types consume all arithmetic operations.
+            return *this;
+        default:
+            // This operation was done on an unsupported type
+            throw Error(*this, INVALID_BIN_OP);
+        }
+    }
+
+    // Add up a list of values. Sums of numbers are kept as machine numbers
+    // instead of values, until an item isn't a number or an int sum overflows.
+    static Value sum(Args items) {
+        Value acc = items[0];
+        size_t i = 1;
+        if (acc.type == INT) {
+            int n = acc.stack_data.i;
+            while (i < items.size() && items[i].type == INT && add_ints(n, items[i].stack_data.i, n))
+                i++;
+            acc = Value(n);
+        }
+        // Adding a float, or overflowing, makes the sum a float
+        if (i < items.size() && acc.is_number() && items[i].is_number())
+            acc = acc + items[i++];
+        if (acc.type == FLOAT) {
+            double f = acc.stack_data.f;
+            while (i < items.size() && items[i].is_number())
+                f += items[i++].as_float();
+            acc = Value(f);
+        }
+        // Anything else is added up value by value
+        for (; i<items.size(); i++)
+            acc = acc + items[i];
+        return acc;
+    }
+
+    // Multiply a list of values. Products of numbers are kept as machine numbers
+    // instead of values, until an item isn't a number or an int product overflows.
+    static Value product(Args items) {
+        Value acc = items[0];
+        size_t i = 1;
+        if (acc.type == INT) {
+            int n = acc.stack_data.i;
+            while (i < items.size() && items[i].type == INT && multiply_ints(n, items[i].stack_data.i, n))
+                i++;
+            acc = Value(n);
+        }
+        // Multiplying by a float, or overflowing, makes the product a float
+        if (i < items.size() && acc.is_number() && items[i].is_number())
+            acc = acc * items[i++];
+        if (acc.type == FLOAT) {
+            double f = acc.stack_data.f;
+            while (i < items.size() && items[i].is_number())
+                f *= items[i++].as_float();
+            acc = Value(f);
+        }
+        // Anything else is multiplied value by value
+        for (; i<items.size(); i++)
+            acc = acc * items[i];
+        return acc;
+    }
+
+    // Get the name of the type of this value
+    std::string get_type_name() const {
+        switch (type) {
+        case QUOTE: return QUOTE_TYPE;
+        case ATOM: return ATOM_TYPE;
+        case INT: return INT_TYPE;
+        case FLOAT: return FLOAT_TYPE;
+        case LIST: return LIST_TYPE;
+        case STRING: return STRING_TYPE;
+        case VECTOR: return as_vector()->floats? F64VEC_TYPE : I32VEC_TYPE;
+        case HANDLE: return FILE_TYPE;
+        case VIEW: return VIEW_TYPE;
+        case BUILDER: return BUILDER_TYPE;
+        case MAP: return as_map()->is_set? SET_TYPE : DICT_TYPE;
+        case TASK: return TASK_TYPE;
+        case CHANNEL: return CHANNEL_TYPE;
+        case BUILTIN:
+        case LAMBDA:
+            // Instead of differentiating between
+            // lambda and builtin types, we group them together.
+            // This is because they are both callable.
+            return FUNCTION_TYPE;
+        case UNIT:
+            return UNIT_TYPE;
+        default:
+            // We don't know the name of this type.
+            // This isn't the users fault, this is just unhandled.
+            // This should never be reached.
+            throw Error(*this, INTERNAL_ERROR);
+        }
+    }
+
+    std::string display() const {
+        std::string result;
+        display_to(result);
+        return result;
+    }
+
+    std::string debug() const {
+        std::string result;
+        debug_to(result);
+        return result;
+    }
+
+    // Add the display form of this value to the end of a string.
+    // Only strings, views, and builders display differently from how they debug.
+    void display_to(std::string &out) const {
+        if (type == STRING) out += str();
+        else if (type == VIEW) out.append(as_view()->data, as_view()->length);
+        else if (type == BUILDER) out += as_builder()->text;
+        else debug_to(out);
+    }
+
+    // Get the debug form of this value, cut off after about `length` bytes
+    std::string preview(size_t length) const {
+        std::string result;
+        debug_to(result, length);
+        return result;
+    }
+
+    // Add the debug form of this value to the end of a string. Lists are
+    // written item by item, without building a string for each item.
+    // Once the string is `limit` bytes long, the rest of the items are
+    // left out, so a preview of a big value only looks at its first items.
+    void debug_to(std::string &out, size_t limit=std::string::npos) const {
+        switch (type) {
+        case QUOTE:
+            out += '\'';
+            list()[0].debug_to(out, limit);
+            return;
+        case ATOM:
+            out += symbol_name(stack_data.atom.symbol);
+            return;
+        case INT:
+            append_int(out, stack_data.i);
+            return;
+        case FLOAT:
+            append_float(out, stack_data.f);
+            return;
+        case STRING:
+            out += '"';
+            for (size_t i=0; i<str().length(); i++) {
+                if (out.size() >= limit) {
+                    out += "...";
+                    break;
+                }
+                if (str()[i] == '"') out += "\\\"";
+                else out += str()[i];
+            }
+            out += '"';
+            return;
+        case VIEW:
+            // Views can be as big as the files they map, so only their size is shown
+            out += "<view of " + to_string(as_view()->length) + " bytes>";
+            return;
+        case HANDLE:
+            out += "<file " + as_file()->path + ">";
+            return;
+        case BUILDER:
+            out += "<builder of " + to_string(as_builder()->text.size()) + " bytes>";
+            return;
+        case TASK:
+            out += "<task>";
+            return;
+        case CHANNEL:
+            out += "<channel>";
+            return;
+        case LAMBDA:
+            out += "(lambda ";
+            items_to(out, limit);
+            out += ')';
+            return;
+        case LIST:
+            out += '(';
+            // Lazy ranges are written without building their items
+            if (list_object()->buffer == NULL) {
+                for (size_t i=0; i<list_object()->count; i++) {
+                    if (i > 0) out += ' ';
+                    if (out.size() >= limit) {
+                        out += "...";
+                        break;
+                    }
+                    append_int(out, list_object()->first + int(i));
+                }
+            } else items_to(out, limit);
+            out += ')';
+            return;
+        case VECTOR: {
+            // Vectors are written as the call that builds them
+            VectorObject *vector = as_vector();
+            out += '(';
+            out += vector->floats? F64VEC_TYPE : I32VEC_TYPE;
+            for (size_t i=0; i<vector->size(); i++) {
+                out += ' ';
+                if (out.size() >= limit) {
+                    out += "...";
+                    break;
+                }
+                if (vector->floats) append_float(out, vector->f[i]);
+                else append_int(out, vector->i[i]);
+            }
+            out += ')';
+            return;
+        }
+        case MAP: {
+            // Maps are written as the call that builds them, with their keys in the order they were added
+            MapObject *map = as_map();
+            out += '(';
+            out += map->is_set? SET_TYPE : DICT_TYPE;
+            for (size_t i=0; i<map->count; i++) {
+                if (map->buffer->previous[i] != MapBuffer::NONE) continue;
+                out += ' ';
+                if (out.size() >= limit) {
+                    out += "...";
+                    break;
+                }
+                map->buffer->keys[i].debug_to(out, limit);
+                if (map->is_set) continue;
+                out += ' ';
+                map->latest_value(i).debug_to(out, limit);
+            }
+            out += ')';
+            return;
+        }
+        case BUILTIN:
+            out += "<" + symbol_name(builtin_name) + " at " + to_string(long(stack_data.fn)) + ">";
+            return;
+        case UNIT:
+            out += '@';
+            return;
+        default:
+            // We don't know how to debug whatever type this is.
+            // This isn't the users fault, this is just unhandled.
+            // This should never be reached.
+            throw Error(*this, INTERNAL_ERROR);
+        }
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, Value const &v) {
+        return os << v.display();
+    }
+
+    friend class ImageWriter;
+    friend class ImageReader;
+
+private:
+    // Does this value keep its data in a heap object?
+    bool is_heap() const {
+        return type == QUOTE || type == LIST || type == STRING || type == LAMBDA
+            || type == VECTOR || type == HANDLE || type == VIEW || type == BUILDER || type == MAP
+            || type == TASK || type == CHANNEL;
+    }
+
+    // Can this value, or anything in it, change in place?
+    bool can_change() const;
+
+    // Take a reference to this value's heap object
+    void retain() const {
+        if (is_heap()) stack_data.object->retain();
+    }
+
+    // Give up this value's reference to its heap object
+    void release() {
+        if (is_heap() && stack_data.object->release())
+            delete stack_data.object;
+    }
+
+    // The text of a string
+    std::string const &str() const {
+        return static_cast<StringObject *>(stack_data.object)->str;
+    }
+
+    // Add the debug forms of the items of a list or lambda to a string, separated by spaces
+    void items_to(std::string &out, size_t limit) const {
+        Args items = list();
+        for (size_t i=0; i<items.size(); i++) {
+            if (i > 0) out += ' ';
+            if (out.size() >= limit) {
+                out += "...";
+                break;
+            }
+            items[i].debug_to(out, limit);
+        }
+    }
+
+    // The heap object of a list, quote, or lambda
+    ListObject *list_object() const {
+        return static_cast<ListObject *>(stack_data.object);
+    }
+
+    // The items of a list, the quoted expression of a quote,
+    // or the parameters and body of a lambda
+    Args list() const {
+        ListObject *object = list_object();
+        std::vector<Value> const &items = object->get_buffer()->items;
+        return Args(items.empty()? NULL : &items[0] + object->start, object->count);
+    }
+
+    // The items of a list, copied first if any other value shares them
+    Value *mutable_items() {
+        ListObject *object = list_object();
+        if (object->is_shared() || object->get_buffer()->is_shared()) {
+            object = new ListObject(list().to_vector());
+            release();
+            stack_data.object = object;
+        }
+        std::vector<Value> &items = object->buffer->items;
+        return items.empty()? NULL : &items[0];
+    }
+
+    // Make this list a run of items in a buffer. If other values share
+    // this list's object, this value gets an object of its own.
+    void set_list_object(ListBuffer *buffer, size_t start, size_t count) {
+        ListObject *object = list_object();
+        if (!object->is_shared() && object->buffer == buffer) {
+            object->start = start;
+            object->count = count;
+        } else {
+            ListObject *replacement = new ListObject(buffer, start, count);
+            release();
+            stack_data.object = replacement;
+        }
+    }
+
+    // The heap object of a lambda
+    LambdaObject *lambda() const {
+        return static_cast<LambdaObject *>(stack_data.object);
+    }
+
+    // Resolve the body of a lambda with the given parameter list,
+    // starting at the `body` index of this lambda form.
+    void resolve_lambda(Value const &params, size_t body, std::vector<FrameLayout> &scopes);
+    // Give the names bound by `define`, `defun`, and `for` in the body of a lambda
+    // slots in its frame. This doesn't look inside of nested lambdas.
+    void declare_locals(FrameLayout &layout) const;
+
+    // Mark the calls in this expression that are invariant in a loop,
+    // given the atoms the loop defines. This doesn't look inside of lambdas.
+    void mark_invariants(std::vector<int> const &defined);
+    // Is this a call to a pure builtin that is invariant in a loop,
+    // given the atoms the loop defines?
+    bool is_invariant(std::vector<int> const &defined) const;
+    // Add the atoms this expression defines to a list. Get whether it
+    // can define any atom at all, by calling a lambda, or a builtin like
+    // `eval` or `map` that runs code.
+    bool get_defined_atoms(std::vector<int> &atoms) const;
+
+    enum {
+        QUOTE,
+        ATOM,
+        INT,
+        FLOAT,
+        LIST,
+        STRING,
+        LAMBDA,
+        BUILTIN,
+        UNIT,
+        VECTOR,
+        HANDLE,
+        VIEW,
+        BUILDER,
+        MAP,
+        TASK,
+        CHANNEL
+    };
+
+    // A value is two machine words: the type tag with the data for builtins,
+    // and the union. C++98 can't size an enum, so the tag is stored in a byte.
+    unsigned char type;
+    // Whether a builtin is a special form
+    bool special_form;
+    // The symbol for the name of a builtin
+    int builtin_name;
+
+    union Data {
+        int i;
+        double f;
+        Builtin fn;
+        // Strings, lists, quotes, and lambdas are stored on the heap
+        Object *object;
+        // An atom's symbol id, and its frame address if the
+        // resolver found it to be a lambda parameter or local.
+        struct {
+            int symbol;
+            short depth;
+            short slot;
+        } atom;
+    } stack_data;
+};
+
+ListBuffer::ListBuffer() : Object(true) {}
+
+ListBuffer::~ListBuffer() {}
+
+void ListBuffer::trace(std::vector<Object *> &objects) const {
+    for (size_t i=0; i<items.size(); i++)
+        if (items[i].heap_object() != NULL)
+            objects.push_back(items[i].heap_object());
+}
+
+void ListBuffer::clear() {
+    // The items are released after they're taken out of the buffer
+    std::vector<Value> released;
+    released.swap(items);
+}
+
+MapBuffer::MapBuffer(size_t limit) : Object(true), limit(limit), slots(MIN_SLOTS) {
+    while (slots * 3 < limit * 4) slots *= 2;
+    table = new int[slots];
+    for (size_t i=0; i<slots; i++) table[i] = NONE;
+    keys.reserve(limit);
+    values.reserve(limit);
+    hashes.reserve(limit);
+    previous.reserve(limit);
+    next.reserve(limit);
+}
+
+MapBuffer::~MapBuffer() {
+    delete[] table;
+}
+
+void MapBuffer::trace(std::vector<Object *> &objects) const {
+    for (size_t i=0; i<keys.size(); i++) {
+        if (keys[i].heap_object() != NULL) objects.push_back(keys[i].heap_object());
+        if (values[i].heap_object() != NULL) objects.push_back(values[i].heap_object());
+    }
+}
+
+void MapBuffer::clear() {
+    // The entries are released after they're taken out of the buffer
+    std::vector<Value> released_keys, released_values;
+    released_keys.swap(keys);
+    released_values.swap(values);
+    hashes.clear();
+    previous.clear();
+    next.clear();
+    for (size_t i=0; i<slots; i++) table[i] = NONE;
+}
+
+size_t MapBuffer::probe(Value const &key, unsigned hash) const {
+    size_t slot = hash & (slots - 1);
+    while (table[slot] != NONE && (hashes[table[slot]] != hash || keys[table[slot]] != key))
+        slot = (slot + 1) & (slots - 1);
+    return slot;
+}
+
+int MapBuffer::find(Value const &key, unsigned hash, size_t count) const {
+    // Entries past the count were added by newer maps sharing the buffer
+    int entry = table[probe(key, hash)];
+    while (entry != NONE && size_t(entry) >= count)
+        entry = previous[entry];
+    return entry;
+}
+
+void MapBuffer::add(Value const &key, unsigned hash, Value const &value) {
+    size_t slot = probe(key, hash);
+    int entry = int(keys.size());
+    keys.push_back(key);
+    values.push_back(value);
+    hashes.push_back(hash);
+    previous.push_back(table[slot]);
+    next.push_back(NONE);
+    if (table[slot] != NONE) next[table[slot]] = entry;
+    table[slot] = entry;
+}
+
+MapObject::MapObject(bool is_set) : Object(true), is_set(is_set), buffer(NULL), count(0), size(0) {}
+
+MapObject::MapObject(MapObject const &other)
+    : Object(true), is_set(other.is_set), buffer(other.buffer), count(other.count), size(other.size) {
+    if (buffer != NULL) buffer->retain();
+}
+
+MapObject::~MapObject() {
+    if (buffer != NULL && buffer->release())
+        delete buffer;
+}
+
+void MapObject::trace(std::vector<Object *> &objects) const {
+    if (buffer != NULL) objects.push_back(buffer);
+}
+
+void MapObject::clear() {
+    MapBuffer *released = buffer;
+    buffer = NULL;
+    count = size = 0;
+    if (released != NULL && released->release())
+        delete released;
+}
+
+Value const *MapObject::find(Value const &key) const {
+    if (buffer == NULL) return NULL;
+    int entry = buffer->find(key, key.hash(), count);
+    return entry == MapBuffer::NONE? NULL : &buffer->values[entry];
+}
+
+bool MapObject::is_latest(size_t entry) const {
+    return buffer->next[entry] == MapBuffer::NONE || size_t(buffer->next[entry]) >= count;
+}
+
+Value const &MapObject::latest_value(size_t entry) const {
+    while (!is_latest(entry)) entry = buffer->next[entry];
+    return buffer->values[entry];
+}
+
+void MapObject::set(Value const &key, Value const &value) {
+    unsigned hash = key.hash();
+    int entry = buffer == NULL? MapBuffer::NONE : buffer->find(key, hash, count);
+    // Adding a key a set already has doesn't change it
+    if (is_set && entry != MapBuffer::NONE) return;
+
+    // Just like pushing to a list, other maps sharing the buffer see fewer
+    // entries than it has, so they don't see the new entry. Other threads might
+    // be adding to the same buffer, so this isn't done while the thread pool is running.
+    if (buffer != NULL && !workers_running && count == buffer->keys.size() && !buffer->full()) {
+        buffer->add(key, hash, value);
+        count++;
+        if (entry == MapBuffer::NONE) size++;
+        return;
+    }
+
+    // Otherwise, copy the latest entry of each key into a new buffer with room to grow.
+    // The keys stay in the order they were first added.
+    MapBuffer *grown = new MapBuffer(size * 2 + 4);
+    for (size_t i=0; i<count; i++) {
+        if (buffer->previous[i] != MapBuffer::NONE) continue;
+        bool replaced = entry != MapBuffer::NONE && buffer->hashes[i] == hash && buffer->keys[i] == key;
+        grown->add(buffer->keys[i], buffer->hashes[i], replaced? value : latest_value(i));
+    }
+    if (entry == MapBuffer::NONE) {
+        grown->add(key, hash, value);
+        size++;
+    }
+    MapBuffer *released = buffer;
+    buffer = grown;
+    count = grown->keys.size();
+    if (released != NULL && released->release())
+        delete released;
+}
+
+// The number of times a `while` or `for` loop has started or finished running
+unsigned long loop_runs = 1;
+
+// The function a call site's head atom resolved to, and the version
+// of the atom's binding and the global scope that it was resolved in.
+// Binding versions are shared by every interpreter, so a program run
+// by another interpreter than the last one must look its heads up again.
+struct CallCache {
+    CallCache() : version(BindingVersions::UNCACHED), scope(NULL), invariant(false), run(0) {}
+
+    unsigned version;
+    Environment const *scope;
+    Value function;
+    // A call the optimizer found to be invariant in its loop keeps its
+    // value until a loop starts or finishes. Only calls to pure builtins,
+    // with arguments the loop doesn't redefine, are invariant, and their
+    // values aren't kept while an argument is a builder or a file handle.
+    bool invariant;
+    unsigned long run;
+    Value value;
+};
+
+ListObject::ListObject(std::vector<Value> const &items)
+    : Object(true), buffer(new ListBuffer), start(0), count(items.size()), first(0), cache(NULL) {
+    buffer->items = items;
+}
+
+ListObject::ListObject(ListBuffer *buffer, size_t start, size_t count)
+    : Object(true), buffer(buffer), start(start), count(count), first(0), cache(NULL) {
+    buffer->retain();
+}
+
+ListObject::ListObject(int first, size_t count)
+    : Object(true), buffer(NULL), start(0), count(count), first(first), cache(NULL) {}
+
+ListObject::~ListObject() {
+    delete cache;
+    if (buffer != NULL && buffer->release())
+        delete buffer;
+}
+
+void ListObject::trace(std::vector<Object *> &objects) const {
+    // A lazy range that hasn't been built doesn't refer to anything
+    if (buffer != NULL) objects.push_back(buffer);
+    if (cache != NULL && cache->function.heap_object() != NULL)
+        objects.push_back(cache->function.heap_object());
+    if (cache != NULL && cache->value.heap_object() != NULL)
+        objects.push_back(cache->value.heap_object());
+}
+
+void ListObject::clear() {
+    ListBuffer *released = buffer;
+    buffer = NULL;
+    count = 0;
+    delete cache;
+    cache = NULL;
+    if (released != NULL && released->release())
+        delete released;
+}
+
+ListBuffer *ListObject::get_buffer() {
+    if (buffer == NULL) {
+        // A range shared between threads is only built by one of them
+        static Mutex mutex;
+        SharedLock lock(mutex);
+        if (buffer == NULL) {
+            ListBuffer *built = new ListBuffer;
+            built->items.reserve(count);
+            for (size_t i=0; i<count; i++)
+                built->items.push_back(Value(first + int(i)));
+            // Make sure the items are written before other threads can see the buffer
+            #ifdef HAS_THREADS
+            __sync_synchronize();
+            #endif
+            buffer = built;
+        }
+    }
+    return buffer;
+}
+
+LambdaObject::LambdaObject(std::vector<Value> const &items) : ListObject(items), frame_size(0), chunk(-1), name(-1), memo(NULL) {}
+
+// A call to a lambda in tail position of a lambda body. It's returned to
+// `Value::apply` and made there, so tail calls run in constant stack space.
+struct TailCall {
+    // The lambda to call, or unit if there is no call to make
+    Value function;
+    std::vector<Value> args;
+};
+
+// The number of results a memoized lambda remembers, unless it's given a number
+#define MEMO_SIZE 4096
+
+// The results of a memoized lambda's calls, keyed by their arguments.
+// Once `limit` results are remembered, each new result replaces
+// the one that was used least recently.
+class MemoTable {
+public:
+    MemoTable(size_t limit) : limit(limit), hits(0), misses(0), newest(NONE), oldest(NONE) {}
+
+    // Get a hash of a call's arguments
+    static unsigned hash(Args args);
+    // Get the result of an earlier call with the same arguments, and whether there was one.
+    // The arguments must have the same types: a call with an int isn't the same as with a float.
+    bool find(Args args, unsigned hash, Value &result);
+    // Remember the result of a call
+    void add(std::vector<Value> const &args, unsigned hash, Value const &result);
+
+    size_t size() const { return entries.size(); }
+
+    void trace(std::vector<Object *> &objects) const;
+    void clear();
+
+    size_t limit;
+    unsigned long hits, misses;
+private:
+    struct Entry {
+        std::vector<Value> args;
+        Value result;
+        unsigned hash;
+        // The next entry in the same bucket, and the entries used just before and after this one
+        int chain, older, newer;
+    };
+    enum { NONE = -1, MIN_BUCKETS = 8 };
+
+    // Take an entry out of the order the entries were used in, or put it at the newest end
+    void unlink(int entry);
+    void make_newest(int entry);
+    // Take an entry out of its bucket
+    void unchain(int entry);
+    // Spread the entries over twice as many buckets
+    void rehash();
+
+    std::vector<Entry> entries;
+    std::vector<int> buckets;
+    int newest, oldest;
+    // Worker threads share the table
+    Mutex mutex;
+};
+
+unsigned MemoTable::hash(Args args) {
+    unsigned result = 23;
+    for (size_t i=0; i<args.size(); i++)
+        result = combine_hashes(result, args[i].hash());
+    return result;
+}
+
+bool MemoTable::find(Args args, unsigned hash, Value &result) {
+    SharedLock lock(mutex);
+    for (int i = buckets.empty()? NONE : buckets[hash & (buckets.size() - 1)]; i != NONE; i = entries[i].chain) {
+        Entry const &entry = entries[i];
+        if (entry.hash != hash || entry.args.size() != args.size()) continue;
+        bool same = true;
+        for (size_t j=0; j<args.size() && same; j++)
+            same = entry.args[j].is_same_type(args[j]) && entry.args[j] == args[j];
+        if (!same) continue;
+
+        unlink(i);
+        make_newest(i);
+        hits++;
+        result = entry.result;
+        return true;
+    }
+    misses++;
+    return false;
+}
+
+void MemoTable::add(std::vector<Value> const &args, unsigned hash, Value const &result) {
+    SharedLock lock(mutex);
+    if (limit == 0) return;
+    int i;
+    if (entries.size() < limit) {
+        if (entries.size() >= buckets.size()) rehash();
+        i = int(entries.size());
+        entries.push_back(Entry());
+    } else {
+        // The least recently used result makes room for this one
+        i = oldest;
+        unlink(i);
+        unchain(i);
+    }
+
+    Entry &entry = entries[i];
+    entry.args = args;
+    entry.result = result;
+    entry.hash = hash;
+    int &bucket = buckets[hash & (buckets.size() - 1)];
+    entry.chain = bucket;
+    bucket = i;
+    make_newest(i);
+}
+
+void MemoTable::unlink(int i) {
+    Entry &entry = entries[i];
+    if (entry.older != NONE) entries[entry.older].newer = entry.newer;
+    else oldest = entry.newer;
+    if (entry.newer != NONE) entries[entry.newer].older = entry.older;
+    else newest = entry.older;
+}
+
+void MemoTable::make_newest(int i) {
+    entries[i].older = newest;
+    entries[i].newer = NONE;
+    if (newest != NONE) entries[newest].newer = i;
+    else oldest = i;
+    newest = i;
+}
+
+void MemoTable::unchain(int i) {
+    // Find the link to the entry in its bucket, and skip over the entry
+    int *link = &buckets[entries[i].hash & (buckets.size() - 1)];
+    while (*link != i) link = &entries[*link].chain;
+    *link = entries[i].chain;
+}
+
+void MemoTable::rehash() {
+    buckets.assign(buckets.empty()? size_t(MIN_BUCKETS) : buckets.size() * 2, int(NONE));
+    for (size_t i=0; i<entries.size(); i++) {
+        int &bucket = buckets[entries[i].hash & (buckets.size() - 1)];
+        entries[i].chain = bucket;
+        bucket = int(i);
+    }
+}
+
+void MemoTable::trace(std::vector<Object *> &objects) const {
+    for (size_t i=0; i<entries.size(); i++) {
+        for (size_t j=0; j<entries[i].args.size(); j++)
+            if (entries[i].args[j].heap_object() != NULL)
+                objects.push_back(entries[i].args[j].heap_object());
+        if (entries[i].result.heap_object() != NULL)
+            objects.push_back(entries[i].result.heap_object());
+    }
+}
+
+void MemoTable::clear() {
+    // The entries are released after they're taken out of the table
+    std::vector<Entry> released;
+    released.swap(entries);
+    buckets.clear();
+    newest = oldest = NONE;
+}
+
+Value Value::memoized(size_t limit) const {
+    if (type != LAMBDA)
+        throw Error(*this, MISMATCHED_TYPES);
+    LambdaObject *original = lambda();
+    LambdaObject *copy = new LambdaObject(list().to_vector());
+    copy->scope = original->scope;
+    copy->frame_size = original->frame_size;
+    copy->dynamic = original->dynamic;
+    copy->chunk = original->chunk;
+    copy->name = original->name;
+    copy->memo = new MemoTable(limit);
+
+    Value result;
+    result.type = LAMBDA;
+    result.stack_data.object = copy;
+    return result;
+}
+
+LambdaObject::~LambdaObject() {
+    delete memo;
+}
+
+void LambdaObject::trace(std::vector<Object *> &objects) const {
+    ListObject::trace(objects);
+    scope.trace(objects);
+    if (memo != NULL) memo->trace(objects);
+}
+
+void LambdaObject::clear() {
+    ListObject::clear();
+    scope.clear();
+    if (memo != NULL) memo->clear();
+}
+
+// The number of bytes of each value that's shown when an error or a scope is printed.
+// Scopes are printed in errors, where a value could be a list of millions of items.
+#define PREVIEW_LENGTH 100
+
+// The cause of an error, and the scope it was thrown in.
+// While the scope is alive this only points to it, and the scope
+// is printed into `scope_text` when it's destroyed or overwritten.
+class ErrorInfo : public Object {
+public:
+    ErrorInfo(Value const &cause, Environment const *scope);
+
+    Value cause;
+    Environment const *scope;
+    std::string scope_text;
+};
+
+ErrorInfo::ErrorInfo(Value const &cause, Environment const *scope) : cause(cause), scope(scope) {
+    if (scope == NULL) scope_text = "{ }";
+}
+
+// Errors from different threads may be thrown in the same scope.
+Mutex &error_mutex() {
+    static Mutex mutex;
+    return mutex;
+}
+
+Error::Error(Value const &v, Environment const &env, const char *msg) : info(new ErrorInfo(v, &env)), msg(msg) {
+    SharedLock lock(error_mutex());
+    // Only the latest error thrown in a scope keeps a handle on it
+    if (env.error != NULL)
+        env.detach_error();
+    info->retain();
+    env.error = info;
+}
+
+Error::Error(Value const &v, const char *msg) : info(new ErrorInfo(v, NULL)), msg(msg) {}
+
+Error::Error(Error const &other) : info(other.info), msg(other.msg) {
+    info->retain();
+}
+
+Error &Error::operator=(Error const &other) {
+    other.info->retain();
+    if (info->release()) delete info;
+    info = other.info;
+    msg = other.msg;
+    return *this;
+}
+
+Error::~Error() {
+    if (info->release()) delete info;
+}
+
+std::string Error::description() {
+    // If the scope is still alive, it hasn't changed since the error was thrown
+    std::string scope = info->scope_text;
+    if (info->scope != NULL) {
+        std::ostringstream ss;
+        ss << *info->scope;
+        scope = ss.str();
+    }
+    return "error: the expression `" + info->cause.preview(PREVIEW_LENGTH) + "` failed in scope " + scope + " with message \"" + msg + "\"";
+}
+
+Frame::Frame(Frame const &other) : symbols(NULL), slots(NULL), count(0), capacity(0), heap(false), arena(NULL) {
+    *this = other;
+}
+
+Frame &Frame::operator=(Frame const &other) {
+    if (this == &other) return *this;
+    clear();
+    reserve(other.count, NULL);
+    for (; count<other.count; count++) {
+        new (slots + count) Value(other.slots[count]);
+        symbols[count] = other.symbols[count];
+    }
+    return *this;
+}
+
+void Frame::assign(Args params, Args args, size_t reserved, Arena &in) {
+    clear();
+    reserve(std::max(reserved, args.size()), &in);
+    for (; count<args.size(); count++) {
+        new (slots + count) Value(args[count]);
+        symbols[count] = params[count].as_symbol();
+    }
+}
+
+void Frame::resize(size_t n) {
+    // A frame in the arena has other calls' memory after it, so it grows into the heap
+    if (n > capacity)
+        reserve(std::max(n, capacity * 2), NULL);
+    for (; count<n; count++) {
+        new (slots + count) Value();
+        symbols[count] = -1;
+    }
+}
+
+void Frame::clear() {
+    for (size_t i=0; i<count; i++)
+        slots[i].~Value();
+    if (heap) operator delete(slots);
+    if (arena != NULL) arena->release(mark);
+    slots = NULL;
+    symbols = NULL;
+    count = capacity = 0;
+    heap = false;
+    arena = NULL;
+}
+
+void Frame::reserve(size_t n, Arena *in) {
+    // The values and the symbols share one allocation, values first
+    size_t bytes = n * (sizeof(Value) + sizeof(int));
+    Value *new_slots;
+    if (in != NULL) {
+        // Only the first allocation of a frame can be in the arena
+        arena = in;
+        mark = in->mark();
+        new_slots = (Value *)in->allocate(bytes);
+    } else new_slots = (Value *)operator new(bytes);
+    int *new_symbols = (int *)(new_slots + n);
+
+    for (size_t i=0; i<count; i++) {
+        new (new_slots + i) Value(slots[i]);
+        slots[i].~Value();
+        new_symbols[i] = symbols[i];
+    }
+    if (heap) operator delete(slots);
+
+    slots = new_slots;
+    symbols = new_symbols;
+    capacity = n;
+    heap = in == NULL;
+}
+
+// A buffer of values in the arena of the calling thread,
+// which is freed at the end of the scope it's declared in.
+class ArenaBuffer {
+public:
+    ArenaBuffer(size_t size) : arena(::arena()), mark(arena.mark()), count(0) {
+        items = (Value *)arena.allocate(size * sizeof(Value));
+        for (; count<size; count++)
+            new (items + count) Value();
+    }
+    ~ArenaBuffer() {
+        for (size_t i=0; i<count; i++)
+            items[i].~Value();
+        arena.release(mark);
+    }
+
+    Value *items;
+private:
+    Arena &arena;
+    Arena::Mark mark;
+    size_t count;
+
+    ArenaBuffer(ArenaBuffer const &);
+    ArenaBuffer &operator=(ArenaBuffer const &);
+};
+
+Bindings::Bindings(Bindings const &other) : symbols(NULL), values(NULL), count(0), capacity(0) {
+    *this = other;
+}
+
+Bindings &Bindings::operator=(Bindings const &other) {
+    if (this == &other) return *this;
+    clear();
+    reserve(other.count);
+    for (size_t i=0; i<other.capacity; i++)
+        if (other.symbols[i] != EMPTY)
+            set(other.symbols[i], other.values[i]);
+    return *this;
+}
+
+Bindings::~Bindings() {
+    delete[] symbols;
+    delete[] values;
+}
+
+size_t Bindings::probe(int symbol) const {
+    // Multiplying by an odd number mixes the bits of the symbol id, while
+    // keeping consecutive symbols, which are most of them, in different slots.
+    size_t mask = capacity - 1;
+    size_t slot = size_t(unsigned(symbol) * 2654435761u) & mask;
+    while (symbols[slot] != EMPTY && symbols[slot] != symbol)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+Value const *Bindings::find(int symbol) const {
+    if (count == 0) return NULL;
+    size_t slot = probe(symbol);
+    return symbols[slot] == symbol? &values[slot] : NULL;
+}
+
+void Bindings::set(int symbol, Value const &value) {
+    // Keep the table at most three quarters full, so probes stay short
+    if ((count + 1) * 4 > capacity * 3)
+        rehash(capacity == 0? size_t(MIN_CAPACITY) : capacity * 2);
+    size_t slot = probe(symbol);
+    if (symbols[slot] == EMPTY) {
+        symbols[slot] = symbol;
+        count++;
+    }
+    values[slot] = value;
+}
+
+void Bindings::reserve(size_t n) {
+    size_t needed = capacity == 0? size_t(MIN_CAPACITY) : capacity;
+    while (n * 4 > needed * 3) needed *= 2;
+    if (needed > capacity) rehash(needed);
+}
+
+void Bindings::clear() {
+    if (count == 0) return;
+    for (size_t i=0; i<capacity; i++)
+        if (symbols[i] != EMPTY) {
+            symbols[i] = EMPTY;
+            values[i] = Value();
+        }
+    count = 0;
+}
+
+Value const &Bindings::value_at(size_t slot) const {
+    return values[slot];
+}
+
+void Bindings::rehash(size_t n) {
+    int *old_symbols = symbols;
+    Value *old_values = values;
+    size_t old_capacity = capacity;
+
+    symbols = new int[n];
+    values = new Value[n];
+    capacity = n;
+    for (size_t i=0; i<n; i++) symbols[i] = EMPTY;
+    for (size_t i=0; i<old_capacity; i++)
+        if (old_symbols[i] != EMPTY) {
+            size_t slot = probe(old_symbols[i]);
+            symbols[slot] = old_symbols[i];
+            values[slot] = old_values[i];
+        }
+
+    delete[] old_symbols;
+    delete[] old_values;
+}
+
+Environment::Environment(Environment const &other)
+    : defs(other.defs), frames(other.frames), parent_scope(other.parent_scope),
+      outermost(other.outermost), lambda(other.lambda), frame(other.frame), error(NULL) {
+    if (lambda != NULL) lambda->retain();
+}
+
+Environment &Environment::operator=(Environment const &other) {
+    if (error != NULL) detach_error();
+    if (other.lambda != NULL) other.lambda->retain();
+    if (lambda != NULL && lambda->release()) delete lambda;
+    defs = other.defs;
+    frames = other.frames;
+    parent_scope = other.parent_scope;
+    outermost = other.outermost;
+    lambda = other.lambda;
+    frame = other.frame;
+    return *this;
+}
+
+Environment::~Environment() {
+    if (error != NULL) detach_error();
+    if (lambda != NULL && lambda->release()) delete lambda;
+}
+
+void Environment::capture_frames(Environment const &other) {
+    // A closure is kept flat: the frames of the scope the other
+    // lambda captured come first, then the ones of its call.
+    frames.clear();
+    if (other.lambda != NULL)
+        frames = other.lambda->scope.frames;
+    frames.insert(frames.end(), other.frames.begin(), other.frames.end());
+    // The frame of the call is copied out of the arena
+    if (other.lambda != NULL)
+        frames.push_back(other.frame);
+}
+
+void Environment::enter_lambda(LambdaObject *called) {
+    if (error != NULL) detach_error();
+    called->retain();
+    if (lambda != NULL && lambda->release()) delete lambda;
+    lambda = called;
+    defs.clear();
+    frames.clear();
+    // Free the last call's frame, so consecutive tail calls reuse its memory
+    frame.clear();
+}
+
+void Environment::detach_error() const {
+    // Nothing needs the scope printed if no error refers to it anymore
+    if (error->is_shared()) {
+        std::ostringstream ss;
+        ss << *this;
+        error->scope_text = ss.str();
+        error->scope = NULL;
+    }
+    if (error->release()) delete error;
+    error = NULL;
+}
+
+void Environment::combine(Environment const &other) {
+    // The other scope's definitions overwrite the ones here.
+    // Room is made for all of them first, so the table grows at most once.
+    defs.reserve(defs.size() + other.defs.size());
+    for (size_t i=0; i<other.defs.slots(); i++) {
+        int symbol = other.defs.symbol_at(i);
+        if (symbol == Bindings::EMPTY) continue;
+        defs.set(symbol, other.defs.value_at(i));
+        rebind(symbol);
+    }
+}
+
+std::map<std::string, Value const *> Environment::variables() const {
+    // The definitions are keyed by symbol id, so sort them
+    // by name to print them in a readable order.
+    // The scope of a lambda call is printed with the variables
+    // the lambda captured, which its own definitions shadow.
+    Environment const &e = *this;
+    std::map<std::string, Value const *> sorted;
+    if (e.lambda != NULL) {
+        Bindings const &captured = e.lambda->scope.defs;
+        for (size_t i=0; i<captured.slots(); i++)
+            if (captured.symbol_at(i) != Bindings::EMPTY)
+                sorted[symbol_name(captured.symbol_at(i))] = &captured.value_at(i);
+    }
+    for (size_t i=0; i<e.defs.slots(); i++)
+        if (e.defs.symbol_at(i) != Bindings::EMPTY)
+            sorted[symbol_name(e.defs.symbol_at(i))] = &e.defs.value_at(i);
+
+    // Locals in the frames shadow the definitions,
+    // and inner frames shadow the outer ones.
+    std::vector<Frame const *> frames;
+    if (e.lambda != NULL)
+        for (size_t i=0; i<e.lambda->scope.frames.size(); i++)
+            frames.push_back(&e.lambda->scope.frames[i]);
+    for (size_t i=0; i<e.frames.size(); i++)
+        frames.push_back(&e.frames[i]);
+    if (e.lambda != NULL)
+        frames.push_back(&e.frame);
+
+    for (size_t i=0; i<frames.size(); i++) {
+        Frame const &frame = *frames[i];
+        for (size_t j=0; j<frame.size(); j++)
+            if (frame.symbols[j] >= 0)
+                sorted[symbol_name(frame.symbols[j])] = &frame.slots[j];
+    }
+    return sorted;
+}
+
+std::ostream &operator<<(std::ostream &os, Environment const &e) {
+    std::map<std::string, Value const *> sorted = e.variables();
+    std::map<std::string, Value const *>::const_iterator sorted_itr = sorted.begin();
+    os << "{ ";
+    for (; sorted_itr != sorted.end(); sorted_itr++) {
+        os << '\'' << sorted_itr->first << "' : " << sorted_itr->second->preview(PREVIEW_LENGTH) << ", ";
+    }
+    return os << "}";
+}
+
+void Environment::set(int symbol, Value value) {
+    // If the current call's frame already binds this symbol, update its slot
+    if (lambda != NULL) {
+        for (size_t i=frame.size(); i-- > 0;) {
+            if (frame.symbols[i] == symbol) {
+                frame.slots[i] = value;
+                return;
+            }
+        }
+    }
+    defs.set(symbol, value);
+    rebind(symbol);
+}
+
+void Environment::capture(int symbol, Value const &value) {
+    defs.set(symbol, value);
+    binding_versions().capture(symbol);
+}
+
+void Environment::rebind(int symbol) const {
+    // Only the global scope has no parent and isn't a call
+    if (parent_scope == NULL && lambda == NULL)
+        binding_versions().redefine(symbol);
+    else binding_versions().shadow(symbol);
+}
+
+Value const *Environment::get_local(int depth, int slot, int symbol) const {
+    // The frame of the call comes before the ones the lambda captured
+    Frame const *found = NULL;
+    if (lambda != NULL && depth == 0) {
+        found = &frame;
+    } else {
+        if (lambda != NULL) depth--;
+        std::vector<Frame> const *outer = &frames;
+        if (depth >= int(frames.size())) {
+            if (lambda == NULL) return NULL;
+            depth -= int(frames.size());
+            outer = &lambda->scope.frames;
+            if (depth >= int(outer->size())) return NULL;
+        }
+        found = &(*outer)[outer->size() - 1 - depth];
+    }
+
+    // The slot must hold the symbol the resolver expected. If it doesn't,
+    // the local hasn't been defined yet, and it must be found by name.
+    if (slot >= int(found->size()) || found->symbols[slot] != symbol)
+        return NULL;
+    return &found->slots[slot];
+}
+
+void Environment::bind(Value const &name, Value value) {
+    if (name.is_local() && name.local_depth() == 0 && lambda != NULL) {
+        // Locals of the current lambda are stored straight into their slot
+        size_t slot = name.local_slot();
+        if (slot >= frame.size())
+            frame.resize(slot + 1);
+        frame.symbols[slot] = name.as_symbol();
+        frame.slots[slot] = value;
+    } else {
+        set(name.is_atom()? name.as_symbol() : intern(name.display()), value);
+    }
+}
+
+void Environment::push_frame(Args params, Args args) {
+    frame.assign(params, args, lambda->frame_size, arena());
+}
+
+void Environment::set(std::string const &name, Value value) {
+    set(intern(name), value);
+}
+
+Value Environment::get(std::string const &name) const {
+    return get(intern(name));
+}
+
+void Environment::trace(std::vector<Object *> &objects) const {
+    for (size_t i=0; i<defs.slots(); i++)
+        if (defs.symbol_at(i) != Bindings::EMPTY && defs.value_at(i).heap_object() != NULL)
+            objects.push_back(defs.value_at(i).heap_object());
+
+    for (size_t i=0; i<frames.size(); i++)
+        for (size_t j=0; j<frames[i].size(); j++)
+            if (frames[i].slots[j].heap_object() != NULL)
+                objects.push_back(frames[i].slots[j].heap_object());
+
+    if (lambda != NULL) {
+        objects.push_back(lambda);
+        for (size_t j=0; j<frame.size(); j++)
+            if (frame.slots[j].heap_object() != NULL)
+                objects.push_back(frame.slots[j].heap_object());
+    }
+}
+
+void Environment::clear() {
+    defs.clear();
+    frames.clear();
+    frame.clear();
+    if (lambda != NULL && lambda->release()) delete lambda;
+    lambda = NULL;
+}
+
+
+// Run a compiled bytecode chunk in an environment.
+// A call in tail position of the chunk is stored in `call` instead of being made.
+// This is defined with the rest of the virtual machine.
+Value run_chunk(int chunk, Environment &env, TailCall &call);
+
+Value const &Args::operator[](size_t i) const {
+    return items[i];
+}
+
+Value const *Args::end() const {
+    return items + count;
+}
+
+std::vector<Value> Args::to_vector() const {
+    return std::vector<Value>(begin(), end());
+}
+
+Value Value::apply(Args args, Environment &env) const {
+    if (type != LAMBDA || lambda()->memo == NULL)
+        return apply_function(args, env);
+
+    // A memoized lambda looks for the result of an earlier call with the same arguments
+    // first. The arguments are copied out before the call, which might overwrite them.
+    MemoTable *memo = lambda()->memo;
+    unsigned hash = MemoTable::hash(args);
+    Value result;
+    if (memo->find(args, hash, result))
+        return result;
+    std::vector<Value> key = args.to_vector();
+    result = apply_function(args, env);
+    memo->add(key, hash, result);
+    return result;
+}
+
+Value Value::apply_function(Args args, Environment &env) const {
+    Value function = *this, result;
+    Environment e;
+    Args params;
+    TailCall call;
+    ProfileScope profile;
+    switch (type) {
+    case LAMBDA:
+        // Calls are where garbage cycles are collected, once there are enough possible roots
+        if (gc_pending && !workers_running) collect_cycles();
+
+        // Each tail call made by the body replaces the current call,
+        // so the lambda it calls runs in this loop instead of on top of it.
+        while (true) {
+            // Get the list of parameter atoms
+            params = function.list()[0].list();
+            if (params.size() != args.size())
+                throw Error(Value(args.to_vector()), env, args.size() > params.size()?
+                    TOO_MANY_ARGS : TOO_FEW_ARGS
+                );
+
+            profile.enter(function.lambda()->name);
+
+            // Share the captured scope of the lambda
+            e.enter_lambda(function.lambda());
+            // And make this scope the parent scope
+            e.set_parent_scope(&env);
+
+            // Every parameter must be an atom.
+            for (size_t i=0; i<params.size(); i++) {
+                if (params[i].type != ATOM) 
+                    throw Error(function, env, INVALID_LAMBDA);
+            }
+            // Bind the arguments to the parameters' slots in a new frame.
+            e.push_frame(params, args);
+
+            // Evaluate the function body with the function scope.
+            // If the body was compiled, run its bytecode instead.
+            call.function = Value();
+            if (function.lambda()->chunk >= 0)
+                result = run_chunk(function.lambda()->chunk, e, call);
+            else result = function.list()[1].eval_tail(e, call);
+
+            if (!call.function.is_lambda())
+                return result;
+
+            // Scoping is dynamic, so a lambda that looks up an atom the
+            // current call binds must be called on top of it to see it.
+            std::vector<int> const &dynamic = call.function.lambda()->dynamic;
+            for (size_t i=0; i<dynamic.size(); i++)
+                if (e.binds(dynamic[i]))
+                    return call.function.apply(call.args, e);
+            // A memoized lambda must remember its result, so it's called on top of the
+            // current call too. It's called from the caller's scope, just like it would be here.
+            if (call.function.lambda()->memo != NULL)
+                return call.function.apply(call.args, env);
+
+            // Otherwise, the call replaces the current one. The frame was copied
+            // out of the arguments, so the next call's arguments can be evaluated over them.
+            function = call.function;
+            args = call.args;
+        }
+    case BUILTIN:
+        // Here, we call the builtin function with the current scope.
+        // This allows us to write special forms without syntactic sugar.
+        // For functions that are not special forms, we just evaluate
+        // the arguments before we run the function.
+        // Special forms are counted as part of the function using them.
+        if (!special_form) profile.enter(builtin_name);
+        return (stack_data.fn)(args, env);
+    default:
+        // We can only call lambdas and builtins
+        throw Error(*this, env, CALL_NON_FUNCTION);
+    }
+}
+
+
+// The number of arguments that are evaluated into a buffer on the stack.
+// Calls with more arguments than this evaluate them into the arena instead.
+#define SMALL_CALL_SIZE 4
+
+// Call a function that isn't a special form with the values of a list of argument expressions
+static Value call_with(Value const &function, Args exprs, Environment &env) {
+    size_t argc = exprs.size();
+    // Small calls evaluate their arguments into a buffer on the stack.
+    if (argc <= SMALL_CALL_SIZE) {
+        Value buffer[SMALL_CALL_SIZE];
+        for (size_t i=0; i<argc; i++)
+            buffer[i] = exprs[i].eval(env);
+        return function.apply(Args(buffer, argc), env);
+    } else {
+        ArenaBuffer buffer(argc);
+        for (size_t i=0; i<argc; i++)
+            buffer.items[i] = exprs[i].eval(env);
+        return function.apply(Args(buffer.items, argc), env);
+    }
+}
+
+Value Value::eval(Environment &env) const {
+    Value function;
+    size_t argc;
+    switch (type) {
+    case QUOTE:
+        return list()[0];
+    case ATOM:
+        // Resolved locals are loaded straight from their frame slot
+        if (is_local()) {
+            Value const *local = env.get_local(stack_data.atom.depth, stack_data.atom.slot, stack_data.atom.symbol);
+            if (local != NULL) return *local;
+        }
+        return env.get(stack_data.atom.symbol);
+    case LIST:
+        if (list().size() < 1)
+            throw Error(*this, env, EVAL_EMPTY_LIST);
+
+        if (list_object()->cache != NULL && list_object()->cache->invariant)
+            return eval_invariant(env);
+
+        function = eval_head(env);
+        argc = list().size() - 1;
+
+        // Special forms evaluate their own arguments,
+        // so we pass them the argument expressions in place.
+        if (function.is_special_form())
+            return function.apply(Args(&list()[0] + 1, argc), env);
+
+        // Everything else gets its arguments evaluated first.
+        return call_with(function, Args(&list()[0] + 1, argc), env);
+
+    default:
+        return *this;
+    }
+}
+
+Value Value::eval_head(Environment &env) const {
+    Value const &head = list()[0];
+    // Resolved locals are already loaded straight from their slot.
+    // The caches aren't synchronized, so worker threads don't use them.
+    if (head.type != ATOM || head.is_local() || workers_running)
+        return head.eval(env);
+
+    unsigned version = binding_versions().version(head.stack_data.atom.symbol);
+    Environment const *scope = &env.global_scope();
+    CallCache *&cache = list_object()->cache;
+    if (cache != NULL && cache->version == version && version != BindingVersions::UNCACHED
+        && cache->scope == scope)
+        return cache->function;
+
+    Value function = env.get(head.stack_data.atom.symbol);
+    if (version != BindingVersions::UNCACHED) {
+        if (cache == NULL) cache = new CallCache;
+        cache->version = version;
+        cache->scope = scope;
+        cache->function = function;
+    }
+    return function;
+}
+
+// Builders, file handles, and channels change in place, so a pure builtin
+// can give something different for the same one, like `len` after an
+// `append`, or `display` of a list holding a builder.
+bool Value::can_change() const {
+    switch (type) {
+    case BUILDER:
+    case HANDLE:
+    case CHANNEL:
+        return true;
+    case QUOTE:
+        return list()[0].can_change();
+    case LIST:
+        // A lazy range that hasn't been built only holds integers
+        if (list_object()->buffer == NULL) return false;
+        for (size_t i=0; i<list().size(); i++)
+            if (list()[i].can_change()) return true;
+        return false;
+    case MAP: {
+        MapObject *map = as_map();
+        for (size_t i=0; i<map->count; i++) {
+            if (map->buffer->previous[i] != MapBuffer::NONE) continue;
+            if (map->buffer->keys[i].can_change()) return true;
+            if (!map->is_set && map->latest_value(i).can_change()) return true;
+        }
+        return false;
+    }
+    default:
+        return false;
+    }
+}
+
+Value Value::eval_invariant(Environment &env) const {
+    // The caches aren't synchronized, so worker threads don't use them
+    CallCache *cache = list_object()->cache;
+    if (cache->run == loop_runs && !workers_running)
+        return cache->value;
+
+    unsigned long run = loop_runs;
+    Value function = eval_head(env);
+    std::vector<Value> args(list().size() - 1);
+    bool changes = false;
+    for (size_t i=0; i<args.size(); i++) {
+        Value const &expr = list()[i + 1];
+        args[i] = expr.eval(env);
+        // A call whose value wasn't kept can give something else next time too
+        changes = changes || args[i].can_change()
+            || (expr.type == LIST && expr.list_object()->cache != NULL && expr.list_object()->cache->invariant
+                && expr.list_object()->cache->run != run);
+    }
+    // The value isn't kept while an argument can change in place
+    Value result = function.apply(Args(args.empty()? NULL : &args[0], args.size()), env);
+    if (!workers_running && !changes) {
+        cache->run = run;
+        cache->value = result;
+    }
+    return result;
+}
+
+Value Value::eval_tail(Environment &env, TailCall &call) const {
+    static const int if_symbol = intern("if");
+    static const int do_symbol = intern("do");
+
+    if (type != LIST || list().empty())
+        return eval(env);
+
+    Value function = eval_head(env);
+    Args args(&list()[0] + 1, list().size() - 1);
+
+    if (function.is_special_form()) {
+        // The branches of an `if`, and the last expression of a `do`,
+        // are in tail position too.
+        if (function.builtin_name == if_symbol && args.size() == 3)
+            return args[args[0].eval(env).as_bool()? 1 : 2].eval_tail(env, call);
+        if (function.builtin_name == do_symbol && !args.empty()) {
+            for (size_t i=0; i<args.size()-1; i++)
+                args[i].eval(env);
+            return args[args.size()-1].eval_tail(env, call);
+        }
+        return function.apply(args, env);
+    }
+
+    // Builtins are called right away, and lambdas are left for `apply`.
+    if (!function.is_lambda())
+        return call_with(function, args, env);
+
+    call.args.resize(args.size());
+    for (size_t i=0; i<args.size(); i++)
+        call.args[i] = args[i].eval(env);
+    call.function = function;
+    return Value();
+}
+
+void Value::resolve(std::vector<FrameLayout> &scopes) {
+    static const int quote_symbol = intern("quote");
+    static const int lambda_symbol = intern("lambda");
+    static const int defun_symbol = intern("defun");
+
+    switch (type) {
+    case ATOM:
+        // Find the innermost lambda frame that binds this atom
+        for (size_t depth=0; depth<scopes.size(); depth++) {
+            int slot = scopes[scopes.size() - 1 - depth].find(stack_data.atom.symbol);
+            if (slot >= 0) {
+                stack_data.atom.depth = depth;
+                stack_data.atom.slot = slot;
+                return;
+            }
+        }
+        return;
+    case LIST:
+        if (list().empty()) return;
+        if (list()[0].type == ATOM) {
+            int head = list()[0].stack_data.atom.symbol;
+            // Quoted expressions are data, not code.
+            if (head == quote_symbol) return;
+
+            // `(lambda params body)`
+            if (head == lambda_symbol && list().size() >= 3 && list()[1].type == LIST) {
+                resolve_lambda(list()[1], 2, scopes);
+                return;
+            }
+
+            // `(defun name params body)`
+            if (head == defun_symbol && list().size() >= 4 && list()[2].type == LIST) {
+                // The name is bound in the enclosing scope, not the lambda's
+                mutable_items()[1].resolve(scopes);
+                resolve_lambda(list()[2], 3, scopes);
+                return;
+            }
+        }
+
+        for (size_t i=0; i<list().size(); i++)
+            mutable_items()[i].resolve(scopes);
+        return;
+    default:
+        // Quotes are data, and nothing else can contain atoms.
+        return;
+    }
+}
+
+void Value::resolve_lambda(Value const &params, size_t body, std::vector<FrameLayout> &scopes) {
+    // The parameters take the first slots of the frame, in order.
+    // If a parameter is repeated, the last one wins, like in `apply`.
+    FrameLayout layout;
+    for (size_t i=0; i<params.list().size(); i++) {
+        // A lambda with invalid parameters will fail when it's called,
+        // so there's no point in resolving its body.
+        if (params.list()[i].type != ATOM) return;
+        layout.slots[params.list()[i].stack_data.atom.symbol] = i;
+    }
+    layout.size = params.list().size();
+
+    // Then every local defined in the body gets the next free slot.
+    for (size_t i=body; i<list().size(); i++)
+        list()[i].declare_locals(layout);
+
+    scopes.push_back(layout);
+    for (size_t i=body; i<list().size(); i++)
+        mutable_items()[i].resolve(scopes);
+    scopes.pop_back();
+}
+
+void Value::declare_locals(FrameLayout &layout) const {
+    static const int quote_symbol = intern("quote");
+    static const int lambda_symbol = intern("lambda");
+    static const int defun_symbol = intern("defun");
+    static const int define_symbol = intern("define");
+    static const int for_symbol = intern("for");
+
+    if (type != LIST || list().empty()) return;
+
+    if (list()[0].type == ATOM) {
+        int head = list()[0].stack_data.atom.symbol;
+        // Nested lambdas have their own frames.
+        if (head == quote_symbol || head == lambda_symbol) return;
+
+        // `defun` binds its name here, but its body belongs to its own frame.
+        if (head == defun_symbol) {
+            if (list().size() > 1 && list()[1].type == ATOM)
+                layout.declare(list()[1].stack_data.atom.symbol);
+            return;
+        }
+
+        // `(define name value)` and `(for name list ...)`
+        if ((head == define_symbol || head == for_symbol) && list().size() > 1 && list()[1].type == ATOM)
+            layout.declare(list()[1].stack_data.atom.symbol);
+    }
+
+    for (size_t i=0; i<list().size(); i++)
+        list()[i].declare_locals(layout);
+}
+
+// A cursor over the source text of a program. The reader lexes the
+// text in place, so the program is never copied while it's parsed,
+// and every character is looked at a constant number of times.
+struct Reader {
+    Reader(const char *begin, size_t length) : ptr(begin), end(begin + length) {}
+
+    // Have we reached the end of the input?
+    bool done() const { return ptr >= end; }
+
+    // Look at a character ahead of the cursor, or NUL past the end
+    char peek(size_t n=0) const { return ptr + n < end? ptr[n] : '\0'; }
+
+    const char *ptr, *end;
+    // Scratch space for the text of a token. It's reused
+    // between tokens, so lexing doesn't allocate for each one.
+    std::string token;
+};
+
+// Skip whitespace and comments up to the next value
+void skip_whitespace(Reader &r) {
+    while (!r.done()) {
+        if (isspace((unsigned char)*r.ptr)) {
+            r.ptr++;
+        } else if (*r.ptr == ';') {
+            // Skip to the end of the line
+            while (!r.done() && *r.ptr != '\n') r.ptr++;
+        } else return;
+    }
+}
+
+// Parse a single value and move the cursor
+// to the beginning of the next value to parse.
+Value parse(Reader &r) {
+    skip_whitespace(r);
+
+    // If there's nothing but comments left, return an empty value
+    if (r.done()) return Value();
+
+    char ch = *r.ptr;
+    if (ch == '\'') {
+        // If this is a quote
+        r.ptr++;
+        return Value::quote(parse(r));
+
+    } else if (ch == '(') {
+        // If this is a list
+        r.ptr++;
+        std::vector<Value> items;
+        for (skip_whitespace(r); r.peek() != ')'; skip_whitespace(r)) {
+            if (r.done())
+                throw std::runtime_error(MALFORMED_PROGRAM);
+            items.push_back(parse(r));
+        }
+
+        r.ptr++;
+        return Value(items);
+
+    } else if (isdigit(ch) || (ch == '-' && isdigit(r.peek(1)))) {
+        // If this is a number
+        bool negate = ch == '-';
+        if (negate) r.ptr++;
+
+        const char *begin = r.ptr;
+        bool is_float = false;
+        for (; isdigit(r.peek()) || r.peek() == '.'; r.ptr++)
+            is_float = is_float || *r.ptr == '.';
+        r.token.assign(begin, r.ptr);
+
+        if (is_float)
+            return Value((negate? -1 : 1) * atof(r.token.c_str()));
+        else return Value((negate? -1 : 1) * atoi(r.token.c_str()));
+
+    } else if (ch == '\"') {
+        // If this is a string, replace the escaped characters
+        // with their intended values as it's read.
+        r.token.clear();
+        for (r.ptr++; r.peek() != '\"'; r.ptr++) {
+            if (r.done())
+                throw std::runtime_error(MALFORMED_PROGRAM);
+
+            if (*r.ptr == '\\') {
+                switch (r.peek(1)) {
+                case '\\': r.token += '\\'; break;
+                case '"':  r.token += '"';  break;
+                case 'n':  r.token += '\n'; break;
+                case 't':  r.token += '\t'; break;
+                default:
+                    // Unknown escapes are kept as they're written
+                    r.token += '\\';
+                    if (r.done() || r.ptr + 1 == r.end)
+                        throw std::runtime_error(MALFORMED_PROGRAM);
+                    r.token += r.ptr[1];
+                }
+                r.ptr++;
+            } else r.token += *r.ptr;
+        }
+
+        r.ptr++;
+        return Value::string(r.token);
+
+    } else if (ch == '@') {
+        r.ptr++;
+        return Value();
+
+    } else if (is_symbol(ch)) {
+        // If this is a symbol
+        const char *begin = r.ptr;
+        while (is_symbol(r.peek())) r.ptr++;
+
+        r.token.assign(begin, r.ptr);
+        return Value::atom(r.token);
+    } else {
+        throw std::runtime_error(MALFORMED_PROGRAM);
+    }
+}
+
+// Parse an entire program and get its list of expressions.
+std::vector<Value> parse(const char *code, size_t length) {
+    Reader r(code, length);
+    std::vector<Value> result;
+    while (!r.done()) {
+        // Parse another expression and add it to the list.
+        result.push_back(parse(r));
+        skip_whitespace(r);
+    }
+
+    // Return the list of values parsed.
+    return result;
+}
+
+std::vector<Value> parse(std::string const &s) {
+    return parse(s.data(), s.size());
+}
+
+// Resolve the lambda parameters and locals in a parsed program
+// to the slots they'll occupy in their lambda frames.
+void resolve(std::vector<Value> &program) {
+    std::vector<FrameLayout> scopes;
+    for (size_t i=0; i<program.size(); i++)
+        program[i].resolve(scopes);
+}
+
+// Fold the constant expressions of a resolved program,
+// and find the calls that are invariant in their loops
+void optimize(std::vector<Value> &program);
+
+// Parse a program, and get it ready to run
+std::vector<Value> prepare(const char *code, size_t length) {
+    std::vector<Value> parsed = parse(code, length);
+    // Resolve the lambda locals before running it
+    resolve(parsed);
+    #ifdef OPTIMIZE
+    optimize(parsed);
+    #endif
+    return parsed;
+}
+
+// Run a prepared program in an environment
+Value run_program(std::vector<Value> const &parsed, Environment &env) {
+    // A program of only comments has no value
+    if (parsed.empty()) return Value();
+    // Iterate over the expressions and evaluate them
+    // in this environment.
+    for (size_t i=0; i<parsed.size()-1; i++)
+        parsed[i].eval(env);
+
+    // Return the result of the last expression.
+    return parsed[parsed.size()-1].eval(env);
+}
+
+// Execute code in an environment
+Value run(std::string const &code, Environment &env) {
+    return run_program(prepare(code.data(), code.size()), env);
+}
+
+#ifdef USE_STD
+// Run a source file or load an image in an environment.
+// This is defined with the rest of the image support.
+Value run_file(std::string const &filename, Environment &env);
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+/// CYCLE COLLECTOR ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// The number of possible roots of cycles that are remembered before
+// the next call collects the cycles among them. This can be changed
+// while the program runs with the `gc-threshold` builtin.
+#define GC_THRESHOLD 10000
+
+// The objects whose reference counts dropped without reaching zero since the
+// last collection. Any cycle of garbage must contain one of them, because the
+// last reference from outside the cycle was dropped at some point.
+std::vector<Object *> roots;
+size_t gc_threshold = GC_THRESHOLD;
+// Objects released while a collection frees garbage aren't remembered as roots
+bool collecting = false;
+// The number of collections run, and the number of objects they freed
+size_t gc_collections = 0, gc_collected = 0;
+
+// Objects freed by worker threads forget their roots under this lock
+Mutex &gc_mutex() {
+    static Mutex mutex;
+    return mutex;
+}
+
+void possible_root(Object *object) {
+    if (collecting) return;
+    object->root = roots.size();
+    roots.push_back(object);
+    if (roots.size() >= gc_threshold) gc_pending = true;
+}
+
+void forget_root(Object *object) {
+    SharedLock lock(gc_mutex());
+    roots[object->root] = NULL;
+}
+
+// Every object reachable from the possible roots is traced. The references
+// between the traced objects are subtracted from their reference counts, so
+// objects left with a count above zero are referred to from outside of them,
+// by the stack or by the scopes of the program. Those are alive, along with
+// everything they refer to, and the rest are cycles of garbage.
+// This is only safe while no worker threads are running.
+size_t collect_cycles() {
+    gc_pending = false;
+    std::vector<Object *> pending;
+    pending.swap(roots);
+
+    // The references to each traced object from outside of the traced objects
+    std::map<Object *, int> outside;
+    std::vector<Object *> traced, stack, refs;
+    for (size_t i=0; i<pending.size(); i++) {
+        if (pending[i] == NULL) continue;
+        pending[i]->root = Object::NOT_ROOT;
+        if (outside.insert(std::make_pair(pending[i], pending[i]->refs)).second)
+            stack.push_back(pending[i]);
+    }
+
+    // Find every object reachable from the roots
+    while (!stack.empty()) {
+        Object *object = stack.back();
+        stack.pop_back();
+        traced.push_back(object);
+
+        refs.clear();
+        object->trace(refs);
+        for (size_t i=0; i<refs.size(); i++)
+            if (refs[i]->root != Object::UNTRACED
+                && outside.insert(std::make_pair(refs[i], refs[i]->refs)).second)
+                stack.push_back(refs[i]);
+    }
+
+    // Subtract the references between the traced objects
+    for (size_t i=0; i<traced.size(); i++) {
+        refs.clear();
+        traced[i]->trace(refs);
+        for (size_t j=0; j<refs.size(); j++) {
+            std::map<Object *, int>::iterator count = outside.find(refs[j]);
+            if (count != outside.end()) count->second--;
+        }
+    }
+
+    // Everything reachable from outside of the traced objects is alive
+    for (size_t i=0; i<traced.size(); i++)
+        if (outside[traced[i]] > 0) stack.push_back(traced[i]);
+    while (!stack.empty()) {
+        Object *object = stack.back();
+        stack.pop_back();
+
+        refs.clear();
+        object->trace(refs);
+        for (size_t i=0; i<refs.size(); i++) {
+            std::map<Object *, int>::iterator count = outside.find(refs[i]);
+            if (count != outside.end() && count->second == 0) {
+                count->second = 1;
+                stack.push_back(refs[i]);
+            }
+        }
+    }
+
+    std::vector<Object *> garbage;
+    for (size_t i=0; i<traced.size(); i++)
+        if (outside[traced[i]] == 0) garbage.push_back(traced[i]);
+
+    // Hold on to the garbage while its references are dropped, so none of
+    // it is freed while it's being cleared, and then free all of it.
+    collecting = true;
+    for (size_t i=0; i<garbage.size(); i++)
+        garbage[i]->retain();
+    for (size_t i=0; i<garbage.size(); i++)
+        garbage[i]->clear();
+    for (size_t i=0; i<garbage.size(); i++)
+        if (garbage[i]->release()) delete garbage[i];
+    collecting = false;
+
+    gc_collections++;
+    gc_collected += garbage.size();
+    return garbage.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// THREAD POOL ////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// A task over a number of items that can be split across the thread pool.
+// `run` is called on disjoint ranges of the items, possibly on different threads.
+class ParallelTask {
+public:
+    virtual ~ParallelTask() {}
+    virtual void run(size_t begin, size_t end) = 0;
+};
+
+// A pool of worker threads for the parallel builtins.
+// A task is split into ranges, which are dealt out to a queue per thread.
+// Each thread takes ranges from the back of its own queue, and when it runs
+// out, it steals ranges from the front of the other threads' queues.
+// The thread that runs a task works on it too, as the first thread of the pool.
+class ThreadPool {
+public:
+    ThreadPool() : threads(1), task(NULL), failure(NULL) {
+        #ifdef HAS_THREADS
+        long available = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = available > 0? int(available) : 1;
+        stopping = false;
+        generation = 0;
+        active = 0;
+        pthread_cond_init(&wake, NULL);
+        pthread_cond_init(&done, NULL);
+        #endif
+        queues.push_back(new Queue);
+        start();
+    }
+
+    ~ThreadPool() {
+        stop();
+        for (size_t i=0; i<queues.size(); i++)
+            delete queues[i];
+        #ifdef HAS_THREADS
+        pthread_cond_destroy(&wake);
+        pthread_cond_destroy(&done);
+        #endif
+    }
+
+    // The number of threads that run tasks, including the calling thread
+    int size() const {
+        return threads;
+    }
+
+    // Are the pool's threads running a task right now?
+    bool busy() const {
+        return task != NULL;
+    }
+
+    // Change the number of threads that run tasks
+    void resize(int n) {
+        #ifdef HAS_THREADS
+        if (n < 1) n = 1;
+        stop();
+        threads = n;
+        start();
+        #else
+        (void)n;
+        #endif
+    }
+
+    // Run a task over `count` items, and wait for it to finish.
+    // An error thrown on any thread is thrown again here.
+    void run(ParallelTask &t, size_t count) {
+        // Tasks started from inside of another task run on their own thread.
+        if (threads == 1 || workers_running || count < 2) {
+            t.run(0, count);
+            return;
+        }
+
+        #ifdef HAS_THREADS
+        // Split the items into several ranges per thread, so
+        // threads that finish early have ranges to steal.
+        size_t ranges = std::min(count, size_t(threads) * 8);
+        size_t per_thread = (ranges + threads - 1) / threads;
+        for (size_t i=0; i<ranges; i++) {
+            Range range;
+            range.begin = count * i / ranges;
+            range.end = count * (i + 1) / ranges;
+            queues[i / per_thread]->ranges.push_back(range);
+        }
+
+        task = &t;
+        workers_running = true;
+        pthread_mutex_lock(&mutex.mutex);
+        generation++;
+        active = threads - 1;
+        pthread_cond_broadcast(&wake);
+        pthread_mutex_unlock(&mutex.mutex);
+
+        work(0);
+
+        pthread_mutex_lock(&mutex.mutex);
+        while (active > 0)
+            pthread_cond_wait(&done, &mutex.mutex);
+        pthread_mutex_unlock(&mutex.mutex);
+        workers_running = false;
+        task = NULL;
+
+        if (failure != NULL) {
+            Error error = *failure;
+            delete failure;
+            failure = NULL;
+            throw error;
+        }
+        if (!failure_message.empty()) {
+            std::string message = failure_message;
+            failure_message = "";
+            throw std::runtime_error(message);
+        }
+        #endif
+    }
+
+private:
+    // A range of items of a task
+    struct Range {
+        size_t begin, end;
+    };
+
+    // The ranges waiting to be run by a thread
+    struct Queue {
+        Mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    // Take the next range for a thread to run, stealing one if its own queue is empty
+    bool next(int thread, Range &range) {
+        for (int i=0; i<threads; i++) {
+            Queue &queue = *queues[(thread + i) % threads];
+            queue.mutex.lock();
+            bool found = !queue.ranges.empty();
+            if (found && i == 0) {
+                range = queue.ranges.back();
+                queue.ranges.pop_back();
+            } else if (found) {
+                range = queue.ranges.front();
+                queue.ranges.pop_front();
+            }
+            queue.mutex.unlock();
+            if (found) return true;
+        }
+        return false;
+    }
+
+    // Run ranges of the current task until there are none left.
+    // After an error, the remaining ranges are skipped.
+    void work(int thread) {
+        Range range;
+        while (next(thread, range)) {
+            if (failed()) continue;
+            try {
+                task->run(range.begin, range.end);
+            } catch (Error &e) {
+                failure_mutex.lock();
+                if (failure == NULL && failure_message.empty())
+                    failure = new Error(e);
+                failure_mutex.unlock();
+            } catch (std::exception &e) {
+                failure_mutex.lock();
+                if (failure == NULL && failure_message.empty())
+                    failure_message = e.what();
+                failure_mutex.unlock();
+            }
+        }
+    }
+
+    // Has the current task thrown an error on any thread?
+    bool failed() {
+        failure_mutex.lock();
+        bool result = failure != NULL || !failure_message.empty();
+        failure_mutex.unlock();
+        return result;
+    }
+
+    #ifdef HAS_THREADS
+    // The arguments passed to a new worker thread
+    struct Start {
+        ThreadPool *pool;
+        int thread;
+        // The last task given to the pool before the thread was started
+        int generation;
+    };
+
+    static void *worker(void *arg) {
+        Start start = *(Start *)arg;
+        delete (Start *)arg;
+        start.pool->wait_for_work(start.thread, start.generation);
+        return NULL;
+    }
+
+    // Run each task the pool is given on a worker thread, until the pool stops
+    void wait_for_work(int thread, int seen) {
+        pthread_mutex_lock(&mutex.mutex);
+        while (true) {
+            while (!stopping && generation == seen)
+                pthread_cond_wait(&wake, &mutex.mutex);
+            if (stopping) break;
+            seen = generation;
+            pthread_mutex_unlock(&mutex.mutex);
+
+            work(thread);
+
+            pthread_mutex_lock(&mutex.mutex);
+            if (--active == 0)
+                pthread_cond_signal(&done);
+        }
+        pthread_mutex_unlock(&mutex.mutex);
+    }
+    #endif
+
+    // Start the worker threads
+    void start() {
+        while (int(queues.size()) < threads)
+            queues.push_back(new Queue);
+        #ifdef HAS_THREADS
+        stopping = false;
+        for (int i=1; i<threads; i++) {
+            Start *arg = new Start;
+            arg->pool = this;
+            arg->thread = i;
+            arg->generation = generation;
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, worker, arg) != 0) {
+                // If no more threads can be made, use the ones we have
+                delete arg;
+                threads = i;
+                break;
+            }
+            workers.push_back(thread);
+        }
+        #endif
+    }
+
+    // Stop and join the worker threads
+    void stop() {
+        #ifdef HAS_THREADS
+        pthread_mutex_lock(&mutex.mutex);
+        stopping = true;
+        pthread_cond_broadcast(&wake);
+        pthread_mutex_unlock(&mutex.mutex);
+        for (size_t i=0; i<workers.size(); i++)
+            pthread_join(workers[i], NULL);
+        workers.clear();
+        #endif
+    }
+
+    int threads;
+    std::vector<Queue *> queues;
+    // The task being run, and the first error it threw
+    ParallelTask *task;
+    Error *failure;
+    std::string failure_message;
+    Mutex failure_mutex;
+
+    #ifdef HAS_THREADS
+    std::vector<pthread_t> workers;
+    // Guards the fields below, which wake the workers when there's a task,
+    // and tell the calling thread when they've finished it
+    Mutex mutex;
+    pthread_cond_t wake, done;
+    bool stopping;
+    int generation;
+    int active;
+    #endif
+};
+
+// The thread pool shared by the whole interpreter
+ThreadPool &thread_pool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// TASKS //////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Tasks are functions that run on threads of their own, alongside the rest
+// of the program, so a task can wait on a file while the program computes.
+// Each task runs in a copy of the global scope from when it was spawned.
+// Tasks pass values to each other through channels, which hold a bounded
+// number of them: sending to a full channel waits for a receiver to make
+// room, and receiving from an empty channel waits for a sender.
+//
+// While tasks are running, reference counts and the shared tables are
+// synchronized, like they are while the parallel builtins run.
+
+// A thread waiting on a channel or a task, until another thread wakes it
+struct Waiter {
+    enum State { WAITING, WOKEN, STUCK };
+    State state;
+    // The queue the thread is waiting in
+    std::deque<Waiter *> *queue;
+    #ifdef HAS_THREADS
+    pthread_cond_t wake;
+    #endif
+};
+
+// Keeps track of how many tasks are running, and of the threads waiting.
+// The lock guards all of it, along with the queues of tasks and channels.
+class TaskScheduler {
+public:
+    TaskScheduler() : running(0), synchronized(false) {
+        #ifdef HAS_THREADS
+        pthread_key_create(&current, NULL);
+        #endif
+    }
+
+    // Start running a task on a thread of its own.
+    // If it can't have one, it's run right away instead.
+    void start(TaskObject *task);
+
+    // Wait in a queue until another thread wakes the calling thread. If every
+    // thread would be waiting, none of them could be woken, so they all stop
+    // waiting and give false. The caller must hold the lock.
+    bool wait(std::deque<Waiter *> &queue);
+    // Wake the first thread in a queue, or all of them. The caller must hold the lock.
+    void wake_one(std::deque<Waiter *> &queue);
+    void wake_all(std::deque<Waiter *> &queue);
+
+    // If tasks started the synchronization, stop it once none are running
+    void settle();
+    // Wait for the running tasks to finish. The program calls this before it exits,
+    // so the tasks don't run while the interpreter is being torn down.
+    void wait_for_tasks();
+
+    // Guards everything tasks and channels share
+    Mutex mutex;
+private:
+    // Run a task on its thread
+    static void *run(void *task);
+    // Wake a thread, and stop counting it as waiting
+    void wake(Waiter *waiter, Waiter::State state);
+    // If every thread is waiting, wake them all to give up
+    void find_deadlock();
+
+    // The number of tasks running on threads of their own
+    int running;
+    // Every thread that's waiting, in any queue
+    std::vector<Waiter *> waiting;
+    // The threads waiting for every task to finish
+    std::deque<Waiter *> exiting;
+    // Whether it was tasks that started synchronizing the interpreter
+    bool synchronized;
+    #ifdef HAS_THREADS
+    // Which task the calling thread runs, if any
+    pthread_key_t current;
+    #endif
+};
+
+// The tasks of the whole interpreter
+TaskScheduler &tasks() {
+    static TaskScheduler scheduler;
+    return scheduler;
+}
+
+// A function running on a thread of its own, and what it gave once it finished
+class TaskObject : public Object {
+public:
+    TaskObject(Value const &function, Args args, Environment const &env)
+        : function(function), args(args.to_vector()), scope(new Environment(env.global_scope())),
+          done(false), error(NULL) {}
+    ~TaskObject() {
+        delete scope;
+        delete error;
+    }
+
+    // Call the function, and keep what it returns or throws
+    void run() {
+        try {
+            result = function.apply(args, *scope);
+        } catch (Error &e) {
+            error = new Error(e);
+        } catch (std::exception &e) {
+            failure_message = e.what();
+        }
+        // Nothing of the call is kept but its result
+        delete scope;
+        scope = NULL;
+        function = Value();
+        args.clear();
+    }
+
+    // The function, its arguments, and the copy of the global scope it's called in
+    Value function;
+    std::vector<Value> args;
+    Environment *scope;
+    // Whether the task has finished, and what it returned or threw
+    bool done;
+    Value result;
+    Error *error;
+    std::string failure_message;
+    // The threads waiting for the task to finish
+    std::deque<Waiter *> awaiting;
+};
+
+// A queue of values for tasks to pass to each other
+class ChannelObject : public Object {
+public:
+    enum Result { DONE, CLOSED, STUCK };
+
+    ChannelObject(size_t capacity) : items(capacity), first(0), count(0), closed(false) {}
+
+    // Add a value to the end of the channel, waiting for room while it's full
+    Result send(Value const &item) {
+        SharedLock lock(tasks().mutex);
+        while (!closed && count == items.size())
+            if (!tasks().wait(senders)) return STUCK;
+        if (closed) return CLOSED;
+        items[(first + count++) % items.size()] = item;
+        tasks().wake_one(receivers);
+        return DONE;
+    }
+
+    // Take the value at the front of the channel, waiting for one while it's empty.
+    // The values sent before a channel was closed can still be received.
+    Result receive(Value &item) {
+        SharedLock lock(tasks().mutex);
+        while (!closed && count == 0)
+            if (!tasks().wait(receivers)) return STUCK;
+        if (count == 0) return CLOSED;
+        item = items[first];
+        items[first] = Value();
+        first = (first + 1) % items.size();
+        count--;
+        tasks().wake_one(senders);
+        return DONE;
+    }
+
+    // Stop anything more from being sent
+    void close() {
+        SharedLock lock(tasks().mutex);
+        closed = true;
+        tasks().wake_all(senders);
+        tasks().wake_all(receivers);
+    }
+
+private:
+    // The values are kept in a ring of slots, starting at `first`
+    std::vector<Value> items;
+    size_t first, count;
+    bool closed;
+    // The threads waiting to send to the channel, and to receive from it
+    std::deque<Waiter *> senders, receivers;
+};
+
+Value Value::task(TaskObject *object) {
+    Value result;
+    result.type = TASK;
+    result.stack_data.object = object;
+    return result;
+}
+
+Value Value::channel(ChannelObject *object) {
+    Value result;
+    result.type = CHANNEL;
+    result.stack_data.object = object;
+    return result;
+}
+
+TaskObject *Value::as_task() const {
+    if (type != TASK)
+        throw Error(*this, BAD_CAST);
+    return static_cast<TaskObject *>(stack_data.object);
+}
+
+ChannelObject *Value::as_channel() const {
+    if (type != CHANNEL)
+        throw Error(*this, BAD_CAST);
+    return static_cast<ChannelObject *>(stack_data.object);
+}
+
+void TaskScheduler::start(TaskObject *task) {
+    #ifdef HAS_THREADS
+    // The thread pool stops synchronizing when its task is done, so
+    // tasks spawned by the parallel builtins can't outlive them
+    if (!thread_pool().busy()) {
+        mutex.lock();
+        if (!workers_running) {
+            // There's only one thread until the first task starts
+            synchronized = true;
+            workers_running = true;
+        }
+        running++;
+        task->retain();
+        pthread_t thread;
+        bool started = pthread_create(&thread, NULL, run, task) == 0;
+        if (started) pthread_detach(thread);
+        else {
+            running--;
+            task->release();
+        }
+        mutex.unlock();
+        if (started) return;
+    }
+    #endif
+    task->run();
+    task->done = true;
+}
+
+void *TaskScheduler::run(void *arg) {
+    TaskObject *task = (TaskObject *)arg;
+    TaskScheduler &scheduler = tasks();
+    #ifdef HAS_THREADS
+    pthread_setspecific(scheduler.current, task);
+    #endif
+    task->run();
+
+    scheduler.mutex.lock();
+    task->done = true;
+    scheduler.wake_all(task->awaiting);
+    scheduler.mutex.unlock();
+
+    // The thread lets go of every value before it stops counting as running,
+    // since the interpreter may stop synchronizing once no tasks are running
+    if (task->release()) delete task;
+
+    scheduler.mutex.lock();
+    if (--scheduler.running == 0)
+        scheduler.wake_all(scheduler.exiting);
+    scheduler.find_deadlock();
+    scheduler.mutex.unlock();
+    return NULL;
+}
+
+bool TaskScheduler::wait(std::deque<Waiter *> &queue) {
+    Waiter waiter;
+    waiter.state = Waiter::WAITING;
+    waiter.queue = &queue;
+    #ifdef HAS_THREADS
+    pthread_cond_init(&waiter.wake, NULL);
+    #endif
+    queue.push_back(&waiter);
+    waiting.push_back(&waiter);
+    find_deadlock();
+    #ifdef HAS_THREADS
+    while (waiter.state == Waiter::WAITING)
+        pthread_cond_wait(&waiter.wake, &mutex.mutex);
+    pthread_cond_destroy(&waiter.wake);
+    #endif
+    return waiter.state == Waiter::WOKEN;
+}
+
+void TaskScheduler::wake_one(std::deque<Waiter *> &queue) {
+    if (queue.empty()) return;
+    Waiter *waiter = queue.front();
+    queue.pop_front();
+    wake(waiter, Waiter::WOKEN);
+}
+
+void TaskScheduler::wake_all(std::deque<Waiter *> &queue) {
+    while (!queue.empty())
+        wake_one(queue);
+}
+
+void TaskScheduler::wake(Waiter *waiter, Waiter::State state) {
+    waiting.erase(std::find(waiting.begin(), waiting.end(), waiter));
+    waiter->state = state;
+    #ifdef HAS_THREADS
+    pthread_cond_signal(&waiter->wake);
+    #endif
+}
+
+void TaskScheduler::find_deadlock() {
+    // Besides the tasks, there's the thread that spawned them
+    if (waiting.empty() || int(waiting.size()) <= running) return;
+    while (!waiting.empty()) {
+        Waiter *waiter = waiting.back();
+        waiter->queue->erase(std::find(waiter->queue->begin(), waiter->queue->end(), waiter));
+        wake(waiter, Waiter::STUCK);
+    }
+}
+
+void TaskScheduler::settle() {
+    // This only changes while there's one thread
+    if (!synchronized) return;
+    mutex.lock();
+    bool finished = running == 0;
+    mutex.unlock();
+    if (finished) {
+        synchronized = false;
+        workers_running = false;
+    }
+}
+
+void TaskScheduler::wait_for_tasks() {
+    #ifdef HAS_THREADS
+    // A task that exits the program only waits for the others
+    int self = pthread_getspecific(current) != NULL? 1 : 0;
+    mutex.lock();
+    // If every task is stuck, they give up and finish with an error
+    while (running > self)
+        wait(exiting);
+    mutex.unlock();
+    #endif
+    // The rest of the program exits on one thread
+    settle();
+}
+
+// Read a line from a file, without its newline, and get whether there was one to read
+bool read_file_line(FILE *file, std::string &line) {
+    line.clear();
+    char buffer[4096];
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        size_t n = strlen(buffer);
+        if (n > 0 && buffer[n-1] == '\n') {
+            line.append(buffer, n-1);
+            return true;
+        }
+        line.append(buffer, n);
+    }
+    return !line.empty();
+}
+
+// A cursor over what a `for` loop iterates over: the items of a list, vector,
+// or view, the lines of a file, or the values received from a channel. Files
+// are read a line at a time, so looping over one takes constant memory. Lists
+// are only iterated up to the length they had when the loop started, and
+// channels until they're closed.
+class ItemIterator {
+public:
+    ItemIterator(Value const &iterable) : iterable(iterable), position(0), length(0), file(NULL), map(NULL), channel(NULL) {
+        std::string type = iterable.get_type_name();
+        if (type == FILE_TYPE) {
+            file = iterable.as_file();
+            if (file->file == NULL)
+                throw Error(iterable, FILE_CLOSED);
+        } else if (type == DICT_TYPE || type == SET_TYPE) {
+            map = iterable.as_map();
+            length = map->count;
+        } else if (type == CHANNEL_TYPE) {
+            channel = iterable.as_channel();
+        } else length = iterable.list_length();
+    }
+
+    // Get the next item, and whether there was one left
+    bool next(Value &item) {
+        if (file != NULL) {
+            if (file->file == NULL || !read_file_line(file->file, line)) return false;
+            item = Value::string(line);
+            return true;
+        }
+        // The keys of a map are iterated over in the order they were added
+        if (map != NULL) {
+            while (position < length && map->buffer->previous[position] != MapBuffer::NONE)
+                position++;
+            if (position >= length) return false;
+            item = map->buffer->keys[position++];
+            return true;
+        }
+        if (channel != NULL) {
+            ChannelObject::Result result = channel->receive(item);
+            if (result == ChannelObject::STUCK)
+                throw Error(iterable, BLOCKED_FOREVER);
+            return result == ChannelObject::DONE;
+        }
+        if (position >= length) return false;
+        item = iterable.list_item(position++);
+        return true;
+    }
+
+private:
+    Value iterable;
+    size_t position, length;
+    FileObject *file;
+    MapObject *map;
+    ChannelObject *channel;
+    // The last line read from the file
+    std::string line;
+};
+
+// This namespace contains all the definitions of builtin functions
+namespace builtin {
+    // Regular builtins are passed their arguments already evaluated.
+    //
+    // Special forms are just builtin functions that don't get their
+    // arguments evaluated. They are registered as special forms in the
+    // builtin table, and they evaluate whichever arguments they need to.
+
+    // Create a lambda function (SPECIAL FORM)
+    Value lambda(Args args, Environment &env) {
+        if (args.size() < 2)
+            throw Error(Value("lambda", lambda), env, TOO_FEW_ARGS);
+
+        if (args[0].get_type_name() != LIST_TYPE)
+            throw Error(Value("lambda", lambda), env, INVALID_LAMBDA);
+
+        return Value(args[0].as_list(), args[1], env);
+    }
+
+    // if-else (SPECIAL FORM)
+    Value if_then_else(Args args, Environment &env) {
+        if (args.size() != 3)
+            throw Error(Value("if", if_then_else), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (args[0].eval(env).as_bool())
+            return args[1].eval(env);
+        else return args[2].eval(env);
+    }
+
+    // Define a variable with a value (SPECIAL FORM)
+    Value define(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("define", define), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+            
+        Value result = args[1].eval(env);
+        result.set_lambda_name(args[0]);
+        env.bind(args[0], result);
+        return result;
+    }
+
+    // Define a function with parameters and a result expression (SPECIAL FORM)
+    Value defun(Args args, Environment &env) {
+        if (args.size() != 3)
+            throw Error(Value("defun", defun), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        if (args[1].get_type_name() != LIST_TYPE)
+            throw Error(Value("defun", defun), env, INVALID_LAMBDA);
+
+        Value f = Value(args[1].as_list(), args[2], env);
+        f.set_lambda_name(args[0]);
+        env.bind(args[0], f);
+        return f;
+    }
+
+    // Counts the start and the end of a loop's run, which
+    // invalidates the values of the loop invariant calls
+    struct LoopRun {
+        LoopRun() { if (!workers_running) loop_runs++; }
+        ~LoopRun() { if (!workers_running) loop_runs++; }
+    };
+
+    // Loop over a list of expressions with a condition (SPECIAL FORM)
+    Value while_loop(Args args, Environment &env) {
+        LoopRun run;
+        Value acc;
+        while (args[0].eval(env).as_bool()) {
+            for (size_t i=1; i<args.size()-1; i++)
+                args[i].eval(env);
+            acc = args[args.size()-1].eval(env);
+        }
+        return acc;
+    }
+
+    // Iterate through a list of values in a list (SPECIAL FORM)
+    Value for_loop(Args args, Environment &env) {
+        LoopRun run;
+        Value acc;
+        ItemIterator items(args[1].eval(env));
+        // Make sure the loop variable is an atom
+        args[0].as_symbol();
+
+        Value item;
+        while (items.next(item)) {
+            env.bind(args[0], item);
+
+            for (size_t j=2; j<args.size()-1; j++)
+                args[j].eval(env);
+            acc = args[args.size()-1].eval(env);
+        }
+
+        return acc;
+    }
+
+    // Evaluate a block of expressions in the current environment (SPECIAL FORM)
+    Value do_block(Args args, Environment &env) {
+        Value acc;
+        for (size_t i=0; i<args.size(); i++)
+            acc = args[i].eval(env);
+        return acc;
+    }
+
+    // Evaluate a block of expressions in a new environment (SPECIAL FORM)
+    Value scope(Args args, Environment &env) {
+        Environment e = env;
+        Value acc;
+        for (size_t i=0; i<args.size(); i++)
+            acc = args[i].eval(e);
+        return acc;
+    }
+
+    // Quote an expression (SPECIAL FORM)
+    Value quote(Args args, Environment &) {
+        return Value(args.to_vector());
+    }
+
+    #ifdef USE_STD
+    // Exit the program with an integer code, once its tasks have finished
+    Value exit(Args args, Environment &) {
+        int code = args.size() < 1? 0 : args[0].cast_to_int().as_int();
+        tasks().wait_for_tasks();
+        std::exit(code);
+        return Value();
+    }
+
+    // Write all of the buffered output
+    Value flush(Args args, Environment &env) {
+        if (!args.empty())
+            throw Error(Value("flush", flush), env, TOO_MANY_ARGS);
+        flush_output();
+        return Value();
+    }
+
+    // Get the number of bytes of output that are buffered before they're
+    // written, or set it. With a size of 0, every print is written right away.
+    Value output_buffer(Args args, Environment &env) {
+        if (args.size() > 1)
+            throw Error(Value("output-buffer", output_buffer), env, TOO_MANY_ARGS);
+        int previous = int(output().get_capacity());
+        if (args.size() == 1) {
+            int size = args[0].as_int();
+            if (size < 0)
+                throw Error(args[0], env, INVALID_ARGUMENT);
+            output().set_capacity(size_t(size));
+        }
+        return Value(previous);
+    }
+
+    // Print several values and return the last one
+    Value print(Args args, Environment &env) {
+        if (args.size() < 1)
+            throw Error(Value("print", print), env, TOO_FEW_ARGS);
+
+        // The values are written straight into the output buffer
+        Output &out = output();
+        SharedLock lock(out.mutex);
+        for (size_t i=0; i<args.size(); i++) {
+            args[i].display_to(out.buffer);
+            if (i < args.size() - 1)
+                out.buffer += ' ';
+        }
+        out.buffer += '\n';
+        out.end_print();
+        return args[args.size() - 1];
+    }
+
+    // Get user input with an optional prompt
+    Value input(Args args, Environment &env) {
+        if (args.size() > 1)
+            throw Error(Value("input", input), env, TOO_MANY_ARGS);
+
+        // Everything printed so far is shown before waiting for input
+        flush_output();
+        if (!args.empty())
+            std::cout << args[0];
+
+        std::string s;
+        std::getline(std::cin, s);
+        return Value::string(s);
+    }
+
+    // Get a random number between two numbers inclusively
+    Value random(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("random", random), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        int low = args[0].as_int(), high = args[1].as_int();
+        unsigned range = unsigned(high - low) + 1;
+        return Value(int(low + (range == 0? random_numbers().next() : random_numbers().next() % range)));
+    }
+
+    // Get the contents of a file
+    Value read_file(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("read-file", read_file), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        // return Value::string(content);
+        return Value::string(read_file_contents(args[0].as_string()));
+    }
+
+    // Write a string to a file
+    Value write_file(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("write-file", write_file), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        std::ofstream f;
+        // The first argument is the file name
+        f.open(args[0].as_string().c_str());
+        // The second argument is the contents of the file to write
+        Value result = Value((f << args[1].as_string())? 1 : 0);
+        f.close();
+        return result;
+    }
+
+    // Open a file to read from, write to, or append to
+    Value open_file(Args args, Environment &env) {
+        if (args.empty() || args.size() > 2)
+            throw Error(Value("open", open_file), env, args.empty()? TOO_FEW_ARGS : TOO_MANY_ARGS);
+
+        std::string mode = args.size() == 2? args[1].as_string() : "r";
+        if (mode != "r" && mode != "w" && mode != "a")
+            throw Error(args[1], env, INVALID_ARGUMENT);
+        FILE *file = fopen(args[0].as_string().c_str(), mode.c_str());
+        if (file == NULL)
+            throw Error(args[0], env, COULD_NOT_OPEN);
+        return Value::file(new FileObject(file, args[0].as_string()));
+    }
+
+    // Close a file or a channel. Files are also closed when nothing refers to them anymore.
+    Value close_file(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("close", close_file), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (args[0].get_type_name() == CHANNEL_TYPE)
+            args[0].as_channel()->close();
+        else args[0].as_file()->close();
+        return Value();
+    }
+
+    // Get the open file of a file handle
+    FILE *open_handle(Value const &handle, Environment &env) {
+        FILE *file = handle.as_file()->file;
+        if (file == NULL)
+            throw Error(handle, env, FILE_CLOSED);
+        return file;
+    }
+
+    // Read the next line of a file, or get unit at the end of the file
+    Value read_line(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("read-line", read_line), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        std::string line;
+        if (!read_file_line(open_handle(args[0], env), line))
+            return Value();
+        return Value::string(line);
+    }
+
+    // Read up to some number of bytes from a file, or get unit at the end of the file
+    Value read_chunk(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("read-chunk", read_chunk), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        FILE *file = open_handle(args[0], env);
+        int size = args[1].as_int();
+        if (size <= 0)
+            throw Error(args[1], env, INVALID_ARGUMENT);
+
+        std::string chunk(size_t(size), '\0');
+        size_t read = fread(&chunk[0], 1, chunk.size(), file);
+        if (read == 0) return Value();
+        chunk.resize(read);
+        return Value::string(chunk);
+    }
+
+    // Write the values to a file, and get whether they were all written
+    Value write_to(Args args, Environment &env) {
+        if (args.size() < 2)
+            throw Error(Value("write", write_to), env, TOO_FEW_ARGS);
+        FILE *file = open_handle(args[0], env);
+        bool written = true;
+        for (size_t i=1; i<args.size(); i++) {
+            if (args[i].get_type_name() == VIEW_TYPE) {
+                // Views are written straight from their bytes
+                ViewObject *view = args[i].as_view();
+                written = fwrite(view->data, 1, view->length, file) == view->length && written;
+            } else if (args[i].get_type_name() == BUILDER_TYPE) {
+                // So are builders
+                std::string const &text = args[i].as_builder()->text;
+                written = fwrite(text.data(), 1, text.size(), file) == text.size() && written;
+            } else {
+                std::string text = args[i].display();
+                written = fwrite(text.data(), 1, text.size(), file) == text.size() && written;
+            }
+        }
+        return Value(written? 1 : 0);
+    }
+
+    // Map a file into memory, and get a read-only view of its contents
+    Value mmap_file(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("mmap", mmap_file), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        MappingObject *mapping;
+        try {
+            mapping = new MappingObject(args[0].as_string());
+        } catch (std::runtime_error &) {
+            throw Error(args[0], env, COULD_NOT_OPEN);
+        }
+
+        // The view takes its own reference to the mapping
+        Value result = Value::view(new ViewObject(mapping, mapping->file.data(), mapping->file.size()));
+        mapping->release();
+        return result;
+    }
+
+    // Read a file and execute its code
+    Value include(Args args, Environment &env) {
+        // Import is technically not a special form, it's more of a macro.
+        // We can evaluate our arguments.
+        if (args.size() != 1)
+            throw Error(Value("include", include), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        // Included files are parsed only the first time their code is seen
+        Environment e;
+        Value result = run_file(args[0].as_string(), e);
+        env.combine(e);
+        return result;
+    }
+    #endif
+
+    // Evaluate a value as code
+    Value eval(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("eval", eval), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        else return args[0].eval(env);
+    }
+
+    // Create a list of values
+    Value list(Args args, Environment &) {
+        return Value(args.to_vector());
+    }
+
+    // Sum multiple values
+    Value sum(Args args, Environment &env) {
+        if (args.size() < 2)
+            throw Error(Value("+", sum), env, TOO_FEW_ARGS);
+        return Value::sum(args);
+    }
+
+    // Subtract two values
+    Value subtract(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("-", subtract), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return args[0] - args[1];
+    }
+
+    // Multiply several values
+    Value product(Args args, Environment &env) {
+        if (args.size() < 2)
+            throw Error(Value("*", product), env, TOO_FEW_ARGS);
+        return Value::product(args);
+    }
+
+    // Divide two values
+    Value divide(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("/", divide), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return args[0] / args[1];
+    }
+
+    // Get the remainder of values
+    Value remainder(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("%", remainder), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return args[0] % args[1];
+    }
+
+    // Are two values equal?
+    Value eq(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("=", eq), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return Value(int(args[0] == args[1]));
+    }
+
+    // Are two values not equal?
+    Value neq(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("!=", neq), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return Value(int(args[0] != args[1]));
+    }
+
+    // Is one number greater than another?
+    Value greater(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value(">", greater), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return Value(int(args[0] > args[1]));
+    }
+
+    // Is one number less than another?
+    Value less(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("<", less), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return Value(int(args[0] < args[1]));
+    }
+
+    // Is one number greater than or equal to another?
+    Value greater_eq(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value(">=", greater_eq), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return Value(int(args[0] >= args[1]));
+    }
+
+    // Is one number less than or equal to another?
+    Value less_eq(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("<=", less_eq), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return Value(int(args[0] <= args[1]));
+    }
+
+    // Get the type name of a value
+    Value get_type_name(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("type", get_type_name), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        return Value::string(args[0].get_type_name());
+    }
+
+    // Cast an item to a float
+    Value cast_to_float(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value(FLOAT_TYPE, cast_to_float), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return args[0].cast_to_float();
+    }
+
+    // Cast an item to an int
+    Value cast_to_int(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value(INT_TYPE, cast_to_int), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        return args[0].cast_to_int();
+    }
+
+    // Index a list
+    Value index(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("index", index), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        size_t length = args[0].list_length();
+        int i = args[1].as_int();
+        if (length == 0 || i >= (int)length)
+            throw Error(args[0], env, INDEX_OUT_OF_RANGE);
+
+        return args[0].list_item(i);
+    }
+
+    // Insert a value into a list
+    Value insert(Args args, Environment &env) {
+        if (args.size() != 3)
+            throw Error(Value("insert", insert), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        Args list = args[0].as_items();
+        int i = args[1].as_int();
+        if (i > (int)list.size())
+            throw Error(args[0], env, INDEX_OUT_OF_RANGE);
+
+        // Inserting at the end shares the list's items
+        Value result = args[0].slice(0, i);
+        result.push(args[2]);
+        for (size_t j=i; j<list.size(); j++)
+            result.push(list[j]);
+        return result;
+    }
+
+    // Remove a value at an index from a list
+    Value remove(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("remove", remove), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        Args list = args[0].as_items();
+        int i = args[1].as_int();
+        if (list.empty() || i >= (int)list.size())
+            throw Error(args[0], env, INDEX_OUT_OF_RANGE);
+
+        // Removing the first or last item shares the rest of the list's items
+        if (i == 0)
+            return args[0].slice(1, list.size() - 1);
+        Value result = args[0].slice(0, i);
+        for (size_t j=i+1; j<list.size(); j++)
+            result.push(list[j]);
+        return result;
+    }
+
+    // Get the length of a list, the number of bytes in a string or a builder,
+    // or the number of keys in a map
+    Value len(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("len", len), env, args.size() > 1?
+                TOO_MANY_ARGS : TOO_FEW_ARGS
+            );
 
-    friend std::ostream &operator<<(std::ostream &os, Value const &v) {
-        return os << v.display();
+        std::string type = args[0].get_type_name();
+        if (type == STRING_TYPE)
+            return Value(int(args[0].as_string().size()));
+        if (type == BUILDER_TYPE)
+            return Value(int(args[0].as_builder()->text.size()));
+        if (type == DICT_TYPE || type == SET_TYPE)
+            return Value(int(args[0].as_map()->size));
+        return Value(int(args[0].list_length()));
     }
 
-private:
-    enum {
-        QUOTE,
-        ATOM,
-        INT,
-        FLOAT,
-        LIST,
-        STRING,
-        LAMBDA,
-        BUILTIN,
-        UNIT
-    } type;
+    // Add an item to the end of a list
+    Value push(Args args, Environment &env) {
+        if (args.size() == 0)
+            throw Error(Value("push", push), env, TOO_FEW_ARGS);
+        Value result = args[0];
+        for (size_t i=1; i<args.size(); i++)
+            result.push(args[i]);
+        return result;
+    }
 
-    union {
-        int i;
-        double f;
-        Builtin b;
-    } stack_data;
+    Value pop(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("pop", pop), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        Value list = args[0];
+        return list.pop();
+    }
 
-    std::string str;
-    std::vector<Value> list;
-    Environment lambda_scope;
-};
+    Value head(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("head", head), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (args[0].list_length() == 0)
+            throw Error(Value("head", head), env, INDEX_OUT_OF_RANGE);
 
-Error::Error(Value v, Environment const &env, const char *msg) : env(env), msg(msg) {
-    cause = new Value;
-    *cause = v;
-}
+        return args[0].list_item(0);
+    }
 
-Error::Error(Error const &other) : env(other.env), msg(other.msg) {
-    cause = new Value(*other.cause);
-}
+    Value tail(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("tail", tail), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
 
-Error::~Error() {
-    delete cause;
-}
+        // The tail shares the items of the list
+        size_t length = args[0].list_length();
+        if (length == 0)
+            return Value(std::vector<Value>());
+        return args[0].slice(1, length - 1);
+    }
 
-std::string Error::description() {
-    return "error: the expression `" + cause->debug() + "` failed in scope " + to_string(env) + " with message \"" + msg + "\"";
-}
+    Value parse(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("parse", parse), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (args[0].get_type_name() != STRING_TYPE)
+            throw Error(args[0], env, INVALID_ARGUMENT);
+        std::vector<Value> parsed = ::parse(args[0].as_string());
 
-void Environment::combine(Environment const &other) {
-    // Normally, I would use the `insert` method of the `map` class,
-    // but it doesn't overwrite previously declared values for keys.
-    std::map<std::string, Value>::const_iterator itr = other.defs.begin();
-    for (; itr!=other.defs.end(); itr++) {
-        // Iterate through the keys and assign each value.
-        defs[itr->first] = itr->second;
+        // if (parsed.size() == 1)
+        //     return parsed[0];
+        // else return Value(parsed);
+        return Value(parsed);
     }
-}
 
-std::ostream &operator<<(std::ostream &os, Environment const &e) {
-    std::map<std::string, Value>::const_iterator itr = e.defs.begin();
-    os << "{ ";
-    for (; itr != e.defs.end(); itr++) {
-        os << '\'' << itr->first << "' : " << itr->second.debug() << ", ";
+    Value replace(Args args, Environment &env) {
+        if (args.size() != 3)
+            throw Error(Value("replace", replace), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (!args[0].is_text())
+            throw Error(args[0], env, MISMATCHED_TYPES);
+
+        size_t length;
+        const char *src = args[0].text_data(length);
+        return Value::string(replace_substring(src, length, args[1].as_string(), args[2].as_string()));
     }
-    return os << "}";
-}
 
-void Environment::set(std::string name, Value value) {
-    defs[name] = value;
-}
+    // Make a string builder, starting with the display forms of the arguments
+    Value builder(Args args, Environment &) {
+        Value result = Value::builder(new BuilderObject());
+        std::string &text = result.as_builder()->text;
+        for (size_t i=0; i<args.size(); i++)
+            args[i].display_to(text);
+        return result;
+    }
 
+    // Add the display forms of values to the end of a string builder, in place
+    Value append(Args args, Environment &env) {
+        if (args.size() < 1)
+            throw Error(Value("append", append), env, TOO_FEW_ARGS);
+        if (args[0].get_type_name() != BUILDER_TYPE)
+            throw Error(args[0], env, MISMATCHED_TYPES);
 
-Value Value::apply(std::vector<Value> args, Environment &env) {
-    Environment e;
-    std::vector<Value> params;
-    switch (type) {
-    case LAMBDA:
-        // Get the list of parameter atoms
-        params = list[0].list;
-        if (params.size() != args.size())
-            throw Error(Value(args), env, args.size() > params.size()?
-                TOO_MANY_ARGS : TOO_FEW_ARGS
-            );
+        std::string &text = args[0].as_builder()->text;
+        for (size_t i=1; i<args.size(); i++)
+            args[i].display_to(text);
+        return args[0];
+    }
 
-        // Get the captured scope from the lambda
-        e = lambda_scope;
-        // And make this scope the parent scope
-        e.set_parent_scope(&env);
+    // Join the display forms of the items of a list into one string,
+    // with an optional separator between them
+    Value join(Args args, Environment &env) {
+        if (args.size() < 1 || args.size() > 2)
+            throw Error(Value("join", join), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        std::string separator = args.size() == 2? args[1].as_string() : "";
 
-        // Iterate through the list of parameters and
-        // insert the arguments into the scope.
-        for (size_t i=0; i<params.size(); i++) {
-            if (params[i].type != ATOM) 
-                throw Error(*this, env, INVALID_LAMBDA);
-            // Set the parameter name into the scope.
-            e.set(params[i].str, args[i]);
+        std::string result;
+        size_t length = args[0].list_length();
+        for (size_t i=0; i<length; i++) {
+            if (i > 0) result += separator;
+            args[0].list_item(i).display_to(result);
         }
+        return Value::string(result);
+    }
 
-        // Evaluate the function body with the function scope
-        return list[1].eval(e);
-    case BUILTIN:
-        // Here, we call the builtin function with the current scope.
-        // This allows us to write special forms without syntactic sugar.
-        // For functions that are not special forms, we just evaluate
-        // the arguments before we run the function.
-        return (stack_data.b)(args, env);
-    default:
-        // We can only call lambdas and builtins
-        throw Error(*this, env, CALL_NON_FUNCTION);
+    // Split a string or a view at every occurrence of a separator. The pieces of
+    // a view share its bytes, and the pieces of a string are copied only once.
+    Value split(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("split", split), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (!args[0].is_text())
+            throw Error(args[0], env, MISMATCHED_TYPES);
+        std::string separator = args[1].as_string();
+        if (separator.empty())
+            throw Error(args[1], env, INVALID_ARGUMENT);
+
+        size_t length;
+        const char *data = args[0].text_data(length), *end = data + length;
+        ViewObject *view = args[0].get_type_name() == VIEW_TYPE? args[0].as_view() : NULL;
+        std::vector<Value> result;
+        for (const char *i=data;;) {
+            const char *found = std::search(i, end, separator.begin(), separator.end());
+            if (view != NULL)
+                result.push_back(Value::view(new ViewObject(view->owner, i, found - i)));
+            else
+                result.push_back(Value::string(std::string(i, found)));
+            if (found == end) break;
+            i = found + separator.size();
+        }
+        return Value(result);
     }
-}
 
+    Value display(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("display", display), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        return Value::string(args[0].display());
+    }
 
-Value Value::eval(Environment &env) {
-    std::vector<Value> args;
-    Value function;
-    Environment e;
-    switch (type) {
-    case QUOTE:
-        return list[0];
-    case ATOM:
-        return env.get(str);
-    case LIST:
-        if (list.size() < 1)
-            throw Error(*this, env, EVAL_EMPTY_LIST);
+    Value debug(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("debug", debug), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
 
-        args = std::vector<Value>(list.begin() + 1, list.end());
-        
-        // Only evaluate our arguments if it's not builtin!
-        // Builtin functions can be special forms, so we
-        // leave them to evaluate their arguments.
-        function = list[0].eval(env);
+        return Value::string(args[0].debug());
+    }
 
-        if (!function.is_builtin())
-            for (size_t i=0; i<args.size(); i++)
-                args[i] = args[i].eval(env);
+    Value map_list(Args args, Environment &env) {
+        std::vector<Value> result;
+        size_t length = args[1].list_length();
+        result.reserve(length);
+        for (size_t i=0; i<length; i++) {
+            // Lazy ranges are streamed through the function one item at a time
+            Value item = args[1].list_item(i);
+            result.push_back(args[0].apply(Args(&item, 1), env));
+        }
+        return Value(result);
+    }
 
-        return function.apply(
-            args,
-            env
-        );
+    Value filter_list(Args args, Environment &env) {
+        std::vector<Value> result;
+        size_t length = args[1].list_length();
+        for (size_t i=0; i<length; i++) {
+            // Lazy ranges are streamed through the function one item at a time
+            Value item = args[1].list_item(i);
+            if (args[0].apply(Args(&item, 1), env).as_bool())
+                result.push_back(item);
+        }
+        return Value(result);
+    }
 
-    default:
-        return *this;
+    Value reduce_list(Args args, Environment &env) {
+        size_t length = args[2].list_length();
+        // The accumulator and the current item are passed to the function
+        Value pair[2];
+        pair[0] = args[1];
+        for (size_t i=0; i<length; i++) {
+            pair[1] = args[2].list_item(i);
+            pair[0] = args[0].apply(Args(pair, 2), env);
+        }
+        return pair[0];
     }
-}
 
-void skip_whitespace(std::string &s, int &ptr) {
-    while (isspace(s[ptr])) { ptr++; }
-}
+    // Applies a function to each item of a list on the thread pool
+    class MapTask : public ParallelTask {
+    public:
+        MapTask(Value const &f, Value const &list, Environment &env, std::vector<Value> &results)
+            : f(f), list(list), env(env), results(results) {}
+
+        void run(size_t begin, size_t end) {
+            // Each range is run in a scope of its own, so anything the function
+            // defines in the scope it's called from isn't shared between threads.
+            Environment scope;
+            scope.set_parent_scope(&env);
+            for (size_t i=begin; i<end; i++) {
+                Value item = list.list_item(i);
+                results[i] = f.apply(Args(&item, 1), scope);
+            }
+        }
 
-// Parse a single value and increment the pointer
-// to the beginning of the next value to parse.
-Value parse(std::string &s, int &ptr) {
-    skip_whitespace(s, ptr);
-
-    // Skip comments
-    while (s[ptr] == ';') {
-        // If this is a comment
-        int work_ptr = ptr;
-        // Skip to the end of the line
-        while (s[work_ptr] != '\n' && work_ptr < int(s.length())) { work_ptr++; }
-        ptr = work_ptr;
-        skip_whitespace(s, ptr);
-
-        // If we're at the end of the string, return an empty value
-        if (s.substr(ptr, s.length()-ptr-1) == "")
-            return Value();
+    private:
+        Value const &f, &list;
+        Environment &env;
+        std::vector<Value> &results;
+    };
+
+    // Reduces blocks of a list, or pairs of partial results, on the thread pool
+    class ReduceTask : public ParallelTask {
+    public:
+        ReduceTask(Value const &f, Value const &list, size_t block, Environment &env, std::vector<Value> &results)
+            : f(f), list(list), block(block), env(env), results(results) {}
+
+        void run(size_t begin, size_t end) {
+            Environment scope;
+            scope.set_parent_scope(&env);
+            Value pair[2];
+            for (size_t i=begin; i<end; i++) {
+                size_t last = std::min(list.list_length(), (i + 1) * block);
+                pair[0] = list.list_item(i * block);
+                for (size_t j=i * block + 1; j<last; j++) {
+                    pair[1] = list.list_item(j);
+                    pair[0] = f.apply(Args(pair, 2), scope);
+                }
+                results[i] = pair[0];
+            }
+        }
+
+    private:
+        Value const &f, &list;
+        size_t block;
+        Environment &env;
+        std::vector<Value> &results;
+    };
+
+    // Map a function over a list on the thread pool.
+    // The function is applied in a scope of its own, so anything it
+    // defines in the scope it's called from is dropped.
+    Value pmap_list(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("pmap", pmap_list), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        std::vector<Value> result(args[1].list_length());
+        MapTask task(args[0], args[1], env, result);
+        thread_pool().run(task, result.size());
+        return Value(result);
     }
 
+    // Filter a list with a predicate on the thread pool
+    Value pfilter_list(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("pfilter", pfilter_list), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        size_t length = args[1].list_length();
+        std::vector<Value> keep(length), result;
+        MapTask task(args[0], args[1], env, keep);
+        thread_pool().run(task, length);
+        // Keep the items in order
+        for (size_t i=0; i<length; i++)
+            if (keep[i].as_bool())
+                result.push_back(args[1].list_item(i));
+        return Value(result);
+    }
 
-    // Parse the value
-    if (s == "") {
-        return Value();
-    } else if (s[ptr] == '\'') {
-        // If this is a quote
-        ptr++;
-        return Value::quote(parse(s, ptr));
+    // Reduce a list on the thread pool. The items are split into blocks which are
+    // reduced in parallel, and then the results are combined in pairs, in order,
+    // like a tree. This gives the same result as `reduce` for associative functions.
+    Value preduce_list(Args args, Environment &env) {
+        if (args.size() != 3)
+            throw Error(Value("preduce", preduce_list), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        size_t length = args[2].list_length();
+        if (length == 0) return args[1];
+
+        size_t blocks = std::min(length, size_t(thread_pool().size()) * 8);
+        size_t block = (length + blocks - 1) / blocks;
+        blocks = (length + block - 1) / block;
+        std::vector<Value> partial(blocks);
+        ReduceTask task(args[0], args[2], block, env, partial);
+        thread_pool().run(task, blocks);
+
+        // Combine the partial results two at a time
+        while (partial.size() > 1) {
+            std::vector<Value> combined((partial.size() + 1) / 2);
+            Value list(partial);
+            ReduceTask pairs(args[0], list, 2, env, combined);
+            thread_pool().run(pairs, combined.size());
+            partial = combined;
+        }
 
-    } else if (s[ptr] == '(') {
-        // If this is a list
-        skip_whitespace(s, ++ptr);
+        Value pair[2];
+        pair[0] = args[1];
+        pair[1] = partial[0];
+        return args[0].apply(Args(pair, 2), env);
+    }
 
-        Value result = Value(std::vector<Value>());
+    // Get the number of threads the parallel builtins use, or set it
+    Value threads(Args args, Environment &env) {
+        if (args.size() > 1)
+            throw Error(Value("threads", threads), env, TOO_MANY_ARGS);
+        // The pool can't be resized by one of its own tasks
+        if (args.size() == 1 && !workers_running)
+            thread_pool().resize(args[0].as_int());
+        return Value(thread_pool().size());
+    }
 
-        while (s[ptr] != ')')
-            result.push(parse(s, ptr));
-        
-        skip_whitespace(s, ++ptr);
+    // Call a function with some arguments on a task of its own, and get the task
+    Value spawn(Args args, Environment &env) {
+        if (args.size() < 1)
+            throw Error(Value("spawn", spawn), env, TOO_FEW_ARGS);
+        if (args[0].get_type_name() != FUNCTION_TYPE)
+            throw Error(args[0], env, CALL_NON_FUNCTION);
+
+        tasks().settle();
+        TaskObject *task = new TaskObject(args[0], Args(args.begin() + 1, args.size() - 1), env);
+        Value result = Value::task(task);
+        tasks().start(task);
         return result;
-        
-    } else if (isdigit(s[ptr]) || (s[ptr] == '-' && isdigit(s[ptr + 1]))) {
-        // If this is a number
-        bool negate = s[ptr] == '-';
-        if (negate) ptr++;
-        
-        int save_ptr = ptr;
-        while (isdigit(s[ptr]) || s[ptr] == '.') ptr++;
-        std::string n = s.substr(save_ptr, ptr);
-        skip_whitespace(s, ptr);
-        
-        if (n.find('.') != std::string::npos)
-            return Value((negate? -1 : 1) * atof(n.c_str()));
-        else return Value((negate? -1 : 1) * atoi(n.c_str()));
-
-    } else if (s[ptr] == '\"') {
-        // If this is a string
-        int n = 1;
-        while (s[ptr + n] != '\"') {
-            if (ptr + n >= int(s.length()))
-                throw std::runtime_error(MALFORMED_PROGRAM);
-                
-            if (s[ptr + n] == '\\') n++;
-            n++;
-        }
-
-        std::string x = s.substr(ptr+1, n-1);
-        ptr += n+1;
-        skip_whitespace(s, ptr);
-
-        // Iterate over the characters in the string, and
-        // replace escaped characters with their intended values.
-        for (size_t i=0; i<x.size(); i++) {
-            if (x[i] == '\\' && x[i+1] == '\\')
-                x.replace(i, 2, "\\");
-            else if (x[i] == '\\' && x[i+1] == '"')
-                x.replace(i, 2, "\"");
-            else if (x[i] == '\\' && x[i+1] == 'n')
-                x.replace(i, 2, "\n");
-            else if (x[i] == '\\' && x[i+1] == 't')
-                x.replace(i, 2, "\t");
-        }
-
-        return Value::string(x);
-    } else if (s[ptr] == '@') {
-        ptr++;
-        skip_whitespace(s, ptr);
-        return Value();
+    }
 
-    } else if (is_symbol(s[ptr])) {
-        // If this is a string
-        int n = 0;
-        while (is_symbol(s[ptr + n])) {
-            n++;
+    // Wait for a task to finish, and get what its function returned.
+    // If the function threw an error, it's thrown again here.
+    Value await(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("await", await), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        TaskObject *task = args[0].as_task();
+        {
+            SharedLock lock(tasks().mutex);
+            while (!task->done)
+                if (!tasks().wait(task->awaiting))
+                    throw Error(args[0], env, BLOCKED_FOREVER);
         }
+        tasks().settle();
 
-        std::string x = s.substr(ptr, n);
-        ptr += n;
-        skip_whitespace(s, ptr);
-        return Value::atom(x);
-    } else {
-        throw std::runtime_error(MALFORMED_PROGRAM);
+        if (task->error != NULL) throw *task->error;
+        if (!task->failure_message.empty())
+            throw std::runtime_error(task->failure_message);
+        return task->result;
     }
-}
 
-// Parse an entire program and get its list of expressions.
-std::vector<Value> parse(std::string s) {
-    int i=0, last_i=-1;
-    std::vector<Value> result;
-    // While the parser is making progress (while the pointer is moving right)
-    // and the pointer hasn't reached the end of the string,
-    while (last_i != i && i <= int(s.length()-1)) {
-        // Parse another expression and add it to the list.
-        last_i = i;
-        result.push_back(parse(s, i));
+    // Make a channel that holds up to a number of values, or one value
+    Value chan(Args args, Environment &env) {
+        if (args.size() > 1)
+            throw Error(Value("chan", chan), env, TOO_MANY_ARGS);
+        int capacity = args.size() == 1? args[0].as_int() : 1;
+        if (capacity < 1)
+            throw Error(args[0], env, INVALID_ARGUMENT);
+        return Value::channel(new ChannelObject(capacity));
     }
 
-    // If the whole string wasn't parsed, the program must be bad.
-    if (i < int(s.length()))
-        throw std::runtime_error(MALFORMED_PROGRAM);
+    // Send a value to a channel, waiting while it's full, and get the value
+    Value send(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("send", send), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
 
-    // Return the list of values parsed.
-    return result;
-}
+        ChannelObject::Result result = args[0].as_channel()->send(args[1]);
+        if (result != ChannelObject::DONE)
+            throw Error(args[0], env, result == ChannelObject::CLOSED? CHANNEL_CLOSED : BLOCKED_FOREVER);
+        return args[1];
+    }
 
-// Execute code in an environment
-Value run(std::string code, Environment &env) {
-    // Parse the code
-    std::vector<Value> parsed = parse(code);
-    // Iterate over the expressions and evaluate them
-    // in this environment.
-    for (size_t i=0; i<parsed.size()-1; i++)
-        parsed[i].eval(env);
+    // Receive a value from a channel, waiting while it's empty.
+    // Once the channel is closed and empty, this gives unit.
+    Value recv(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("recv", recv), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+
+        Value item;
+        ChannelObject::Result result = args[0].as_channel()->receive(item);
+        if (result == ChannelObject::STUCK)
+            throw Error(args[0], env, BLOCKED_FOREVER);
+        tasks().settle();
+        return item;
+    }
 
-    // Return the result of the last expression.
-    return parsed[parsed.size()-1].eval(env);
-}
+    // Collect the cycles of garbage now, and get the number of objects freed
+    Value gc(Args args, Environment &env) {
+        if (args.size() > 0)
+            throw Error(Value("gc", gc), env, TOO_MANY_ARGS);
+        if (workers_running) return Value(0);
+        return Value(int(collect_cycles()));
+    }
 
-// This namespace contains all the definitions of builtin functions
-namespace builtin {
-    // This function is NOT a builtin function, but it is used
-    // by almost all of them.
-    //
-    // Special forms are just builtin functions that don't evaluate
-    // their arguments. To make a regular builtin that evaluates its
-    // arguments, we just call this function in our builtin definition.
-    void eval_args(std::vector<Value> &args, Environment &env) {
-        for (size_t i=0; i<args.size(); i++)
-            args[i] = args[i].eval(env);
+    // Get or set the number of possible roots of cycles that triggers a collection
+    Value gc_threshold(Args args, Environment &env) {
+        if (args.size() > 1)
+            throw Error(Value("gc-threshold", gc_threshold), env, TOO_MANY_ARGS);
+        if (args.size() == 1) {
+            if (args[0].as_int() < 1)
+                throw Error(args[0], env, INVALID_ARGUMENT);
+            if (!workers_running)
+                ::gc_threshold = args[0].as_int();
+        }
+        return Value(int(::gc_threshold));
     }
 
-    // Create a lambda function (SPECIAL FORM)
-    Value lambda(std::vector<Value> args, Environment &env) {
-        if (args.size() < 2)
-            throw Error(Value("lambda", lambda), env, TOO_FEW_ARGS);
+    // Get a list of the heap's statistics, as pairs of names and counts
+    Value heap_stats(Args args, Environment &env) {
+        if (args.size() > 0)
+            throw Error(Value("heap-stats", heap_stats), env, TOO_MANY_ARGS);
+        std::vector<Value> stats, pair(2);
+        pair[0] = Value::string("objects");
+        pair[1] = Value(load_refs(live_objects));
+        stats.push_back(Value(pair));
+        pair[0] = Value::string("roots");
+        pair[1] = Value(int(roots.size()));
+        stats.push_back(Value(pair));
+        pair[0] = Value::string("collections");
+        pair[1] = Value(int(gc_collections));
+        stats.push_back(Value(pair));
+        pair[0] = Value::string("collected");
+        pair[1] = Value(int(gc_collected));
+        stats.push_back(Value(pair));
+        pair[0] = Value::string("threshold");
+        pair[1] = Value(int(::gc_threshold));
+        stats.push_back(Value(pair));
+        return Value(stats);
+    }
 
-        if (args[0].get_type_name() != LIST_TYPE)
-            throw Error(Value("lambda", lambda), env, INVALID_LAMBDA);
+    // Get a copy of a lambda that remembers the results of calls to it,
+    // keyed by their arguments. It remembers MEMO_SIZE results, or a given number.
+    Value memoize(Args args, Environment &env) {
+        if (args.size() < 1 || args.size() > 2)
+            throw Error(Value("memoize", memoize), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (!args[0].is_lambda())
+            throw Error(args[0], env, MISMATCHED_TYPES);
+        int limit = args.size() == 2? args[1].as_int() : MEMO_SIZE;
+        if (limit < 0)
+            throw Error(args[1], env, INVALID_ARGUMENT);
+
+        return args[0].memoized(size_t(limit));
+    }
 
-        return Value(args[0].as_list(), args[1], env);
+    // Get a list of a memoized lambda's statistics, as pairs of names and counts
+    Value memo_stats(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("memo-stats", memo_stats), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        MemoTable *memo = args[0].memo_table();
+        if (memo == NULL)
+            throw Error(args[0], env, MISMATCHED_TYPES);
+
+        std::vector<Value> stats, pair(2);
+        pair[0] = Value::string("hits");
+        pair[1] = Value(int(memo->hits));
+        stats.push_back(Value(pair));
+        pair[0] = Value::string("misses");
+        pair[1] = Value(int(memo->misses));
+        stats.push_back(Value(pair));
+        pair[0] = Value::string("size");
+        pair[1] = Value(int(memo->size()));
+        stats.push_back(Value(pair));
+        pair[0] = Value::string("limit");
+        pair[1] = Value(int(memo->limit));
+        stats.push_back(Value(pair));
+        return Value(stats);
     }
 
-    // if-else (SPECIAL FORM)
-    Value if_then_else(std::vector<Value> args, Environment &env) {
+    // Get `count` items of a list, or bytes of a view or a string, starting at `start`.
+    // Slices of lists and views share their items instead of copying them.
+    Value slice(Args args, Environment &env) {
         if (args.size() != 3)
-            throw Error(Value("if", if_then_else), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        if (args[0].eval(env).as_bool())
-            return args[1].eval(env);
-        else return args[2].eval(env);
+            throw Error(Value("slice", slice), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        int start = args[1].as_int(), count = args[2].as_int();
+        std::string type = args[0].get_type_name();
+        size_t length;
+        if (type == STRING_TYPE) length = args[0].as_string().size();
+        else if (type == LIST_TYPE || type == VIEW_TYPE) length = args[0].list_length();
+        else throw Error(args[0], env, MISMATCHED_TYPES);
+        if (start < 0 || count < 0 || size_t(start) + size_t(count) > length)
+            throw Error(Value("slice", slice), env, INDEX_OUT_OF_RANGE);
+
+        if (type == STRING_TYPE)
+            return Value::string(args[0].as_string().substr(start, count));
+        if (type == LIST_TYPE)
+            return count == 0? Value(std::vector<Value>()) : args[0].slice(start, count);
+        ViewObject *view = args[0].as_view();
+        return Value::view(new ViewObject(view->owner, view->data + start, count));
     }
 
-    // Define a variable with a value (SPECIAL FORM)
-    Value define(std::vector<Value> args, Environment &env) {
-        if (args.size() != 2)
-            throw Error(Value("define", define), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-            
-        Value result = args[1].eval(env);
-        env.set(args[0].display(), result);
+    // Get the bytes of a string or a view from `start`, to the end or up to `count` bytes.
+    // Substrings of views share their bytes.
+    Value substr(Args args, Environment &env) {
+        if (args.size() < 2 || args.size() > 3)
+            throw Error(Value("substr", substr), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (!args[0].is_text())
+            throw Error(args[0], env, MISMATCHED_TYPES);
+
+        size_t length;
+        const char *data = args[0].text_data(length);
+        int start = args[1].as_int();
+        if (start < 0 || size_t(start) > length)
+            throw Error(Value("substr", substr), env, INDEX_OUT_OF_RANGE);
+        int count = args.size() == 3? args[2].as_int() : int(length - start);
+        if (count < 0 || size_t(start) + size_t(count) > length)
+            throw Error(Value("substr", substr), env, INDEX_OUT_OF_RANGE);
+
+        if (args[0].get_type_name() == VIEW_TYPE)
+            return Value::view(new ViewObject(args[0].as_view()->owner, data + start, count));
+        return Value::string(std::string(data + start, count));
+    }
+
+    // Find the first position of some text in a string or a view,
+    // at or after an optional starting position. Get -1 if it isn't there.
+    Value find(Args args, Environment &env) {
+        if (args.size() < 2 || args.size() > 3)
+            throw Error(Value("find", find), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (!args[0].is_text())
+            throw Error(args[0], env, MISMATCHED_TYPES);
+        std::string needle = args[1].as_string();
+        int start = args.size() == 3? args[2].as_int() : 0;
+        if (start < 0)
+            throw Error(args[2], env, INDEX_OUT_OF_RANGE);
+
+        // The text is searched in place, without copying it
+        size_t length;
+        const char *data = args[0].text_data(length);
+        if (size_t(start) > length) return Value(-1);
+
+        const char *found = std::search(data + start, data + length, needle.begin(), needle.end());
+        if (found == data + length && !needle.empty()) return Value(-1);
+        return Value(int(found - data));
+    }
+
+    // Make a dict from pairs of keys and values
+    Value dict(Args args, Environment &env) {
+        if (args.size() % 2 != 0)
+            throw Error(Value("dict", dict), env, TOO_FEW_ARGS);
+        Value result = Value::map(new MapObject(false));
+        for (size_t i=0; i<args.size(); i+=2)
+            result.as_map()->set(args[i], args[i + 1]);
         return result;
     }
 
-    // Define a function with parameters and a result expression (SPECIAL FORM)
-    Value defun(std::vector<Value> args, Environment &env) {
+    // Make a set of the arguments
+    Value make_set(Args args, Environment &) {
+        Value result = Value::map(new MapObject(true));
+        for (size_t i=0; i<args.size(); i++)
+            result.as_map()->set(args[i], Value());
+        return result;
+    }
+
+    // Get the value of a key in a dict, or a default value if the key isn't in it
+    Value dict_get(Args args, Environment &env) {
+        if (args.size() < 2 || args.size() > 3)
+            throw Error(Value("dict-get", dict_get), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (args[0].get_type_name() != DICT_TYPE)
+            throw Error(args[0], env, MISMATCHED_TYPES);
+
+        Value const *value = args[0].as_map()->find(args[1]);
+        if (value != NULL) return *value;
+        if (args.size() == 3) return args[2];
+        throw Error(args[1], env, KEY_NOT_FOUND);
+    }
+
+    // Get a dict with a key set to a value
+    Value dict_set(Args args, Environment &env) {
         if (args.size() != 3)
-            throw Error(Value("defun", defun), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+            throw Error(Value("dict-set", dict_set), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (args[0].get_type_name() != DICT_TYPE)
+            throw Error(args[0], env, MISMATCHED_TYPES);
 
-        if (args[1].get_type_name() != LIST_TYPE)
-            throw Error(Value("defun", defun), env, INVALID_LAMBDA);
+        Value result = args[0];
+        result.set_key(args[1], args[2]);
+        return result;
+    }
 
-        Value f = Value(args[1].as_list(), args[2], env);
-        env.set(args[0].display(), f);
-        return f;
+    // Is a key in a dict?
+    Value dict_has(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("dict-has", dict_has), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (args[0].get_type_name() != DICT_TYPE)
+            throw Error(args[0], env, MISMATCHED_TYPES);
+
+        return Value(args[0].as_map()->find(args[1]) != NULL? 1 : 0);
+    }
+
+    // Get the keys of a dict or a set, in the order they were added
+    Value dict_keys(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("dict-keys", dict_keys), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (args[0].get_type_name() != DICT_TYPE && args[0].get_type_name() != SET_TYPE)
+            throw Error(args[0], env, MISMATCHED_TYPES);
+
+        MapObject *map = args[0].as_map();
+        std::vector<Value> result;
+        result.reserve(map->size);
+        for (size_t i=0; i<map->count; i++)
+            if (map->buffer->previous[i] == MapBuffer::NONE)
+                result.push_back(map->buffer->keys[i]);
+        return Value(result);
+    }
+
+    // Get a set with the arguments added to it
+    Value set_add(Args args, Environment &env) {
+        if (args.size() < 2)
+            throw Error(Value("set-add", set_add), env, TOO_FEW_ARGS);
+        if (args[0].get_type_name() != SET_TYPE)
+            throw Error(args[0], env, MISMATCHED_TYPES);
+
+        Value result = args[0];
+        for (size_t i=1; i<args.size(); i++)
+            result.set_key(args[i], Value());
+        return result;
     }
 
-    // Loop over a list of expressions with a condition (SPECIAL FORM)
-    Value while_loop(std::vector<Value> args, Environment &env) {
-        Value acc;
-        while (args[0].eval(env).as_bool()) {
-            for (size_t i=1; i<args.size()-1; i++)
-                args[i].eval(env);
-            acc = args[args.size()-1].eval(env);
-        }
-        return acc;
+    // Is a key in a set?
+    Value set_has(Args args, Environment &env) {
+        if (args.size() != 2)
+            throw Error(Value("set-has", set_has), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        if (args[0].get_type_name() != SET_TYPE)
+            throw Error(args[0], env, MISMATCHED_TYPES);
+
+        return Value(args[0].as_map()->find(args[1]) != NULL? 1 : 0);
     }
 
-    // Iterate through a list of values in a list (SPECIAL FORM)
-    Value for_loop(std::vector<Value> args, Environment &env) {
-        Value acc;
-        std::vector<Value> list = args[1].eval(env).as_list();
+    Value range(Args args, Environment &env) {
+        std::vector<Value> result;
+        Value low = args[0], high = args[1];
+        if (low.get_type_name() != INT_TYPE && low.get_type_name() != FLOAT_TYPE)
+            throw Error(low, env, MISMATCHED_TYPES);
+        if (high.get_type_name() != INT_TYPE && high.get_type_name() != FLOAT_TYPE)
+            throw Error(high, env, MISMATCHED_TYPES);
 
-        for (size_t i=0; i<list.size(); i++) {
-            env.set(args[0].as_atom(), list[i]);
+        if (low >= high) return Value(result);
 
-            for (size_t j=1; j<args.size()-1; j++)
-                args[j].eval(env);
-            acc = args[args.size()-1].eval(env);
+        // Integer ranges are lazy, so iterating over them takes constant memory
+        if (low.get_type_name() == INT_TYPE) {
+            int count = (high - low).cast_to_int().as_int();
+            if (low + Value(count) < high) count++;
+            return Value::lazy_range(low.as_int(), count);
         }
 
-        return acc;
+        while (low < high) {
+            result.push_back(low);
+            low = low + Value(1);
+        }
+        return Value(result);
     }
 
-    // Evaluate a block of expressions in the current environment (SPECIAL FORM)
-    Value do_block(std::vector<Value> args, Environment &env) {
-        Value acc;
-        for (size_t i=0; i<args.size(); i++)
-            acc = args[i].eval(env);
-        return acc;
-    }
+    ////////////////////////////////////////////////////////////////////////////////
+    /// VECTOR OPERATIONS //////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////
 
-    // Evaluate a block of expressions in a new environment (SPECIAL FORM)
-    Value scope(std::vector<Value> args, Environment &env) {
-        Environment e = env;
-        Value acc;
-        for (size_t i=0; i<args.size(); i++)
-            acc = args[i].eval(e);
-        return acc;
+    // The kernels below are plain loops over raw arrays, with no values or
+    // type checks inside of them, so the compiler can vectorize them.
+
+    struct AddKernel      { double operator()(double a, double b) const { return a + b; } };
+    struct SubtractKernel { double operator()(double a, double b) const { return a - b; } };
+    struct MultiplyKernel { double operator()(double a, double b) const { return a * b; } };
+    struct DivideKernel   { double operator()(double a, double b) const { return a / b; } };
+    struct LessKernel      { double operator()(double a, double b) const { return a < b; } };
+    struct GreaterKernel   { double operator()(double a, double b) const { return a > b; } };
+    struct LessEqKernel    { double operator()(double a, double b) const { return a <= b; } };
+    struct GreaterEqKernel { double operator()(double a, double b) const { return a >= b; } };
+    struct EqKernel        { double operator()(double a, double b) const { return a == b; } };
+    struct NotEqKernel     { double operator()(double a, double b) const { return a != b; } };
+
+    // Apply an operation to each pair of items of two arrays,
+    // or to each item of an array and a scalar if `b` is NULL.
+    template <typename Kernel>
+    void vector_kernel(Kernel kernel, double const *a, double const *b, double scalar, double *out, size_t n) {
+        if (b == NULL)
+            for (size_t i=0; i<n; i++) out[i] = kernel(a[i], scalar);
+        else
+            for (size_t i=0; i<n; i++) out[i] = kernel(a[i], b[i]);
     }
 
-    // Quote an expression (SPECIAL FORM)
-    Value quote(std::vector<Value> args, Environment &) {
-        std::vector<Value> v;
-        for (size_t i=0; i<args.size(); i++)
-            v.push_back(args[i]);
-        return Value(v);
+    // Get the items of a vector as floats. Int vectors are converted into `scratch`.
+    double const *vector_floats(VectorObject *vector, std::vector<double> &scratch) {
+        if (vector->floats) return vector->f.empty()? NULL : &vector->f[0];
+        scratch.assign(vector->i.begin(), vector->i.end());
+        return scratch.empty()? NULL : &scratch[0];
     }
 
-    #ifdef USE_STD
-    // Exit the program with an integer code
-    Value exit(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
-
-        std::exit(args.size() < 1? 0 : args[0].cast_to_int().as_int());
-        return Value();
+    // Sum an array with four accumulators, so the additions don't wait on each other
+    template <typename T>
+    double sum_kernel(T const *a, size_t n) {
+        double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += a[i]; s1 += a[i+1]; s2 += a[i+2]; s3 += a[i+3];
+        }
+        for (; i < n; i++) s0 += a[i];
+        return (s0 + s1) + (s2 + s3);
     }
 
-    // Print several values and return the last one
-    Value print(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
-
-        if (args.size() < 1)
-            throw Error(Value("print", print), env, TOO_FEW_ARGS);
-
-        Value acc;
-        for (size_t i=0; i<args.size(); i++) {
-            acc = args[i];
-            std::cout << acc.display();
-            if (i < args.size() - 1)
-                std::cout << " ";
+    // Get the dot product of two arrays with four accumulators
+    double dot_kernel(double const *a, double const *b, size_t n) {
+        double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += a[i] * b[i]; s1 += a[i+1] * b[i+1];
+            s2 += a[i+2] * b[i+2]; s3 += a[i+3] * b[i+3];
         }
-        std::cout << std::endl;
-        return acc;
+        for (; i < n; i++) s0 += a[i] * b[i];
+        return (s0 + s1) + (s2 + s3);
     }
 
-    // Get user input with an optional prompt
-    Value input(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    // The result of an int vector operation computed with floats.
+    // Sums of ints are exact in a double, so they're only a float if they don't fit an int.
+    Value int_or_float(double f) {
+        if (f >= double(INT_MIN) && f <= double(INT_MAX)) return Value(int(f));
+        return Value(f);
+    }
 
-        if (args.size() > 1)
-            throw Error(Value("input", input), env, TOO_MANY_ARGS);
+    // Build a vector from numbers, or from the items of a single list or vector
+    Value make_vector(Args args, bool floats, Value const &function, Environment &env) {
+        // A single list or vector argument gives the items
+        bool from_list = args.size() == 1 && !args[0].is_number();
+        if (from_list && args[0].get_type_name() != LIST_TYPE
+            && args[0].get_type_name() != F64VEC_TYPE && args[0].get_type_name() != I32VEC_TYPE)
+            throw Error(args[0], env, MISMATCHED_TYPES);
+        size_t n = from_list? args[0].list_length() : args.size();
+
+        VectorObject *vector = new VectorObject(floats);
+        Value result = Value::vector(vector);
+        if (floats) vector->f.resize(n);
+        else vector->i.resize(n);
+        for (size_t i=0; i<n; i++) {
+            Value item = from_list? args[0].list_item(i) : args[i];
+            if (!item.is_number())
+                throw Error(function, env, MISMATCHED_TYPES);
+            if (floats) vector->f[i] = item.as_float();
+            else vector->i[i] = item.cast_to_int().as_int();
+        }
+        return result;
+    }
 
-        if (!args.empty())
-            std::cout << args[0];
+    // Construct a vector of floats
+    Value f64vec(Args args, Environment &env) {
+        return make_vector(args, true, Value("f64vec", f64vec), env);
+    }
 
-        std::string s;
-        std::getline(std::cin, s);
-        return Value::string(s);
+    // Construct a vector of ints
+    Value i32vec(Args args, Environment &env) {
+        return make_vector(args, false, Value("i32vec", i32vec), env);
     }
 
-    // Get a random number between two numbers inclusively
-    Value random(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    // Get the sum of the items of a vector
+    Value vsum(Args args, Environment &env) {
+        if (args.size() != 1)
+            throw Error(Value("vsum", vsum), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        VectorObject *vector = args[0].as_vector();
+        if (vector->floats)
+            return Value(vector->f.empty()? 0.0 : sum_kernel(&vector->f[0], vector->f.size()));
+        return int_or_float(vector->i.empty()? 0.0 : sum_kernel(&vector->i[0], vector->i.size()));
+    }
 
+    // Get the dot product of two vectors of the same length
+    Value vdot(Args args, Environment &env) {
         if (args.size() != 2)
-            throw Error(Value("random", random), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-
-        int low = args[0].as_int(), high = args[1].as_int();
-        return Value(rand()%(high-low+1) + low);
+            throw Error(Value("vdot", vdot), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        VectorObject *a = args[0].as_vector(), *b = args[1].as_vector();
+        if (a->size() != b->size())
+            throw Error(Value("vdot", vdot), env, MISMATCHED_TYPES);
+
+        std::vector<double> a_scratch, b_scratch;
+        double dot = a->size() == 0? 0.0 : dot_kernel(vector_floats(a, a_scratch), vector_floats(b, b_scratch), a->size());
+        // The dot product of int vectors is an int, unless it overflows
+        if (a->floats || b->floats) return Value(dot);
+        return int_or_float(dot);
     }
 
-    // Get the contents of a file
-    Value read_file(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
-
+    // Get the smallest or largest item of a vector
+    Value vector_extreme(Args args, bool largest, Value const &function, Environment &env) {
         if (args.size() != 1)
-            throw Error(Value("read-file", read_file), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+            throw Error(function, env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        VectorObject *vector = args[0].as_vector();
+        size_t n = vector->size();
+        if (n == 0)
+            throw Error(function, env, INDEX_OUT_OF_RANGE);
+
+        if (vector->floats) {
+            double const *f = &vector->f[0];
+            double result = f[0];
+            if (largest) for (size_t i=1; i<n; i++) result = f[i] > result? f[i] : result;
+            else for (size_t i=1; i<n; i++) result = f[i] < result? f[i] : result;
+            return Value(result);
+        }
+        int const *v = &vector->i[0];
+        int result = v[0];
+        if (largest) for (size_t i=1; i<n; i++) result = v[i] > result? v[i] : result;
+        else for (size_t i=1; i<n; i++) result = v[i] < result? v[i] : result;
+        return Value(result);
+    }
 
-        // return Value::string(content);
-        return Value::string(read_file_contents(args[0].as_string()));
+    Value vmin(Args args, Environment &env) {
+        return vector_extreme(args, false, Value("vmin", vmin), env);
     }
 
-    // Write a string to a file
-    Value write_file(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    Value vmax(Args args, Environment &env) {
+        return vector_extreme(args, true, Value("vmax", vmax), env);
+    }
 
-        if (args.size() != 2)
-            throw Error(Value("write-file", write_file), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+    // Apply an arithmetic builtin or a comparison to each item of a vector,
+    // with each item of another vector of the same length, or with a number.
+    // Comparisons give an int vector of ones and zeros.
+    Value vmap(Args args, Environment &env) {
+        if (args.size() != 3)
+            throw Error(Value("vmap", vmap), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+        VectorObject *a = args[1].as_vector();
+        size_t n = a->size();
+
+        // The other operand is either a vector or a scalar
+        VectorObject *b = NULL;
+        double scalar = 0;
+        bool b_floats;
+        if (args[2].is_number()) {
+            scalar = args[2].as_float();
+            b_floats = args[2].get_type_name() == FLOAT_TYPE;
+        } else {
+            b = args[2].as_vector();
+            b_floats = b->floats;
+            if (b->size() != n)
+                throw Error(Value("vmap", vmap), env, MISMATCHED_TYPES);
+        }
 
-        std::ofstream f;
-        // The first argument is the file name
-        f.open(args[0].as_string().c_str());
-        // The second argument is the contents of the file to write
-        Value result = Value((f << args[1].as_string())? 1 : 0);
-        f.close();
+        std::vector<double> a_scratch, b_scratch, out(n);
+        double const *a_items = vector_floats(a, a_scratch);
+        double const *b_items = b == NULL? NULL : vector_floats(b, b_scratch);
+        bool ints = !a->floats && !b_floats;
+        bool mask = false;
+        if (n == 0) a_items = b_items = NULL;
+
+        Value op = args[0];
+        Builtin fn = op.is_special_form()? NULL : op.builtin_function();
+        if (fn == NULL) throw Error(op, env, MISMATCHED_TYPES);
+        else if (n == 0) mask = fn == eq || fn == neq || fn == greater || fn == less || fn == greater_eq || fn == less_eq;
+        else if (fn == sum)        vector_kernel(AddKernel(), a_items, b_items, scalar, &out[0], n);
+        else if (fn == subtract)   vector_kernel(SubtractKernel(), a_items, b_items, scalar, &out[0], n);
+        else if (fn == product)    vector_kernel(MultiplyKernel(), a_items, b_items, scalar, &out[0], n);
+        else if (fn == divide) {
+            // Dividing ints by zero is an error, like it is for numbers
+            if (ints) {
+                if (b == NULL? scalar == 0 : std::find(b->i.begin(), b->i.end(), 0) != b->i.end())
+                    throw Error(Value("vmap", vmap), env, DIVIDE_BY_ZERO);
+            }
+            vector_kernel(DivideKernel(), a_items, b_items, scalar, &out[0], n);
+            // Int quotients are truncated. The truncated quotient of two ints
+            // computed with floats is always exact. The one quotient that doesn't
+            // fit an int, INT_MIN / -1, is already whole.
+            if (ints)
+                for (size_t i=0; i<n; i++)
+                    if (out[i] > double(INT_MIN) && out[i] < double(INT_MAX))
+                        out[i] = double(int(out[i]));
+        }
+        else if (fn == less)       { mask = true; vector_kernel(LessKernel(), a_items, b_items, scalar, &out[0], n); }
+        else if (fn == greater)    { mask = true; vector_kernel(GreaterKernel(), a_items, b_items, scalar, &out[0], n); }
+        else if (fn == less_eq)    { mask = true; vector_kernel(LessEqKernel(), a_items, b_items, scalar, &out[0], n); }
+        else if (fn == greater_eq) { mask = true; vector_kernel(GreaterEqKernel(), a_items, b_items, scalar, &out[0], n); }
+        else if (fn == eq)         { mask = true; vector_kernel(EqKernel(), a_items, b_items, scalar, &out[0], n); }
+        else if (fn == neq)        { mask = true; vector_kernel(NotEqKernel(), a_items, b_items, scalar, &out[0], n); }
+        else throw Error(op, env, MISMATCHED_TYPES);
+
+        // The results of int operations stay ints, unless one of them overflows
+        if (ints && !mask)
+            for (size_t i=0; i<n; i++)
+                if (out[i] < double(INT_MIN) || out[i] > double(INT_MAX)) {
+                    ints = false;
+                    break;
+                }
+
+        VectorObject *vector = new VectorObject(!ints && !mask);
+        Value result = Value::vector(vector);
+        if (vector->floats) vector->f.swap(out);
+        else vector->i.assign(out.begin(), out.end());
         return result;
     }
+}
 
-    // Read a file and execute its code
-    Value include(std::vector<Value> args, Environment &env) {
-        // Import is technically not a special form, it's more of a macro.
-        // We can evaluate our arguments.
-        eval_args(args, env);
+#ifdef USE_STD
+// The number of variables `!env` shows on each page
+#define REPL_PAGE_SIZE 40
+// The number of bytes of a result, or of a variable's value, the REPL shows
+#define REPL_PREVIEW_LENGTH 1000
+
+// Show a page of the variables in a scope, one to a line.
+// Only the values on the page are printed, and long ones are cut off.
+void show_variables(Environment const &env, int page) {
+    std::map<std::string, Value const *> variables = env.variables();
+    int first = (page - 1) * REPL_PAGE_SIZE, count = int(variables.size());
+    std::map<std::string, Value const *>::const_iterator i = variables.begin();
+    for (int n=0; i != variables.end() && n < first + REPL_PAGE_SIZE; i++, n++)
+        if (n >= first)
+            std::cout << '\'' << i->first << "' : " << i->second->preview(REPL_PREVIEW_LENGTH) << std::endl;
+    if (count > REPL_PAGE_SIZE)
+        std::cout << "(page " << page << " of " << (count + REPL_PAGE_SIZE - 1) / REPL_PAGE_SIZE
+            << ", `!env n` shows page n)" << std::endl;
+}
+#endif
 
-        if (args.size() != 1)
-            throw Error(Value("include", include), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+void repl(Environment &env) {
+#ifdef USE_STD
+    // The forms of the lines that ran, which `!export` writes back out
+    std::vector<Value> forms;
+    std::string input;
+    Value tmp;
+    // Whether `!time` turned on timing each line
+    bool timed = false;
+    while (std::cin) {
+        std::cout << ">>> ";
+        std::getline(std::cin, input);
+        if (input == "!quit" || input == "!q")
+            break;
+        else if (input == "!env" || input == "!e")
+            show_variables(env, 1);
+        else if (input.compare(0, 5, "!env ") == 0 || input.compare(0, 3, "!e ") == 0)
+            show_variables(env, std::max(atoi(input.c_str() + input.find(' ')), 1));
+        else if (input == "!export" || input == "!x") {
+            std::cout << "File to export to: ";
+            std::getline(std::cin, input);
 
-        Environment e;
-        Value result = run(read_file_contents(args[0].as_string()), e);
-        env.combine(e);
-        return result;
+            std::ofstream f;
+            f.open(input.c_str(), std::ofstream::out);
+            std::string text;
+            for (size_t i=0; i<forms.size(); i++) {
+                text.clear();
+                forms[i].debug_to(text);
+                f << text << std::endl;
+            }
+            f.close();
+        }
+        else if (input == "!time" || input == "!t") {
+            timed = !timed;
+            std::cout << "timing is " << (timed? "on" : "off") << std::endl;
+        }
+        else if (input != "") {
+            double start = wall_time();
+            #ifdef HAS_PROFILER
+            size_t allocations = allocated_objects;
+            #endif
+            // What the code printed is shown before its result or its error
+            try {
+                // The line is kept as it was parsed. Its lists are shared with
+                // the program that runs, so they're copied when that's prepared.
+                std::vector<Value> parsed = parse(input), program = parsed;
+                resolve(program);
+                #ifdef OPTIMIZE
+                optimize(program);
+                #endif
+                tmp = run_program(program, env);
+                flush_output();
+                std::cout << " => " << tmp.preview(REPL_PREVIEW_LENGTH) << std::endl;
+                forms.insert(forms.end(), parsed.begin(), parsed.end());
+            } catch (Error &e) {
+                flush_output();
+                std::cerr << e.description() << std::endl;
+            } catch (std::runtime_error &e) {
+                flush_output();
+                std::cerr << e.what() << std::endl;
+            }
+            if (timed) {
+                std::cout << std::fixed << std::setprecision(3) << "(" << (wall_time() - start) * 1000 << " ms";
+                // Allocations are only counted for the profiler
+                #ifdef HAS_PROFILER
+                std::cout << ", " << allocated_objects - allocations << " allocations";
+                #endif
+                std::cout << ")" << std::endl;
+            }
+        }
     }
-    #endif
+#else
+    // There's no REPL without the standard library
+    (void)env;
+#endif
+}
 
-    // Evaluate a value as code
-    Value eval(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+// The table of builtin functions and constants, indexed by symbol id.
+// Builtins are registered once, the first time the table is used, so
+// looking one up is a single index into this table.
+class BuiltinTable {
+public:
+    BuiltinTable() {
+        // Meta operations
+        define_caller("eval", builtin::eval);
+        define_pure("type",  builtin::get_type_name);
+        define("parse",      builtin::parse);
+
+        // Special forms
+        define_special("do",     builtin::do_block);
+        define_special("if",     builtin::if_then_else);
+        define_special("for",    builtin::for_loop);
+        define_special("while",  builtin::while_loop);
+        define_special("scope",  builtin::scope);
+        define_special("quote",  builtin::quote);
+        define_special("defun",  builtin::defun);
+        define_special("define", builtin::define);
+        define_special("lambda", builtin::lambda);
+
+        // Comparison operations
+        define_pure("=",  builtin::eq);
+        define_pure("!=", builtin::neq);
+        define_pure(">",  builtin::greater);
+        define_pure("<",  builtin::less);
+        define_pure(">=", builtin::greater_eq);
+        define_pure("<=", builtin::less_eq);
+
+        // Arithmetic operations
+        define_pure("+", builtin::sum);
+        define_pure("-", builtin::subtract);
+        define_pure("*", builtin::product);
+        define_pure("/", builtin::divide);
+        define_pure("%", builtin::remainder);
+
+        // List operations
+        define_pure("list",  builtin::list);
+        define("insert",     builtin::insert);
+        define_pure("index", builtin::index);
+        define("remove",     builtin::remove);
+
+        define_pure("len",   builtin::len);
+
+        define("push",       builtin::push);
+        define("pop",        builtin::pop);
+        define_pure("head",  builtin::head);
+        define_pure("tail",  builtin::tail);
+        define_pure("first", builtin::head);
+        define("last",       builtin::pop);
+        define_pure("range", builtin::range);
+        define_pure("slice", builtin::slice);
+
+        // Functional operations
+        define_caller("map",    builtin::map_list);
+        define_caller("filter", builtin::filter_list);
+        define_caller("reduce", builtin::reduce_list);
+
+        // Vector operations
+        define_pure("f64vec", builtin::f64vec);
+        define_pure("i32vec", builtin::i32vec);
+        define_pure("vsum",   builtin::vsum);
+        define_pure("vdot",   builtin::vdot);
+        define_pure("vmin",   builtin::vmin);
+        define_pure("vmax",   builtin::vmax);
+        define_pure("vmap",   builtin::vmap);
+
+        // Parallel operations
+        define_caller("pmap",    builtin::pmap_list);
+        define_caller("pfilter", builtin::pfilter_list);
+        define_caller("preduce", builtin::preduce_list);
+        define("threads", builtin::threads);
+
+        // Tasks and channels
+        define_caller("spawn", builtin::spawn);
+        define("await", builtin::await);
+        define("chan",  builtin::chan);
+        define("send",  builtin::send);
+        define("recv",  builtin::recv);
+
+        // Memory management
+        define("gc",           builtin::gc);
+        define("gc-threshold", builtin::gc_threshold);
+        define("heap-stats",   builtin::heap_stats);
+
+        // Memoization
+        define("memoize",    builtin::memoize);
+        define("memo-stats", builtin::memo_stats);
+
+        // IO operations
+        #ifdef USE_STD
+        define("exit",       builtin::exit);
+        define("quit",       builtin::exit);
+        define("print",      builtin::print);
+        define("input",      builtin::input);
+        define("random",     builtin::random);
+        define_caller("include", builtin::include);
+        define("read-file",  builtin::read_file);
+        define("write-file", builtin::write_file);
+        define("open",       builtin::open_file);
+        define("close",      builtin::close_file);
+        define("read-line",  builtin::read_line);
+        define("read-chunk", builtin::read_chunk);
+        define("write",      builtin::write_to);
+        define("mmap",       builtin::mmap_file);
+
+        // Output buffering
+        define("flush",         builtin::flush);
+        define("output-buffer", builtin::output_buffer);
+        #endif
 
-        if (args.size() != 1)
-            throw Error(Value("eval", eval), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        else return args[0].eval(env);
+        // String operations
+        define("debug",        builtin::debug);
+        define("replace",      builtin::replace);
+        define_pure("find",    builtin::find);
+        define_pure("substr",  builtin::substr);
+        define_pure("split",   builtin::split);
+        define_pure("join",    builtin::join);
+        define_pure("display", builtin::display);
+
+        // String builders
+        define("builder", builtin::builder);
+        define("append",  builtin::append);
+
+        // Dicts and sets
+        define_pure("dict",      builtin::dict);
+        define_pure("dict-get",  builtin::dict_get);
+        define_pure("dict-set",  builtin::dict_set);
+        define_pure("dict-has",  builtin::dict_has);
+        define_pure("dict-keys", builtin::dict_keys);
+        define_pure("set",       builtin::make_set);
+        define_pure("set-add",   builtin::set_add);
+        define_pure("set-has",   builtin::set_has);
+
+        // Casting operations
+        define_pure("int",   builtin::cast_to_int);
+        define_pure("float", builtin::cast_to_float);
+
+        // Constants
+        define("endl", Value::string("\n"));
     }
 
-    // Create a list of values
-    Value list(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
-        
-        return Value(args);
+    // Get the builtin bound to a symbol, or NULL if there isn't one
+    Value const *find(int symbol) const {
+        if (symbol < 0 || symbol >= int(defined.size()) || !defined[symbol])
+            return NULL;
+        return &values[symbol];
     }
 
-    // Sum multiple values
-    Value sum(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
-        
-        if (args.size() < 2)
-            throw Error(Value("+", sum), env, TOO_FEW_ARGS);
-        
-        Value acc = args[0];
-        for (size_t i=1; i<args.size(); i++)
-            acc = acc + args[i];
-        return acc;
+    // Is the builtin bound to a symbol a function with no side effects,
+    // whose result depends only on its arguments?
+    bool is_pure(int symbol) const {
+        return symbol >= 0 && symbol < int(pure.size()) && pure[symbol];
     }
 
-    // Subtract two values
-    Value subtract(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
-
-        if (args.size() != 2)
-            throw Error(Value("-", subtract), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return args[0] - args[1];
+    // Can the builtin bound to a symbol run code that isn't written
+    // where it's called, like a function it's passed or source it reads?
+    bool runs_code(int symbol) const {
+        return symbol >= 0 && symbol < int(caller.size()) && caller[symbol];
     }
 
-    // Multiply several values
-    Value product(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+private:
+    // Register a builtin function under a name
+    void define(std::string const &name, Builtin b) {
+        define(name, Value(name, b));
+    }
 
-        if (args.size() < 2)
-            throw Error(Value("*", product), env, TOO_FEW_ARGS);
+    // Register a special form under a name
+    void define_special(std::string const &name, Builtin b) {
+        define(name, Value(name, b, true));
+    }
 
-        Value acc = args[0];
-        for (size_t i=1; i<args.size(); i++)
-            acc = acc * args[i];
-        return acc;
+    // Register a pure builtin function under a name.
+    // Calls to it can be folded or hoisted out of loops by the optimizer.
+    void define_pure(std::string const &name, Builtin b) {
+        define(name, Value(name, b));
+        pure[intern(name)] = true;
     }
 
-    // Divide two values
-    Value divide(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    // Register a builtin function that calls back into code under a name.
+    // A loop that calls it could redefine anything.
+    void define_caller(std::string const &name, Builtin b) {
+        define(name, Value(name, b));
+        caller[intern(name)] = true;
+    }
 
-        if (args.size() != 2)
-            throw Error(Value("/", divide), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return args[0] / args[1];
+    // Register a builtin constant under a name
+    void define(std::string const &name, Value value) {
+        int symbol = intern(name);
+        if (symbol >= int(values.size())) {
+            values.resize(symbol + 1);
+            defined.resize(symbol + 1, false);
+            pure.resize(symbol + 1, false);
+            caller.resize(symbol + 1, false);
+        }
+        values[symbol] = value;
+        defined[symbol] = true;
     }
 
-    // Get the remainder of values
-    Value remainder(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    std::vector<Value> values;
+    std::vector<bool> defined, pure, caller;
+};
 
-        if (args.size() != 2)
-            throw Error(Value("%", remainder), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return args[0] % args[1];
-    }
+// The builtin table shared by the whole interpreter.
+BuiltinTable const &builtins() {
+    static BuiltinTable table;
+    return table;
+}
 
-    // Are two values equal?
-    Value eq(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+////////////////////////////////////////////////////////////////////////////////
+/// OPTIMIZER //////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-        if (args.size() != 2)
-            throw Error(Value("=", eq), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return Value(int(args[0] == args[1]));
-    }
+void optimize(std::vector<Value> &program) {
+    for (size_t i=0; i<program.size(); i++)
+        program[i].optimize();
+}
 
-    // Are two values not equal?
-    Value neq(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+// Can this value be used as a constant in place of the call that returned it?
+static bool is_constant(Value const &value) {
+    std::string type = value.get_type_name();
+    return type == INT_TYPE || type == FLOAT_TYPE || type == STRING_TYPE
+        || type == QUOTE_TYPE || type == UNIT_TYPE;
+}
 
-        if (args.size() != 2)
-            throw Error(Value("!=", neq), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return Value(int(args[0] != args[1]));
+void Value::optimize() {
+    static const int quote_symbol = intern("quote");
+    static const int lambda_symbol = intern("lambda");
+    static const int defun_symbol = intern("defun");
+    static const int while_symbol = intern("while");
+    static const int for_symbol = intern("for");
+    static const int range_symbol = intern("range");
+
+    if (type != LIST || list().empty()) return;
+
+    // Parameter lists aren't calls, and quoted expressions are data
+    size_t first = 0;
+    int head = list()[0].type == ATOM? list()[0].stack_data.atom.symbol : -1;
+    if (head == quote_symbol) return;
+    if (head == lambda_symbol) first = 2;
+    if (head == defun_symbol) first = 3;
+    for (size_t i=first; i<list().size(); i++)
+        mutable_items()[i].optimize();
+
+    // The values of loop invariant calls are kept for the rest of the loop's run
+    if (head == while_symbol || head == for_symbol) {
+        std::vector<int> defined;
+        if (head == for_symbol && list().size() > 1 && list()[1].type == ATOM)
+            defined.push_back(list()[1].stack_data.atom.symbol);
+        // A loop that evaluates code could redefine anything
+        if (!get_defined_atoms(defined)) return;
+        // The list a `for` loop iterates over is only evaluated once anyway
+        for (size_t i=head == for_symbol? 3 : 1; i<list().size(); i++)
+            mutable_items()[i].mark_invariants(defined);
+        return;
     }
 
-    // Is one number greater than another?
-    Value greater(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    // A call to a pure builtin with constant arguments is replaced by its result.
+    // If the call fails, it's left alone to fail when it's evaluated.
+    // Ranges are lazy, so there's nothing to gain from folding them,
+    // and a folded range would be printed in full with its lambda
+    if (!builtins().is_pure(head) || head == range_symbol) return;
+    for (size_t i=1; i<list().size(); i++)
+        if (!is_constant(list()[i])) return;
+    try {
+        Environment empty;
+        Value result = eval(empty);
+        if (result.type == INT || result.type == FLOAT || result.type == STRING || result.type == UNIT)
+            *this = result;
+        else if (result.type == LIST || result.type == ATOM || result.type == QUOTE)
+            *this = Value::quote(result);
+    } catch (Error &) {}
+}
 
-        if (args.size() != 2)
-            throw Error(Value(">", greater), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return Value(int(args[0] > args[1]));
+void Value::mark_invariants(std::vector<int> const &defined) {
+    static const int quote_symbol = intern("quote");
+    static const int lambda_symbol = intern("lambda");
+    static const int defun_symbol = intern("defun");
+
+    if (type != LIST || list().empty()) return;
+    if (is_invariant(defined)) {
+        // Its arguments are marked too, so it can tell when one of them
+        // didn't keep its value
+        for (size_t i=1; i<list().size(); i++)
+            mutable_items()[i].mark_invariants(defined);
+        if (list_object()->cache == NULL)
+            list_object()->cache = new CallCache;
+        list_object()->cache->invariant = true;
+        return;
     }
 
-    // Is one number less than another?
-    Value less(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
-
-        if (args.size() != 2)
-            throw Error(Value("<", less), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return Value(int(args[0] < args[1]));
+    // The body of a lambda can be called outside of the loop
+    if (list()[0].type == ATOM) {
+        int head = list()[0].stack_data.atom.symbol;
+        if (head == quote_symbol || head == lambda_symbol || head == defun_symbol)
+            return;
     }
+    for (size_t i=0; i<list().size(); i++)
+        mutable_items()[i].mark_invariants(defined);
+}
 
-    // Is one number greater than or equal to another?
-    Value greater_eq(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+bool Value::is_invariant(std::vector<int> const &defined) const {
+    if (type != LIST || list().empty() || list()[0].type != ATOM)
+        return false;
+    if (!builtins().is_pure(list()[0].stack_data.atom.symbol))
+        return false;
+
+    for (size_t i=1; i<list().size(); i++) {
+        Value const &arg = list()[i];
+        if (arg.type == ATOM) {
+            if (std::find(defined.begin(), defined.end(), arg.stack_data.atom.symbol) != defined.end())
+                return false;
+        } else if (!is_constant(arg) && !arg.is_invariant(defined)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-        if (args.size() != 2)
-            throw Error(Value(">=", greater_eq), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return Value(int(args[0] >= args[1]));
+bool Value::get_defined_atoms(std::vector<int> &atoms) const {
+    static const int quote_symbol = intern("quote");
+    static const int define_symbol = intern("define");
+    static const int defun_symbol = intern("defun");
+    static const int for_symbol = intern("for");
+    static const int lambda_symbol = intern("lambda");
+
+    // Code that isn't known until it runs could define anything. That's the
+    // code run by a builtin like `eval` or `map`, whether it's called here
+    // or passed along as a value, and the body of any lambda that's called.
+    // Builtins can't be shadowed, so a call to one by name is always to it.
+    if (type == ATOM)
+        return !builtins().runs_code(stack_data.atom.symbol);
+    if (type != LIST || list().empty()) return true;
+    if (list()[0].type != ATOM) return false;
+
+    int head = list()[0].stack_data.atom.symbol;
+    if (head == quote_symbol) return true;
+    if (builtins().find(head) == NULL) return false;
+    if ((head == define_symbol || head == defun_symbol || head == for_symbol)
+        && list().size() > 1 && list()[1].type == ATOM)
+        atoms.push_back(list()[1].stack_data.atom.symbol);
+
+    // Parameter lists aren't calls
+    for (size_t i=0; i<list().size(); i++) {
+        if ((head == lambda_symbol && i == 1) || (head == defun_symbol && i == 2))
+            continue;
+        if (!list()[i].get_defined_atoms(atoms)) return false;
     }
+    return true;
+}
 
-    // Is one number less than or equal to another?
-    Value less_eq(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+////////////////////////////////////////////////////////////////////////////////
+/// IMAGES /////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-        if (args.size() != 2)
-            throw Error(Value("<=", less_eq), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return Value(int(args[0] <= args[1]));
+#ifdef USE_STD
+// An image is a snapshot of the definitions a program made, in a binary
+// format that loads without parsing or running the program again.
+// It holds, in order:
+//   - the header: IMAGE_MAGIC, IMAGE_VERSION, and IMAGE_BYTE_ORDER
+//   - the names of the symbols it uses, which are interned again when it's loaded
+//   - the kind of each heap object in it
+//   - the definitions, as pairs of a symbol and a value
+//   - the contents of each heap object
+// Values refer to symbols and heap objects by their index in the image, so
+// objects shared by several values, or in a cycle, load the same way they
+// were saved. Numbers are stored in the byte order of the machine, so an
+// image only loads on machines like the one that built it.
+#define IMAGE_MAGIC "WIMG"
+#define IMAGE_VERSION 2
+#define IMAGE_BYTE_ORDER 0x01020304
+
+// The kinds of heap objects in an image
+enum ImageObject {
+    IMAGE_STRING,
+    IMAGE_LIST,
+    IMAGE_RANGE,
+    IMAGE_LAMBDA,
+    IMAGE_F64VEC,
+    IMAGE_I32VEC,
+    IMAGE_DICT,
+    IMAGE_SET
+};
+
+// Is this data an image, rather than source code?
+bool is_image(const char *data, size_t size) {
+    return size >= 4 && std::string(data, 4) == IMAGE_MAGIC;
+}
+
+// Saves the definitions of a scope to an image
+class ImageWriter {
+public:
+    // Write every definition of a scope, besides `cmd-args`, to a file
+    void save(Environment const &env, std::string const &filename);
+private:
+    void write_int(std::string &out, int n) {
+        out.append((const char *)&n, sizeof(n));
     }
 
-    // Get the type name of a value
-    Value get_type_name(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    void write_float(std::string &out, double f) {
+        out.append((const char *)&f, sizeof(f));
+    }
 
-        if (args.size() != 1)
-            throw Error(Value("type", get_type_name), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+    void write_string(std::string &out, std::string const &s) {
+        write_int(out, int(s.size()));
+        out += s;
+    }
 
-        return Value::string(args[0].get_type_name());
+    // Write the index of a symbol in the image
+    void write_symbol(std::string &out, int symbol);
+    // Write a value. Heap objects are written as their index in the image,
+    // and the objects not seen before are queued to have their contents written.
+    void write_value(std::string &out, Value const &value);
+    // Write the contents of a heap object
+    void write_object(std::string &out, Value const &value);
+    // Write the definitions of a scope
+    void write_bindings(std::string &out, Bindings const &defs, int skipped);
+
+    std::map<int, int> symbol_index;
+    std::vector<int> symbols;
+    std::map<Object *, int> object_index;
+    // A value referring to each heap object, in the order of their indices
+    std::vector<Value> objects;
+    std::string kinds;
+};
+
+void ImageWriter::write_symbol(std::string &out, int symbol) {
+    std::map<int, int>::const_iterator itr = symbol_index.find(symbol);
+    if (itr != symbol_index.end()) {
+        write_int(out, itr->second);
+        return;
     }
+    int index = int(symbols.size());
+    symbol_index[symbol] = index;
+    symbols.push_back(symbol);
+    write_int(out, index);
+}
 
-    // Cast an item to a float
-    Value cast_to_float(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+void ImageWriter::write_value(std::string &out, Value const &value) {
+    out.push_back(char(value.type));
+    switch (value.type) {
+    case Value::INT:
+        write_int(out, value.stack_data.i);
+        break;
+    case Value::FLOAT:
+        write_float(out, value.stack_data.f);
+        break;
+    case Value::ATOM:
+        write_symbol(out, value.stack_data.atom.symbol);
+        write_int(out, value.stack_data.atom.depth);
+        write_int(out, value.stack_data.atom.slot);
+        break;
+    case Value::BUILTIN:
+        // Builtins are found by name when the image is loaded
+        write_symbol(out, value.builtin_name);
+        break;
+    case Value::UNIT:
+        break;
+    case Value::HANDLE:
+    case Value::VIEW:
+    case Value::BUILDER:
+    case Value::TASK:
+    case Value::CHANNEL:
+        // Open files and mapped files only make sense in the process that opened them,
+        // and so do tasks and channels, which belong to its threads.
+        // Builders are meant to be turned into strings before they're saved.
+        throw Error(value, CANNOT_SAVE);
+    default: {
+        Object *object = value.stack_data.object;
+        std::map<Object *, int>::const_iterator itr = object_index.find(object);
+        if (itr != object_index.end()) {
+            write_int(out, itr->second);
+            break;
+        }
 
-        if (args.size() != 1)
-            throw Error(Value(FLOAT_TYPE, cast_to_float), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return args[0].cast_to_float();
+        ImageObject kind;
+        if (value.type == Value::STRING) kind = IMAGE_STRING;
+        else if (value.type == Value::LAMBDA) kind = IMAGE_LAMBDA;
+        else if (value.type == Value::VECTOR) kind = value.as_vector()->floats? IMAGE_F64VEC : IMAGE_I32VEC;
+        else if (value.type == Value::MAP) kind = value.as_map()->is_set? IMAGE_SET : IMAGE_DICT;
+        else kind = value.list_object()->buffer == NULL? IMAGE_RANGE : IMAGE_LIST;
+
+        int index = int(objects.size());
+        object_index[object] = index;
+        objects.push_back(value);
+        kinds.push_back(char(kind));
+        write_int(out, index);
     }
+    }
+}
 
-    // Cast an item to an int
-    Value cast_to_int(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+void ImageWriter::write_object(std::string &out, Value const &value) {
+    if (value.type == Value::STRING) {
+        write_string(out, value.str());
+        return;
+    }
+    if (value.type == Value::VECTOR) {
+        VectorObject *vector = value.as_vector();
+        write_int(out, int(vector->size()));
+        if (vector->floats) out.append((const char *)&vector->f[0], vector->f.size() * sizeof(double));
+        else out.append((const char *)&vector->i[0], vector->i.size() * sizeof(int));
+        return;
+    }
+    if (value.type == Value::MAP) {
+        // Only the keys and their latest values are written
+        MapObject *map = value.as_map();
+        write_int(out, int(map->size));
+        for (size_t i=0; i<map->count; i++) {
+            if (map->buffer->previous[i] != MapBuffer::NONE) continue;
+            write_value(out, map->buffer->keys[i]);
+            if (!map->is_set) write_value(out, map->latest_value(i));
+        }
+        return;
+    }
 
-        if (args.size() != 1)
-            throw Error(Value(INT_TYPE, cast_to_int), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return args[0].cast_to_int();
+    ListObject *list = value.list_object();
+    if (list->buffer == NULL) {
+        write_int(out, list->first);
+        write_int(out, int(list->count));
+        return;
+    }
+    write_int(out, int(list->count));
+    for (size_t i=0; i<list->count; i++)
+        write_value(out, list->buffer->items[list->start + i]);
+    // The optimizer's marks on invariant calls are kept, but the functions
+    // calls resolved to are found again
+    out.push_back(char(list->cache != NULL && list->cache->invariant));
+    if (value.type != Value::LAMBDA) return;
+
+    LambdaObject *lambda = value.lambda();
+    write_int(out, int(lambda->frame_size));
+    // Memoized lambdas start over with no results remembered
+    write_int(out, lambda->memo != NULL? int(lambda->memo->limit) : -1);
+    write_int(out, lambda->name);
+    if (lambda->name >= 0) write_symbol(out, lambda->name);
+    write_int(out, int(lambda->dynamic.size()));
+    for (size_t i=0; i<lambda->dynamic.size(); i++)
+        write_symbol(out, lambda->dynamic[i]);
+
+    // The scope of a lambda only has the variables and frames it captured
+    write_bindings(out, lambda->scope.defs, -1);
+    std::vector<Frame> const &frames = lambda->scope.frames;
+    write_int(out, int(frames.size()));
+    for (size_t i=0; i<frames.size(); i++) {
+        write_int(out, int(frames[i].size()));
+        for (size_t j=0; j<frames[i].size(); j++) {
+            write_int(out, frames[i].symbols[j]);
+            if (frames[i].symbols[j] >= 0) write_symbol(out, frames[i].symbols[j]);
+            write_value(out, frames[i].slots[j]);
+        }
+    }
+}
+
+void ImageWriter::write_bindings(std::string &out, Bindings const &defs, int skipped) {
+    int count = 0;
+    for (size_t i=0; i<defs.slots(); i++)
+        if (defs.symbol_at(i) != Bindings::EMPTY && defs.symbol_at(i) != skipped) count++;
+    write_int(out, count);
+    for (size_t i=0; i<defs.slots(); i++) {
+        int symbol = defs.symbol_at(i);
+        if (symbol == Bindings::EMPTY || symbol == skipped) continue;
+        write_symbol(out, symbol);
+        write_value(out, defs.value_at(i));
     }
+}
 
-    // Index a list
-    Value index(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+void ImageWriter::save(Environment const &env, std::string const &filename) {
+    // The definitions are written first, to find the objects they refer to.
+    // Writing the objects can find more objects, which are written after them.
+    std::string defs, contents;
+    write_bindings(defs, env.defs, intern("cmd-args"));
+    // Writing an object can add to the list of objects, so each one is copied out of it first
+    for (size_t i=0; i<objects.size(); i++) {
+        Value object = objects[i];
+        write_object(contents, object);
+    }
 
-        if (args.size() != 2)
-            throw Error(Value("index", index), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+    std::string header = IMAGE_MAGIC;
+    write_int(header, IMAGE_VERSION);
+    write_int(header, IMAGE_BYTE_ORDER);
+    write_int(header, int(symbols.size()));
+    for (size_t i=0; i<symbols.size(); i++)
+        write_string(header, symbol_name(symbols[i]));
+    write_string(header, kinds);
+
+    std::ofstream f(filename.c_str(), std::ios::binary);
+    if (!f || !(f << header << defs << contents))
+        throw std::runtime_error("could not write file");
+}
 
-        std::vector<Value> list = args[0].as_list();
-        int i = args[1].as_int();
-        if (list.empty() || i >= (int)list.size())
-            throw Error(list, env, INDEX_OUT_OF_RANGE);
+// Loads the definitions saved in an image into a scope
+class ImageReader {
+public:
+    ImageReader(const char *data, size_t size) : ptr(data), end(data + size) {}
 
-        return list[i];
+    // Bind every definition in the image in a scope
+    void load(Environment &env);
+private:
+    // Make sure the image has `n` more bytes
+    void need(size_t n) {
+        if (size_t(end - ptr) < n) throw std::runtime_error(BAD_IMAGE);
     }
 
-    // Insert a value into a list
-    Value insert(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    int read_int() {
+        int n;
+        need(sizeof(n));
+        memcpy(&n, ptr, sizeof(n));
+        ptr += sizeof(n);
+        return n;
+    }
 
-        if (args.size() != 3)
-            throw Error(Value("insert", insert), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+    double read_float() {
+        double f;
+        need(sizeof(f));
+        memcpy(&f, ptr, sizeof(f));
+        ptr += sizeof(f);
+        return f;
+    }
 
-        std::vector<Value> list = args[0].as_list();
-        int i = args[1].as_int();
-        if (i > (int)list.size())
-            throw Error(list, env, INDEX_OUT_OF_RANGE);
+    // Read a count of things that each take at least `size` bytes
+    size_t read_count(size_t size) {
+        int n = read_int();
+        if (n < 0) throw std::runtime_error(BAD_IMAGE);
+        need(size_t(n) * size);
+        return size_t(n);
+    }
 
-        list.insert(list.begin() + args[1].as_int(), args[2]);
-        return Value(list);
+    std::string read_string() {
+        size_t n = read_count(1);
+        std::string result(ptr, n);
+        ptr += n;
+        return result;
     }
 
-    // Remove a value at an index from a list
-    Value remove(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    // Read the index of a symbol, and get the symbol it's interned as
+    int read_symbol() {
+        int index = read_int();
+        if (index < 0 || index >= int(symbols.size())) throw std::runtime_error(BAD_IMAGE);
+        return symbols[index];
+    }
 
-        if (args.size() != 2)
-            throw Error(Value("remove", remove), env, args.size() > 2? TOO_MANY_ARGS : TOO_FEW_ARGS);
+    Value read_value();
+    // Fill in the contents of a heap object
+    void read_object(size_t index);
+
+    const char *ptr, *end;
+    std::vector<int> symbols;
+    // A value referring to each heap object. They're made empty,
+    // so values can refer to them before their contents are read.
+    std::vector<Value> objects;
+    std::string kinds;
+    // The objects that quotes refer to
+    std::vector<int> quotes;
+    // The maps, with the keys and values to set in them
+    std::vector<std::pair<size_t, std::vector<Value> > > maps;
+};
 
-        std::vector<Value> list = args[0].as_list();
-        int i = args[1].as_int();
-        if (list.empty() || i >= (int)list.size())
-            throw Error(list, env, INDEX_OUT_OF_RANGE);
+Value ImageReader::read_value() {
+    need(1);
+    // The type is only set on the result once it has the data for its type
+    unsigned char type = (unsigned char)*ptr++;
+    Value result;
+    switch (type) {
+    case Value::INT:
+        result.type = type;
+        result.stack_data.i = read_int();
+        return result;
+    case Value::FLOAT:
+        result.type = type;
+        result.stack_data.f = read_float();
+        return result;
+    case Value::ATOM: {
+        result.stack_data.atom.symbol = read_symbol();
+        // A local's frame is found by counting out from the current one,
+        // so a negative depth or slot would be read from outside of the frames.
+        // Atoms that aren't locals have the slot -1.
+        int depth = read_int(), slot = read_int();
+        if (depth < 0 || depth > SHRT_MAX || slot < -1 || slot > SHRT_MAX)
+            throw std::runtime_error(BAD_IMAGE);
+        result.stack_data.atom.depth = short(depth);
+        result.stack_data.atom.slot = short(slot);
+        result.type = type;
+        return result;
+    }
+    case Value::BUILTIN: {
+        Value const *builtin = builtins().find(read_symbol());
+        if (builtin == NULL) throw std::runtime_error(BAD_IMAGE);
+        return *builtin;
+    }
+    case Value::UNIT:
+        return result;
+    case Value::QUOTE:
+    case Value::LIST:
+    case Value::STRING:
+    case Value::LAMBDA:
+    case Value::VECTOR:
+    case Value::MAP: {
+        int index = read_int();
+        if (index < 0 || index >= int(objects.size())) throw std::runtime_error(BAD_IMAGE);
+        // The value must refer to the kind of object it was saved with
+        ImageObject kind = ImageObject(kinds[index]);
+        bool list = kind == IMAGE_LIST || kind == IMAGE_RANGE;
+        if ((type == Value::STRING) != (kind == IMAGE_STRING)
+            || (type == Value::LAMBDA) != (kind == IMAGE_LAMBDA)
+            || (type == Value::VECTOR) != (kind == IMAGE_F64VEC || kind == IMAGE_I32VEC)
+            || (type == Value::MAP) != (kind == IMAGE_DICT || kind == IMAGE_SET)
+            || (type == Value::QUOTE && kind != IMAGE_LIST)
+            || (type == Value::LIST && !list))
+            throw std::runtime_error(BAD_IMAGE);
+
+        if (type == Value::QUOTE) quotes.push_back(index);
+        result = objects[index];
+        result.type = type;
+        return result;
+    }
+    default:
+        throw std::runtime_error(BAD_IMAGE);
+    }
+}
 
-        list.erase(list.begin() + i);
-        return Value(list);
+void ImageReader::read_object(size_t index) {
+    Value const &value = objects[index];
+    switch (kinds[index]) {
+    case IMAGE_STRING:
+        static_cast<StringObject *>(value.stack_data.object)->str = read_string();
+        return;
+    case IMAGE_F64VEC: {
+        std::vector<double> &f = value.as_vector()->f;
+        f.resize(read_count(sizeof(double)));
+        if (!f.empty()) memcpy(&f[0], ptr, f.size() * sizeof(double));
+        ptr += f.size() * sizeof(double);
+        return;
+    }
+    case IMAGE_I32VEC: {
+        std::vector<int> &i = value.as_vector()->i;
+        i.resize(read_count(sizeof(int)));
+        if (!i.empty()) memcpy(&i[0], ptr, i.size() * sizeof(int));
+        ptr += i.size() * sizeof(int);
+        return;
+    }
+    case IMAGE_RANGE: {
+        ListObject *range = value.list_object();
+        range->first = read_int();
+        range->count = read_count(0);
+        return;
+    }
+    case IMAGE_DICT:
+    case IMAGE_SET: {
+        // The keys can't be hashed until the objects they refer to are read
+        bool is_set = kinds[index] == IMAGE_SET;
+        size_t count = read_count(sizeof(int) * (is_set? 1 : 2));
+        maps.push_back(std::make_pair(index, std::vector<Value>()));
+        for (size_t i=0; i<count; i++) {
+            maps.back().second.push_back(read_value());
+            maps.back().second.push_back(is_set? Value() : read_value());
+        }
+        return;
+    }
     }
 
-    // Get the length of a list
-    Value len(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    ListObject *list = value.list_object();
+    std::vector<Value> &items = list->buffer->items;
+    size_t count = read_count(1);
+    items.reserve(count);
+    for (size_t i=0; i<count; i++)
+        items.push_back(read_value());
+    list->count = count;
+    need(1);
+    if (*ptr++) {
+        list->cache = new CallCache;
+        list->cache->invariant = true;
+    }
+    if (kinds[index] != IMAGE_LAMBDA) return;
+
+    LambdaObject *lambda = value.lambda();
+    lambda->frame_size = read_count(0);
+    int memo_limit = read_int();
+    if (memo_limit >= 0) lambda->memo = new MemoTable(size_t(memo_limit));
+    if (read_int() >= 0) lambda->name = read_symbol();
+    size_t dynamic = read_count(sizeof(int));
+    for (size_t i=0; i<dynamic; i++)
+        lambda->dynamic.push_back(read_symbol());
+
+    size_t captured = read_count(sizeof(int));
+    for (size_t i=0; i<captured; i++) {
+        int symbol = read_symbol();
+        lambda->scope.capture(symbol, read_value());
+    }
+    lambda->scope.frames.resize(read_count(sizeof(int)));
+    for (size_t i=0; i<lambda->scope.frames.size(); i++) {
+        Frame &frame = lambda->scope.frames[i];
+        frame.resize(read_count(sizeof(int)));
+        for (size_t j=0; j<frame.size(); j++) {
+            frame.symbols[j] = read_int() >= 0? read_symbol() : -1;
+            frame.slots[j] = read_value();
+        }
+    }
+}
 
-        if (args.size() != 1)
-            throw Error(Value("len", len), env, args.size() > 1?
-                TOO_MANY_ARGS : TOO_FEW_ARGS
-            );
-        
-        return Value(int(args[0].as_list().size()));
+void ImageReader::load(Environment &env) {
+    need(4);
+    if (!is_image(ptr, size_t(end - ptr))) throw std::runtime_error(BAD_IMAGE);
+    ptr += 4;
+    if (read_int() != IMAGE_VERSION || read_int() != IMAGE_BYTE_ORDER)
+        throw std::runtime_error(BAD_IMAGE);
+
+    size_t symbol_count = read_count(sizeof(int));
+    for (size_t i=0; i<symbol_count; i++)
+        symbols.push_back(intern(read_string()));
+
+    // Make every object empty, so they can be referred to before they're read
+    kinds = read_string();
+    for (size_t i=0; i<kinds.size(); i++) {
+        switch (kinds[i]) {
+        case IMAGE_STRING: objects.push_back(Value::string("")); break;
+        case IMAGE_LIST: objects.push_back(Value(std::vector<Value>())); break;
+        case IMAGE_RANGE: objects.push_back(Value::lazy_range(0, 0)); break;
+        case IMAGE_LAMBDA: {
+            Value lambda;
+            lambda.type = Value::LAMBDA;
+            lambda.stack_data.object = new LambdaObject(std::vector<Value>());
+            objects.push_back(lambda);
+            break;
+        }
+        case IMAGE_F64VEC: objects.push_back(Value::vector(new VectorObject(true))); break;
+        case IMAGE_I32VEC: objects.push_back(Value::vector(new VectorObject(false))); break;
+        case IMAGE_DICT: objects.push_back(Value::map(new MapObject(false))); break;
+        case IMAGE_SET: objects.push_back(Value::map(new MapObject(true))); break;
+        default: throw std::runtime_error(BAD_IMAGE);
+        }
     }
 
-    // Add an item to the end of a list
-    Value push(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    std::vector<int> names;
+    std::vector<Value> values;
+    size_t def_count = read_count(sizeof(int));
+    for (size_t i=0; i<def_count; i++) {
+        names.push_back(read_symbol());
+        values.push_back(read_value());
+    }
+    for (size_t i=0; i<objects.size(); i++)
+        read_object(i);
+    // Maps are filled in after the objects their keys refer to. Maps in the
+    // keys of a map were found after it when it was saved, so they're filled in first.
+    for (size_t i=maps.size(); i-- > 0;) {
+        MapObject *map = objects[maps[i].first].as_map();
+        std::vector<Value> const &entries = maps[i].second;
+        for (size_t j=0; j<entries.size(); j+=2)
+            map->set(entries[j], entries[j + 1]);
+    }
 
-        if (args.size() == 0)
-            throw Error(Value("push", push), env, TOO_FEW_ARGS);
-        for (size_t i=1; i<args.size(); i++)
-            args[0].push(args[i]);
-        return args[0];
+    // Quotes need their quoted expression, and lambdas their parameters and body
+    for (size_t i=0; i<quotes.size(); i++)
+        if (objects[quotes[i]].list_length() == 0)
+            throw std::runtime_error(BAD_IMAGE);
+    for (size_t i=0; i<objects.size(); i++) {
+        Value const &object = objects[i];
+        if (kinds[i] == IMAGE_LAMBDA && (object.list().size() != 2 || object.list()[0].type != Value::LIST))
+            throw std::runtime_error(BAD_IMAGE);
+        if (kinds[i] != IMAGE_LAMBDA) continue;
+
+        // Atoms bound in the lambda's frame can't be cached by call sites,
+        // just like when the lambda was first made
+        Args params = object.list()[0].list();
+        FrameLayout layout;
+        layout.size = int(params.size());
+        object.list()[1].declare_locals(layout);
+        for (size_t j=0; j<params.size(); j++)
+            if (params[j].is_atom()) binding_versions().shadow(params[j].as_symbol());
+        for (std::map<int, int>::const_iterator j=layout.slots.begin(); j!=layout.slots.end(); j++)
+            binding_versions().shadow(j->first);
     }
 
-    Value pop(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    for (size_t i=0; i<names.size(); i++)
+        env.set(names[i], values[i]);
+
+    // Everything in the image is reachable from its definitions, so none of it
+    // is a cycle of garbage. Letting go of the objects here made them possible
+    // roots of cycles, which would only slow down the next collection.
+    std::vector<Object *> loaded;
+    for (size_t i=0; i<objects.size(); i++)
+        loaded.push_back(objects[i].stack_data.object);
+    objects.clear();
+    values.clear();
+    for (size_t i=0; i<loaded.size(); i++)
+        if (loaded[i]->root >= 0) {
+            forget_root(loaded[i]);
+            loaded[i]->root = Object::NOT_ROOT;
+        }
+}
 
-        if (args.size() != 1)
-            throw Error(Value("pop", pop), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        return args[0].pop();
-    }
+// Save the definitions of a scope to an image
+void save_image(Environment const &env, std::string const &filename) {
+    ImageWriter().save(env, filename);
+}
 
-    Value head(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+// Load the definitions in an image into a scope
+void load_image(const char *data, size_t size, Environment &env) {
+    ImageReader(data, size).load(env);
+}
 
-        if (args.size() != 1)
-            throw Error(Value("head", head), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        std::vector<Value> list = args[0].as_list();
-        if (list.empty())
-            throw Error(Value("head", head), env, INDEX_OUT_OF_RANGE);
+// A program that's been included, kept so including the same code again doesn't parse it again
+struct CachedProgram {
+    std::string code;
+    std::vector<Value> program;
+};
 
-        return list[0];
+Value run_file(std::string const &filename, Environment &env) {
+    MappedFile file(filename);
+    if (is_image(file.data(), file.size())) {
+        load_image(file.data(), file.size(), env);
+        return Value();
     }
 
-    Value tail(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    // The cache is keyed by the hash of the code, and the code itself
+    // is compared to make sure it's the same program
+    static std::map<unsigned, CachedProgram> cache;
+    static Mutex mutex;
+    unsigned hash = hash_bytes(file.data(), file.size());
+    std::vector<Value> program;
+    {
+        SharedLock lock(mutex);
+        std::map<unsigned, CachedProgram>::const_iterator itr = cache.find(hash);
+        if (itr != cache.end() && itr->second.code.size() == file.size()
+            && memcmp(itr->second.code.data(), file.data(), file.size()) == 0)
+            program = itr->second.program;
+    }
 
-        if (args.size() != 1)
-            throw Error(Value("tail", tail), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+    if (program.empty()) {
+        program = prepare(file.data(), file.size());
+        SharedLock lock(mutex);
+        CachedProgram &cached = cache[hash];
+        cached.code.assign(file.data(), file.size());
+        cached.program = program;
+    }
+    return run_program(program, env);
+}
+#endif
 
-        std::vector<Value> result, list = args[0].as_list();
+// Does this environment, or its parent environment, have a variable?
+bool Environment::has(int symbol) const {
+    if (binds(symbol))
+        return true;
+    else if (parent_scope != NULL)
+        // If it was not found in the current environment,
+        // try to find it in the parent environment
+        return parent_scope->has(symbol);
+    else return false;
+}
 
-        for (size_t i = 1; i<list.size(); i++)
-            result.push_back(list[i]);
-        
-        return Value(result);
+// Find a local in a lambda frame
+static Value const *find_local(Frame const &frame, int symbol) {
+    for (size_t j=frame.size(); j-- > 0;)
+        if (frame.symbols[j] == symbol)
+            return &frame.slots[j];
+    return NULL;
+}
+
+// Find a local in a list of lambda frames, innermost first
+static Value const *find_local(std::vector<Frame> const &frames, int symbol) {
+    for (size_t i=frames.size(); i-- > 0;) {
+        Value const *local = find_local(frames[i], symbol);
+        if (local != NULL) return local;
     }
+    return NULL;
+}
 
-    Value parse(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+bool Environment::binds(int symbol) const {
+    // Check the locals in the lambda frames
+    if (lambda != NULL && find_local(frame, symbol) != NULL)
+        return true;
+    if (find_local(frames, symbol) != NULL)
+        return true;
+    if (lambda != NULL && find_local(lambda->scope.frames, symbol) != NULL)
+        return true;
 
-        if (args.size() != 1)
-            throw Error(Value("parse", parse), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
-        if (args[0].get_type_name() != STRING_TYPE)
-            throw Error(args[0], env, INVALID_ARGUMENT);
-        std::vector<Value> parsed = ::parse(args[0].as_string());
+    // Find the value in the map
+    return defs.find(symbol) != NULL
+        || (lambda != NULL && lambda->scope.defs.find(symbol) != NULL);
+}
 
-        // if (parsed.size() == 1)
-        //     return parsed[0];
-        // else return Value(parsed);
-        return Value(parsed);
-    }
+// Get the value associated with this symbol in this scope
+Value Environment::get(int symbol) const {
+    // Builtins can't be shadowed, so check them first
+    Value const *b = builtins().find(symbol);
+    if (b != NULL) return *b;
 
-    Value replace(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    Value const *found = lookup(symbol);
+    if (found != NULL) return *found;
 
-        if (args.size() != 3)
-            throw Error(Value("replace", replace), env, args.size() > 3? TOO_MANY_ARGS : TOO_FEW_ARGS);
+    // The lookup failed in the outermost scope, so the error is reported there
+    Environment const *outermost = this;
+    while (outermost->parent_scope != NULL)
+        outermost = outermost->parent_scope;
+    throw Error(Value::atom(symbol), *outermost, ATOM_NOT_DEFINED);
+}
 
-        std::string src = args[0].as_string();
-        replace_substring(src, args[1].as_string(), args[2].as_string());
-        return Value::string(src);
+Value const *Environment::lookup(int symbol) const {
+    // Each scope is checked once, from the innermost to the outermost
+    for (Environment const *scope = this; scope != NULL; scope = scope->parent_scope) {
+        // The locals in the lambda frames come first, innermost first
+        LambdaObject const *called = scope->lambda;
+        Value const *found = called != NULL? find_local(scope->frame, symbol) : NULL;
+        if (found == NULL && !scope->frames.empty())
+            found = find_local(scope->frames, symbol);
+        if (found == NULL && called != NULL && !called->scope.frames.empty())
+            found = find_local(called->scope.frames, symbol);
+        // Then the definitions in the scope
+        if (found == NULL)
+            found = scope->defs.find(symbol);
+        // Then the variables captured by the lambda this is a call to
+        if (found == NULL && called != NULL)
+            found = called->scope.defs.find(symbol);
+        if (found != NULL) return found;
     }
+    return NULL;
+}
 
-    Value display(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+////////////////////////////////////////////////////////////////////////////////
+/// BYTECODE VIRTUAL MACHINE ///////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-        if (args.size() != 1)
-            throw Error(Value("display", display), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+// The instructions of the stack virtual machine.
+// Any operands are stored in the code directly after their opcode.
+enum Opcode {
+    // Push constant `k`
+    OP_CONSTANT,
+    // Push the value of the atom in constant `k`
+    OP_LOAD,
+    // Push the function the head of the call in constant `k` resolves to,
+    // using the function the call site cached if its atom wasn't redefined
+    OP_LOAD_HEAD,
+    // Push the result of tree-walking the expression in constant `k`
+    OP_EVAL,
+    // Discard the top of the stack
+    OP_POP,
+    // Jump to `target`
+    OP_JUMP,
+    // Pop the top of the stack, and jump to `target` if it's false
+    OP_JUMP_IF_FALSE,
+    // Bind the top of the stack to the atom in constant `k`, leaving it on the stack
+    OP_DEFINE,
+    // Push a lambda with the parameters in constant `k`, the body in
+    // constant `k+1`, and the body compiled to chunk `c`
+    OP_LAMBDA,
+    // If the function on top of the stack is a special form, call it with
+    // the unevaluated arguments of the call in constant `k`, and jump to `target`
+    OP_PREPARE_CALL,
+    // Call the function under the top `n` values with those values as arguments
+    OP_CALL,
+    // Like OP_CALL, but if the function is a lambda, return the call for
+    // `Value::apply` to make instead of making it
+    OP_TAIL_CALL,
+    // Pop a list, and start iterating over it
+    OP_FOR_INIT,
+    // Bind the next item of the innermost loop to the atom in constant `k`,
+    // or jump to `target` if there are none left
+    OP_FOR_NEXT,
+    // Pop the result of a loop body, and store it as the loop's result
+    OP_FOR_STORE,
+    // Stop iterating over the innermost loop
+    OP_FOR_END,
+    // Arithmetic over the top `n` values
+    OP_ADD,
+    OP_MUL,
+    // Arithmetic and comparisons over the top two values
+    OP_SUB,
+    OP_DIV,
+    OP_MOD,
+    OP_EQ,
+    OP_NEQ,
+    OP_LESS,
+    OP_GREATER,
+    OP_LESS_EQ,
+    OP_GREATER_EQ,
+    // Return the top of the stack
+    OP_RETURN
+};
 
-        return Value::string(args[0].display());
+// A compiled program or lambda body.
+struct Chunk {
+    // The opcodes and their operands
+    std::vector<int> code;
+    // The values the code refers to
+    std::vector<Value> constants;
+
+    // Add a constant to the chunk and get its index
+    int constant(Value const &v) {
+        constants.push_back(v);
+        return int(constants.size() - 1);
     }
 
-    Value debug(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    void emit(int op) { code.push_back(op); }
+    void emit(int op, int operand) { emit(op); emit(operand); }
 
-        if (args.size() != 1)
-            throw Error(Value("debug", debug), env, args.size() > 1? TOO_MANY_ARGS : TOO_FEW_ARGS);
+    // The position of the next instruction
+    int here() const { return int(code.size()); }
+    // Point the jump operand at `at` to the next instruction
+    void patch(int at) { code[at] = here(); }
+};
 
-        return Value::string(args[0].debug());
+// All of the chunks compiled so far. Compiled lambdas refer
+// to their bodies by their index in this table.
+std::vector<Chunk *> &chunks() {
+    static std::vector<Chunk *> table;
+    return table;
+}
+
+// Compiles parsed and resolved expressions to bytecode chunks.
+// Special forms that don't have an instruction fall back to being
+// tree-walked with `Value::eval`, so every program can be compiled.
+class Compiler {
+public:
+    // Compile a whole program, and get the index of its chunk
+    int compile_program(std::vector<Value> const &program) {
+        int id = new_chunk();
+        Chunk &chunk = *chunks()[id];
+        if (program.empty())
+            chunk.emit(OP_CONSTANT, chunk.constant(Value()));
+
+        for (size_t i=0; i<program.size(); i++) {
+            if (i > 0) chunk.emit(OP_POP);
+            compile(program[i], id);
+        }
+        chunk.emit(OP_RETURN);
+        return id;
     }
 
-    Value map_list(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+private:
+    int new_chunk() {
+        chunks().push_back(new Chunk);
+        return int(chunks().size() - 1);
+    }
 
-        std::vector<Value> result, l=args[1].as_list(), tmp;
-        for (size_t i=0; i<l.size(); i++) {
-            tmp.push_back(l[i]);
-            result.push_back(args[0].apply(tmp, env));
-            tmp.clear();
+    // Compile an expression to code that pushes its value.
+    // Chunks are referred to by index, because compiling
+    // a lambda adds to the chunk table. Calls in `tail`
+    // position of a lambda body are compiled to tail calls.
+    void compile(Value const &expr, int id, bool tail=false) {
+        std::string type = expr.get_type_name();
+        if (type == ATOM_TYPE) {
+            // Builtins can't be shadowed, so they are constants.
+            Value const *b = builtins().find(expr.as_symbol());
+            if (b != NULL)
+                chunks()[id]->emit(OP_CONSTANT, chunks()[id]->constant(*b));
+            else
+                chunks()[id]->emit(OP_LOAD, chunks()[id]->constant(expr));
+        } else if (type == LIST_TYPE) {
+            compile_call(expr, expr.as_list(), id, tail);
+        } else {
+            // Quotes and literals always evaluate to the same constant.
+            Environment empty;
+            chunks()[id]->emit(OP_CONSTANT, chunks()[id]->constant(Value(expr).eval(empty)));
         }
-        return Value(result);
     }
 
-    Value filter_list(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
-
-        std::vector<Value> result, l=args[1].as_list(), tmp;
-        for (size_t i=0; i<l.size(); i++) {
-            tmp.push_back(l[i]);
-            if (args[0].apply(tmp, env).as_bool())
-                result.push_back(l[i]);
-            tmp.clear();
+    // Compile each expression in a body, keeping only the last result
+    void compile_body(std::vector<Value> const &list, size_t from, size_t to, int id, bool tail=false) {
+        for (size_t i=from; i<to; i++) {
+            compile(list[i], id, tail && i == to - 1);
+            if (i < to - 1) chunks()[id]->emit(OP_POP);
         }
-        return Value(result);
     }
 
-    Value reduce_list(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+    // Compile a lambda body to its own chunk
+    int compile_lambda(Value const &body) {
+        int id = new_chunk();
+        compile(body, id, true);
+        chunks()[id]->emit(OP_RETURN);
+        return id;
+    }
 
-        std::vector<Value> l=args[2].as_list(), tmp;
-        Value acc = args[1];
-        for (size_t i=0; i<l.size(); i++) {
-            tmp.push_back(acc);
-            tmp.push_back(l[i]);
-            acc = args[0].apply(tmp, env);
-            tmp.clear();
+    void compile_call(Value const &expr, std::vector<Value> const &list, int id, bool tail) {
+        static const int if_symbol = intern("if");
+        static const int do_symbol = intern("do");
+        static const int while_symbol = intern("while");
+        static const int for_symbol = intern("for");
+        static const int define_symbol = intern("define");
+        static const int defun_symbol = intern("defun");
+        static const int lambda_symbol = intern("lambda");
+
+        // Evaluating an empty list is an error, so let `eval` throw it.
+        if (list.empty()) {
+            chunks()[id]->emit(OP_EVAL, chunks()[id]->constant(expr));
+            return;
         }
-        return acc;
-    }
 
-    Value range(std::vector<Value> args, Environment &env) {
-        // Is not a special form, so we can evaluate our args.
-        eval_args(args, env);
+        size_t argc = list.size() - 1;
+        if (list[0].is_atom() && builtins().find(list[0].as_symbol()) != NULL) {
+            int head = list[0].as_symbol();
+            std::string name = list[0].as_atom();
+
+            if (head == if_symbol && argc == 3) {
+                compile(list[1], id);
+                chunks()[id]->emit(OP_JUMP_IF_FALSE, 0);
+                int to_else = chunks()[id]->here() - 1;
+                compile(list[2], id, tail);
+                chunks()[id]->emit(OP_JUMP, 0);
+                int to_end = chunks()[id]->here() - 1;
+                chunks()[id]->patch(to_else);
+                compile(list[3], id, tail);
+                chunks()[id]->patch(to_end);
+                return;
+            }
 
-        std::vector<Value> result;
-        Value low = args[0], high = args[1];
-        if (low.get_type_name() != INT_TYPE && low.get_type_name() != FLOAT_TYPE)
-            throw Error(low, env, MISMATCHED_TYPES);
-        if (high.get_type_name() != INT_TYPE && high.get_type_name() != FLOAT_TYPE)
-            throw Error(high, env, MISMATCHED_TYPES);
+            if (head == do_symbol) {
+                if (argc == 0)
+                    chunks()[id]->emit(OP_CONSTANT, chunks()[id]->constant(Value()));
+                compile_body(list, 1, list.size(), id, tail);
+                return;
+            }
 
-        if (low >= high) return Value(result);
+            if (head == while_symbol && argc >= 2) {
+                // The result of the last iteration stays on the stack
+                chunks()[id]->emit(OP_CONSTANT, chunks()[id]->constant(Value()));
+                int loop = chunks()[id]->here();
+                compile(list[1], id);
+                chunks()[id]->emit(OP_JUMP_IF_FALSE, 0);
+                int to_end = chunks()[id]->here() - 1;
+                chunks()[id]->emit(OP_POP);
+                compile_body(list, 2, list.size(), id);
+                chunks()[id]->emit(OP_JUMP, loop);
+                chunks()[id]->patch(to_end);
+                return;
+            }
 
-        while (low < high) {
-            result.push_back(low);
-            low = low + Value(1);
+            if (head == for_symbol && argc >= 3 && list[1].is_atom()) {
+                chunks()[id]->emit(OP_CONSTANT, chunks()[id]->constant(Value()));
+                compile(list[2], id);
+                chunks()[id]->emit(OP_FOR_INIT);
+                int loop = chunks()[id]->here();
+                chunks()[id]->emit(OP_FOR_NEXT, chunks()[id]->constant(list[1]));
+                chunks()[id]->emit(0);
+                int to_end = chunks()[id]->here() - 1;
+                compile_body(list, 3, list.size(), id);
+                chunks()[id]->emit(OP_FOR_STORE);
+                chunks()[id]->emit(OP_JUMP, loop);
+                chunks()[id]->patch(to_end);
+                chunks()[id]->emit(OP_FOR_END);
+                return;
+            }
+
+            if (head == define_symbol && argc == 2) {
+                compile(list[2], id);
+                chunks()[id]->emit(OP_DEFINE, chunks()[id]->constant(list[1]));
+                return;
+            }
+
+            if (head == lambda_symbol && argc >= 2 && list[1].get_type_name() == LIST_TYPE) {
+                emit_lambda(list[1], list[2], id);
+                return;
+            }
+
+            if (head == defun_symbol && argc == 3 && list[2].get_type_name() == LIST_TYPE) {
+                emit_lambda(list[2], list[3], id);
+                chunks()[id]->emit(OP_DEFINE, chunks()[id]->constant(list[1]));
+                return;
+            }
+
+            int op = -1;
+            if ((name == "+" || name == "*") && argc >= 2) {
+                op = name == "+"? OP_ADD : OP_MUL;
+            } else if (argc == 2) {
+                if (name == "-")       op = OP_SUB;
+                else if (name == "/")  op = OP_DIV;
+                else if (name == "%")  op = OP_MOD;
+                else if (name == "=")  op = OP_EQ;
+                else if (name == "!=") op = OP_NEQ;
+                else if (name == "<")  op = OP_LESS;
+                else if (name == ">")  op = OP_GREATER;
+                else if (name == "<=") op = OP_LESS_EQ;
+                else if (name == ">=") op = OP_GREATER_EQ;
+            }
+            if (op >= 0) {
+                for (size_t i=1; i<list.size(); i++)
+                    compile(list[i], id);
+                if (op == OP_ADD || op == OP_MUL)
+                    chunks()[id]->emit(op, int(argc));
+                else chunks()[id]->emit(op);
+                return;
+            }
+
+            // Every other special form evaluates its own arguments.
+            if (builtins().find(head)->is_special_form()) {
+                chunks()[id]->emit(OP_EVAL, chunks()[id]->constant(expr));
+                return;
+            }
+
+            // And regular builtins are called with their evaluated arguments.
+            compile(list[0], id);
+            for (size_t i=1; i<list.size(); i++)
+                compile(list[i], id);
+            chunks()[id]->emit(OP_CALL, int(argc));
+            return;
         }
-        return Value(result);
+
+        // The function might still turn out to be a special form
+        // at runtime, in which case it gets the arguments unevaluated.
+        // A head atom is looked up through the call site's cache, like the
+        // tree walker does, since finding it means searching every caller's scope.
+        if (list[0].is_atom())
+            chunks()[id]->emit(OP_LOAD_HEAD, chunks()[id]->constant(expr));
+        else compile(list[0], id);
+        std::vector<Value> args(list.begin() + 1, list.end());
+        chunks()[id]->emit(OP_PREPARE_CALL, chunks()[id]->constant(Value(args)));
+        chunks()[id]->emit(0);
+        int to_end = chunks()[id]->here() - 1;
+        for (size_t i=1; i<list.size(); i++)
+            compile(list[i], id);
+        chunks()[id]->emit(tail? OP_TAIL_CALL : OP_CALL, int(argc));
+        chunks()[id]->patch(to_end);
     }
-}
 
-void repl(Environment &env) {
-#ifdef USE_STD
-    std::string code;
-    std::string input;
-    Value tmp;
-    std::vector<Value> parsed;
-    while (std::cin) {
-        std::cout << ">>> ";
-        std::getline(std::cin, input);
-        if (input == "!quit" || input == "!q")
-            break;
-        else if (input == "!env" || input == "!e")
-            std::cout << env << std::endl;
-        else if (input == "!export" || input == "!x") {
-            std::cout << "File to export to: ";
-            std::getline(std::cin, input);
+    void emit_lambda(Value const &params, Value const &body, int id) {
+        int body_chunk = compile_lambda(body);
+        Chunk &chunk = *chunks()[id];
+        int k = chunk.constant(params);
+        chunk.constant(body);
+        chunk.emit(OP_LAMBDA, k);
+        chunk.emit(body_chunk);
+    }
+};
 
-            std::ofstream f;
-            f.open(input.c_str(), std::ofstream::out);
-            f << code;
-            f.close();
-        } else if (input != "") {
-            try {
-                tmp = run(input, env);
-                std::cout << " => " << tmp.debug() << std::endl;
-                code += input + "\n";
-            } catch (Error &e) {
-                std::cerr << e.description() << std::endl;
-            } catch (std::runtime_error &e) {
-                std::cerr << e.what() << std::endl;
+Value run_chunk(int id, Environment &env, TailCall &call) {
+    Chunk const &chunk = *chunks()[id];
+    std::vector<int> const &code = chunk.code;
+    std::vector<Value> const &constants = chunk.constants;
+
+    std::vector<Value> stack;
+    // The `for` loops being run
+    std::vector<ItemIterator> loops;
+    Value item;
+    Value a, b, f;
+    int n;
+
+    size_t pc = 0;
+    while (true) {
+        switch (code[pc++]) {
+        case OP_CONSTANT:
+            stack.push_back(constants[code[pc++]]);
+            break;
+        case OP_LOAD:
+        case OP_EVAL:
+            stack.push_back(constants[code[pc++]].eval(env));
+            break;
+        case OP_LOAD_HEAD:
+            stack.push_back(constants[code[pc++]].eval_head(env));
+            break;
+        case OP_POP:
+            stack.pop_back();
+            break;
+        case OP_JUMP:
+            pc = code[pc];
+            break;
+        case OP_JUMP_IF_FALSE:
+            a = stack.back();
+            stack.pop_back();
+            if (a.as_bool()) pc++;
+            else pc = code[pc];
+            break;
+        case OP_DEFINE:
+            stack.back().set_lambda_name(constants[code[pc]]);
+            env.bind(constants[code[pc++]], stack.back());
+            break;
+        case OP_LAMBDA:
+            f = Value(constants[code[pc]].as_list(), constants[code[pc] + 1], env);
+            f.set_compiled_body(code[pc + 1]);
+            stack.push_back(f);
+            pc += 2;
+            break;
+        case OP_PREPARE_CALL:
+            if (stack.back().is_special_form()) {
+                f = stack.back();
+                stack.pop_back();
+                stack.push_back(f.apply(constants[code[pc]].as_list(), env));
+                pc = code[pc + 1];
+            } else pc += 2;
+            break;
+        case OP_CALL:
+            // The arguments are passed in place on the stack
+            n = code[pc++];
+            f = stack[stack.size() - n - 1].apply(Args(&stack[0] + stack.size() - n, n), env);
+            stack.resize(stack.size() - n);
+            stack.back() = f;
+            break;
+        case OP_TAIL_CALL:
+            n = code[pc++];
+            f = stack[stack.size() - n - 1];
+            if (f.is_lambda()) {
+                call.function = f;
+                call.args.assign(stack.end() - n, stack.end());
+                return Value();
+            }
+            f = f.apply(Args(&stack[0] + stack.size() - n, n), env);
+            stack.resize(stack.size() - n);
+            stack.back() = f;
+            break;
+        case OP_FOR_INIT:
+            // Making the iterator checks that the loop is over something it can iterate over
+            loops.push_back(ItemIterator(stack.back()));
+            stack.pop_back();
+            break;
+        case OP_FOR_NEXT:
+            if (loops.back().next(item)) {
+                env.bind(constants[code[pc]], item);
+                pc += 2;
+            } else pc = code[pc + 1];
+            break;
+        case OP_FOR_STORE:
+            stack[stack.size() - 2] = stack.back();
+            stack.pop_back();
+            break;
+        case OP_FOR_END:
+            loops.pop_back();
+            break;
+        case OP_ADD:
+        case OP_MUL:
+            n = code[pc];
+            a = code[pc - 1] == OP_ADD? Value::sum(Args(&stack[stack.size() - n], n))
+                : Value::product(Args(&stack[stack.size() - n], n));
+            stack.resize(stack.size() - code[pc] + 1);
+            stack.back() = a;
+            pc++;
+            break;
+        case OP_SUB:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_EQ:
+        case OP_NEQ:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_LESS_EQ:
+        case OP_GREATER_EQ:
+            b = stack.back();
+            stack.pop_back();
+            a = stack.back();
+            switch (code[pc - 1]) {
+            case OP_SUB:        stack.back() = a - b; break;
+            case OP_DIV:        stack.back() = a / b; break;
+            case OP_MOD:        stack.back() = a % b; break;
+            case OP_EQ:         stack.back() = Value(int(a == b)); break;
+            case OP_NEQ:        stack.back() = Value(int(a != b)); break;
+            case OP_LESS:       stack.back() = Value(int(a < b)); break;
+            case OP_GREATER:    stack.back() = Value(int(a > b)); break;
+            case OP_LESS_EQ:    stack.back() = Value(int(a <= b)); break;
+            case OP_GREATER_EQ: stack.back() = Value(int(a >= b)); break;
             }
+            break;
+        case OP_RETURN:
+            return stack.back();
+        default:
+            throw Error(Value(), env, INTERNAL_ERROR);
         }
     }
-#endif
 }
 
-// Does this environment, or its parent environment, have a variable?
-bool Environment::has(std::string name) const {
-    // Find the value in the map
-    std::map<std::string, Value>::const_iterator itr = defs.find(name);
-    if (itr != defs.end())
-        // If it was found
-        return true;
-    else if (parent_scope != NULL)
-        // If it was not found in the current environment,
-        // try to find it in the parent environment
-        return parent_scope->has(name);
-    else return false;
+// Compile code to bytecode, and execute it in an environment
+Value run_compiled(std::string const &code, Environment &env) {
+    std::vector<Value> parsed = parse(code);
+    resolve(parsed);
+    Compiler compiler;
+    // The program isn't a lambda body, so it has no tail calls
+    TailCall call;
+    return run_chunk(compiler.compile_program(parsed), env, call);
 }
 
-// Get the value associated with this name in this scope
-Value Environment::get(std::string name) const {
-    // Meta operations
-    if (name == "eval")  return Value("eval",  builtin::eval);
-    if (name == "type")  return Value("type",  builtin::get_type_name);
-    if (name == "parse") return Value("parse", builtin::parse);
-
-    // Special forms
-    if (name == "do")     return Value("do",     builtin::do_block);
-    if (name == "if")     return Value("if",     builtin::if_then_else);
-    if (name == "for")    return Value("for",    builtin::for_loop);
-    if (name == "while")  return Value("while",  builtin::while_loop);
-    if (name == "scope")  return Value("scope",  builtin::scope);
-    if (name == "quote")  return Value("quote",  builtin::quote);
-    if (name == "defun")  return Value("defun",  builtin::defun);
-    if (name == "define") return Value("define", builtin::define);
-    if (name == "lambda") return Value("lambda", builtin::lambda);
-
-    // Comparison operations
-    if (name == "=")  return Value("=",  builtin::eq);
-    if (name == "!=") return Value("!=", builtin::neq);
-    if (name == ">")  return Value(">",  builtin::greater);
-    if (name == "<")  return Value("<",  builtin::less);
-    if (name == ">=") return Value(">=", builtin::greater_eq);
-    if (name == "<=") return Value("<=", builtin::less_eq);
-
-    // Arithmetic operations
-    if (name == "+") return Value("+", builtin::sum);
-    if (name == "-") return Value("-", builtin::subtract);
-    if (name == "*") return Value("*", builtin::product);
-    if (name == "/") return Value("/", builtin::divide);
-    if (name == "%") return Value("%", builtin::remainder);
-
-    // List operations
-    if (name == "list")   return Value("list",   builtin::list);
-    if (name == "insert") return Value("insert", builtin::insert);
-    if (name == "index")  return Value("index",  builtin::index);
-    if (name == "remove") return Value("remove", builtin::remove);
-
-    if (name == "len")    return Value("len",   builtin::len);
-
-    if (name == "push")   return Value("push",  builtin::push);
-    if (name == "pop")    return Value("pop",   builtin::pop);
-    if (name == "head")   return Value("head",  builtin::head);
-    if (name == "tail")   return Value("tail",  builtin::tail);
-    if (name == "first")  return Value("first", builtin::head);
-    if (name == "last")   return Value("last",  builtin::pop);
-    if (name == "range")  return Value("range", builtin::range);
-
-    // Functional operations
-    if (name == "map")    return Value("map",    builtin::map_list);
-    if (name == "filter") return Value("filter", builtin::filter_list);
-    if (name == "reduce") return Value("reduce", builtin::reduce_list);
-
-    // IO operations
-    #ifdef USE_STD
-    if (name == "exit")       return Value("exit",       builtin::exit);
-    if (name == "quit")       return Value("quit",       builtin::exit);
-    if (name == "print")      return Value("print",      builtin::print);
-    if (name == "input")      return Value("input",      builtin::input);
-    if (name == "random")     return Value("random",     builtin::random);
-    if (name == "include")    return Value("include",    builtin::include);
-    if (name == "read-file")  return Value("read-file",  builtin::read_file);
-    if (name == "write-file") return Value("write-file", builtin::write_file);
-    #endif
+////////////////////////////////////////////////////////////////////////////////
+/// INTERPRETER ////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-    // String operations
-    if (name == "debug")   return Value("debug",   builtin::debug);
-    if (name == "replace") return Value("replace", builtin::replace);
-    if (name == "display") return Value("display", builtin::display);
-    
-    // Casting operations
-    if (name == "int")   return Value("int",   builtin::cast_to_int);
-    if (name == "float") return Value("float", builtin::cast_to_float);
+// A program that was parsed and prepared once, to be run many times
+class Program {
+public:
+    Program() {}
 
-    // Constants
-    if (name == "endl") return Value::string("\n");
-    
-    std::map<std::string, Value>::const_iterator itr = defs.find(name);
-    if (itr != defs.end()) return itr->second;
-    else if (parent_scope != NULL) {
-        itr = parent_scope->defs.find(name);
-        if (itr != parent_scope->defs.end()) return itr->second;
-        else return parent_scope->get(name);
+    friend class Interpreter;
+private:
+    Program(std::vector<Value> const &expressions) : expressions(expressions) {}
+
+    std::vector<Value> expressions;
+};
+
+// An interpreter with a global scope of its own, for embedding wisp in another
+// program. Define NO_MAIN to compile this file without `main`, and include it.
+//
+// An interpreter is used by one thread at a time, and allocates from that thread's
+// arena and draws from its random numbers. To run interpreters on several threads
+// at once, call `Interpreter::enable_threads` before the threads start. Programs
+// prepared by one interpreter can be run by another, since the functions their
+// call sites cache are only used again in the same global scope. Preparing a copy
+// for each thread keeps the threads from sharing the reference counts of its expressions.
+class Interpreter {
+public:
+    Interpreter() {}
+
+    // Parse and prepare code to run in any interpreter
+    Program compile(std::string const &code) const {
+        return Program(prepare(code.data(), code.size()));
     }
 
-    throw Error(Value::atom(name), *this, ATOM_NOT_DEFINED);
-}
+    // Run a program in the global scope, where its definitions are kept
+    Value eval(Program const &program) {
+        return run_program(program.expressions, globals);
+    }
+
+    // Run a program with some variables bound for this run only.
+    // The program's own definitions are dropped when it's done too.
+    Value eval(Program const &program, std::map<std::string, Value> const &bindings) {
+        Environment scope;
+        scope.set_parent_scope(&globals);
+        for (std::map<std::string, Value>::const_iterator i=bindings.begin(); i!=bindings.end(); i++)
+            scope.set(i->first, i->second);
+        return run_program(program.expressions, scope);
+    }
+
+    // Parse, prepare, and run code in the global scope
+    Value run(std::string const &code) {
+        return ::run(code, globals);
+    }
+
+    // Get and set global variables
+    Value get(std::string const &name) const {
+        return globals.get(name);
+    }
+    void set(std::string const &name, Value const &value) {
+        globals.set(name, value);
+    }
+
+    // Seed the random numbers of the calling thread, to make a run repeatable
+    static void seed(unsigned seed) {
+        random_numbers().reseed(seed);
+    }
+
+    // Synchronize the interpreter's shared tables and reference counts from now on,
+    // so interpreters can run on several threads. Call this before starting them.
+    // The parallel builtins then run on the calling thread, and the cycle collector
+    // doesn't run, since it can't see what other threads are doing.
+    static void enable_threads() {
+        // The builtins are set up now, before the threads could race to set them up
+        builtins();
+        #ifdef USE_STD
+        output();
+        #endif
+        workers_running = true;
+    }
+
+private:
+    Environment globals;
+};
 
+#ifndef NO_MAIN
 int main(int argc, const char **argv) {
+    #ifdef USE_STD
+    catch_crashes();
+    #endif
     Environment env;
     std::vector<Value> args;
     for (int i=0; i<argc; i++)
@@ -1802,20 +8157,51 @@ int main(int argc, const char **argv) {
     env.set("cmd-args", Value(args));
 
     #ifdef USE_STD
-    srand(time(NULL));
     try {
-        if (argc == 1 || (argc == 2 && std::string(argv[1]) == "-i"))
+        #ifdef HAS_PROFILER
+        if (argc == 3 && std::string(argv[1]) == "--profile") {
+            start_profile(PROFILE_CALLS);
+            run(read_file_contents(argv[2]), env);
+        } else if (argc == 4 && std::string(argv[1]) == "--profile-samples") {
+            profile_samples_file = argv[2];
+            start_profile(PROFILE_SAMPLES);
+            run(read_file_contents(argv[3]), env);
+        } else if (argc == 3 && std::string(argv[1]) == "--bench") {
+            // Time a file, which defines how many operations it did as `bench-ops`
+            size_t allocations = allocated_objects;
+            double start = wall_time();
+            run_file(argv[2], env);
+            double seconds = wall_time() - start;
+            int ops = 1, symbol = intern("bench-ops");
+            if (env.has(symbol)) ops = std::max(env.get(symbol).as_int(), 1);
+            flush_output();
+            report_benchmark(argv[2], seconds, allocated_objects - allocations, ops);
+        } else
+        #endif
+        if (argc == 5 && std::string(argv[1]) == "--compile" && std::string(argv[3]) == "-o") {
+            // Run the file, and save the definitions it made to an image
+            run_file(argv[2], env);
+            save_image(env, argv[4]);
+        } else if (argc == 4 && std::string(argv[1]) == "--image") {
+            // Load the definitions in an image, and then run a file with them
+            run_file(argv[2], env);
+            run_file(argv[3], env);
+        } else if (argc == 1 || (argc == 2 && std::string(argv[1]) == "-i"))
             repl(env);
         else if (argc == 3 && std::string(argv[1]) == "-c")
             run(argv[2], env);
         else if (argc == 3 && std::string(argv[1]) == "-f")
-            run(read_file_contents(argv[2]), env);
+            run_file(argv[2], env);
+        else if (argc == 3 && std::string(argv[1]) == "-b")
+            run_compiled(read_file_contents(argv[2]), env);
         else if (argc == 2)
-            run(read_file_contents(argv[1]), env);
+            run_file(argv[1], env);
         else std::cerr << "invalid arguments" << std::endl;
     } catch (Error &e) {
+        flush_output();
         std::cerr << e.description() << std::endl;
     } catch (std::runtime_error &e) {
+        flush_output();
         std::cerr << e.what() << std::endl;
     }
     #else
@@ -1823,5 +8209,7 @@ int main(int argc, const char **argv) {
         run(argv[2], env);
     #endif
 
+    tasks().wait_for_tasks();
     return 0;
 }
+#endif